@@ -30,6 +30,10 @@
 const char* g_StageName = "Stage";
 const char* g_StageDescription = "Zaber Stage";
 
+const long g_StreamNumber = 1;
+const long g_MaxSequenceLength = 10000;
+const long g_MaxStreamBuffer = 100;
+
 using namespace std;
 
 Stage::Stage() :
@@ -42,7 +46,31 @@ Stage::Stage() :
 	cmdPrefix_("/"),
 	resolution_(64),
 	motorSteps_(200),
-	linearMotion_(2.0)
+	linearMotion_(2.0),
+	positionMaxAgeMs_(20.0),
+	resyncIntervalMs_(0.0),
+	maxSpeedSteps_(0.0),
+	accelSteps_(0.0),
+	streamSequencing_(false),
+	streamSpeed_(0.0),
+	streamBuffer_(0),
+	storedSpeedData_(0),
+	streamLive_(false),
+	streamTriggerInput_(1),
+	triggerOutput_(1),
+	triggerIntervalUm_(1.0),
+	triggerCount_(0),
+	triggerArmed_(false),
+	lockstepGroup_(0),
+	lockstepSecondaryAxis_(0),
+	lockstepCreated_(false),
+	routeMs_(0.0),
+	routeSavedMs_(0.0),
+	publishPositions_(true),
+	published_(false),
+	publishedSteps_(0),
+	wasBusy_(false),
+	clampToLimits_(false)
 {
 	this->LogMessage("Stage::Stage\n", true);
 
@@ -52,6 +80,10 @@ Stage::Stage() :
 	SetErrorText(ERR_BUSY_TIMEOUT, g_Msg_BUSY_TIMEOUT);
 	SetErrorText(ERR_COMMAND_REJECTED, g_Msg_COMMAND_REJECTED);
 	SetErrorText(ERR_SETTING_FAILED, g_Msg_SETTING_FAILED);
+	SetErrorText(ERR_STREAM_SEGMENT, g_Msg_STREAM_SEGMENT);
+	SetErrorText(ERR_LOCKSTEP_GROUP, g_Msg_LOCKSTEP_GROUP);
+	SetErrorText(ERR_LOCKSTEP_STREAM, g_Msg_LOCKSTEP_STREAM);
+	SetErrorText(ERR_POSITION_OUT_OF_RANGE, g_Msg_POSITION_OUT_OF_RANGE);
 
 	// Pre-initialization properties
 	CreateProperty(MM::g_Keyword_Name, g_StageName, MM::String, true);
@@ -74,6 +106,24 @@ Stage::Stage() :
 
 	pAct = new CPropertyAction(this, &Stage::OnLinearMotion);
 	CreateFloatProperty("Linear Motion Per Motor Rev [mm]", linearMotion_, false, pAct, true);
+
+	// Stage sequences are executed in stream mode: the controller holds each
+	// position until a rising edge on the stream trigger input, then moves
+	// to it, so the whole sequence runs with no host round trip.
+	pAct = new CPropertyAction(this, &Stage::OnStreamSequencing);
+	CreateProperty("Stream Sequencing", "No", MM::String, false, pAct, true);
+	AddAllowedValue("Stream Sequencing", "No");
+	AddAllowedValue("Stream Sequencing", "Yes");
+
+	// Gantry support: with a lockstep group the axis above is the primary
+	// axis of the group, and the device moves the secondary axis with it.
+	pAct = new CPropertyAction(this, &Stage::OnLockstepGroup);
+	CreateIntegerProperty("Lockstep Group", lockstepGroup_, false, pAct, true);
+	SetPropertyLimits("Lockstep Group", 0, 9);
+
+	pAct = new CPropertyAction(this, &Stage::OnLockstepSecondaryAxis);
+	CreateIntegerProperty("Lockstep Secondary Axis", lockstepSecondaryAxis_, false, pAct, true);
+	SetPropertyLimits("Lockstep Secondary Axis", 0, 9);
 }
 
 Stage::~Stage()
@@ -112,6 +162,12 @@ int Stage::Initialize()
 		return ret;
 	}
 
+	ret = SetUpLockstep();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
 	// Calculate step size.
 	ret = GetSetting(deviceAddress_, axisNumber_, "resolution", resolution_);
 	if (ret != DEVICE_OK) 
@@ -120,6 +176,30 @@ int Stage::Initialize()
 	}
 	stepSizeUm_ = ((double)linearMotion_/(double)motorSteps_)*(1/(double)resolution_)*1000;
 
+	// Speed and acceleration for the motion model, in steps/s and steps/s^2.
+	long speedData, accelData;
+	ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = GetSetting(deviceAddress_, axisNumber_, "accel", accelData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	maxSpeedSteps_ = speedData/convFactor_;
+	accelSteps_ = accelData*10000/convFactor_;
+	motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+
+	// Travel limits, cached for checking targets before they are sent.
+	long limitMin, limitMax;
+	ret = ZaberBase::GetLimits(deviceAddress_, axisNumber_, limitMin, limitMax);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
 	CPropertyAction* pAct;
 	// Initialize Speed (in mm/s)
 	pAct = new CPropertyAction (this, &Stage::OnSpeed);
@@ -137,6 +217,154 @@ int Stage::Initialize()
 		return ret;
 	}
 
+	// Positions are read for all axes of the controller at once and shared
+	// between stages for this long, while the controller is idle.
+	pAct = new CPropertyAction (this, &Stage::OnPositionMaxAge);
+	ret = CreateFloatProperty("Position Cache Max Age [ms]", positionMaxAgeMs_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Position Cache Max Age [ms]", 0, 1000);
+
+	// While moving, positions are estimated from the move profile and only
+	// read from the device at this interval and when the move ends.
+	pAct = new CPropertyAction (this, &Stage::OnResyncInterval);
+	ret = CreateFloatProperty("Position Resync Interval [ms]", resyncIntervalMs_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Position Resync Interval [ms]", 0, 10000);
+
+	// Passes positions read from the device on to the core as they are
+	// read, and the final position once a move ends, so the GUI need not
+	// poll for them.
+	pAct = new CPropertyAction (this, &Stage::OnPublishPositions);
+	ret = CreateProperty("Publish Position Changes", "Yes", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Publish Position Changes", "No");
+	AddAllowedValue("Publish Position Changes", "Yes");
+
+	// Moves, sequence points and route points outside the travel limits are
+	// refused before anything is sent, or clamped to the nearest limit.
+	pAct = new CPropertyAction (this, &Stage::OnOutOfRangeMoves);
+	ret = CreateProperty("Out Of Range Moves", "Reject", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Out Of Range Moves", "Reject");
+	AddAllowedValue("Out Of Range Moves", "Clamp");
+
+	if (streamSequencing_)
+	{
+		pAct = new CPropertyAction (this, &Stage::OnStreamSpeed);
+		ret = CreateFloatProperty("Stream Speed [mm/s]", streamSpeed_, false, pAct);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		// A non-zero buffer stores the sequence on the controller once, and
+		// each start then replays it with a single command.
+		pAct = new CPropertyAction (this, &Stage::OnStreamBuffer);
+		ret = CreateIntegerProperty("Stream Buffer", streamBuffer_, false, pAct);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+		SetPropertyLimits("Stream Buffer", 0, g_MaxStreamBuffer);
+
+		// Digital input carrying the camera (or other) hardware trigger.
+		pAct = new CPropertyAction (this, &Stage::OnStreamTriggerInput);
+		ret = CreateIntegerProperty("Stream Trigger Input", streamTriggerInput_, false, pAct);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+		SetPropertyLimits("Stream Trigger Input", 1, 4);
+	}
+
+	// Position-based trigger: the digital output gives one pulse (a rising
+	// edge) per interval of travel, so a continuous sweep can time camera
+	// exposures directly. The count is in pulses.
+	pAct = new CPropertyAction (this, &Stage::OnTriggerOutput);
+	ret = CreateIntegerProperty("Trigger Output", triggerOutput_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Trigger Output", 1, 4);
+
+	pAct = new CPropertyAction (this, &Stage::OnTriggerInterval);
+	ret = CreateFloatProperty("Trigger Interval [um]", triggerIntervalUm_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	pAct = new CPropertyAction (this, &Stage::OnTriggerCount);
+	ret = CreateIntegerProperty("Trigger Count", triggerCount_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Trigger Count", 0, 100000);
+
+	pAct = new CPropertyAction (this, &Stage::OnTriggerArmed);
+	ret = CreateProperty("Trigger Armed", "No", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Trigger Armed", "No");
+	AddAllowedValue("Trigger Armed", "Yes");
+
+	// Route planning: setting the positions orders them for the shortest
+	// total travel time from the current position, using the speed and
+	// acceleration of each axis, and reports the order and the time saved.
+	// A point holds the position of this axis first, then of the further
+	// axes of the same controller listed in "Route Axes" (say "2" for the Y
+	// axis of an XY pair), all in um of this axis.
+	pAct = new CPropertyAction (this, &Stage::OnRouteAxes);
+	ret = CreateProperty("Route Axes", "", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	pAct = new CPropertyAction (this, &Stage::OnRoutePositions);
+	ret = CreateProperty("Route Positions [um]", "", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	pAct = new CPropertyAction (this, &Stage::OnRouteOrder);
+	ret = CreateProperty("Route Order", "", MM::String, true, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	pAct = new CPropertyAction (this, &Stage::OnRouteTime);
+	ret = CreateFloatProperty("Route Time [ms]", 0.0, true, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	pAct = new CPropertyAction (this, &Stage::OnRouteTimeSaved);
+	ret = CreateFloatProperty("Route Time Saved [ms]", 0.0, true, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
 	ret = UpdateStatus();
 	if (ret != DEVICE_OK) 
 	{
@@ -156,6 +384,13 @@ int Stage::Shutdown()
 	this->LogMessage("Stage::Shutdown\n", true);
 	if (initialized_)
 	{
+		ReleaseStream();
+		DisarmTrigger();
+		if (lockstepCreated_)
+		{
+			LockstepDisable(deviceAddress_, lockstepGroup_);
+			lockstepCreated_ = false;
+		}
 		initialized_ = false;
 	}
 	return DEVICE_OK;
@@ -164,7 +399,22 @@ int Stage::Shutdown()
 bool Stage::Busy()
 {
 	this->LogMessage("Stage::Busy\n", true);
-	return IsBusy(deviceAddress_);
+	bool busy = IsBusy(deviceAddress_);
+
+	// The move has just ended: read where it ended, which also ends the
+	// motion profile should the axis have stopped early, and publish that.
+	if (wasBusy_ && !busy)
+	{
+		long steps;
+		MM::MMTime now = GetCurrentMMTime();
+		if (GetSnapshotPosition(deviceAddress_, axisNumber_, steps, 0) == DEVICE_OK)
+		{
+			motion_.Complete(steps, now);
+			PublishPosition(steps);
+		}
+	}
+	wasBusy_ = busy;
+	return busy;
 }
 
 int Stage::GetPositionUm(double& pos)
@@ -172,7 +422,7 @@ int Stage::GetPositionUm(double& pos)
 	this->LogMessage("Stage::GetPositionUm\n", true);
 	
 	long steps;
-	int ret =  GetSetting(deviceAddress_, axisNumber_, "pos", steps);
+	int ret = GetPositionSteps(steps);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
@@ -184,7 +434,21 @@ int Stage::GetPositionUm(double& pos)
 int Stage::GetPositionSteps(long& steps)
 {
 	this->LogMessage("Stage::GetPositionSteps\n", true);
-	return GetSetting(deviceAddress_, axisNumber_, "pos", steps);
+
+	MM::MMTime now = GetCurrentMMTime();
+	if (motion_.Estimate(now, resyncIntervalMs_, steps))
+	{
+		return DEVICE_OK;
+	}
+
+	int ret = GetSnapshotPosition(deviceAddress_, axisNumber_, steps, positionMaxAgeMs_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	motion_.Sync(steps, now);
+	PublishPosition(steps);
+	return DEVICE_OK;
 }
 
 int Stage::SetPositionUm(double pos)
@@ -204,34 +468,114 @@ int Stage::SetRelativePositionUm(double d)
 int Stage::SetPositionSteps(long steps)
 {
 	this->LogMessage("Stage::SetPositionSteps\n", true);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "abs", steps);
+	int ret = LimitTarget(deviceAddress_, axisNumber_, steps, clampToLimits_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	ret = ReleaseStream();
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	MM::MMTime now = GetCurrentMMTime();
+	ret = SendStageMove("abs", steps);
+	if (ret != DEVICE_OK)
+	{
+		motion_.Invalidate();
+		return ret;
+	}
+	motion_.StartMove(steps, now);
+	return DEVICE_OK;
 }
 
 int Stage::SetRelativePositionSteps(long steps)
 {
 	this->LogMessage("Stage::SetRelativePositionSteps\n", true);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "rel", steps);
+
+	// the target can only be checked while the position is known
+	if (motion_.IsKnown())
+	{
+		long current = motion_.Target();
+		motion_.Estimate(GetCurrentMMTime(), 1e300, current);
+		long target = current + steps;
+		int ret = LimitTarget(deviceAddress_, axisNumber_, target, clampToLimits_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		steps = target - current;
+	}
+
+	int ret = ReleaseStream();
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	MM::MMTime now = GetCurrentMMTime();
+	ret = SendStageMove("rel", steps);
+	if (ret != DEVICE_OK)
+	{
+		motion_.Invalidate();
+		return ret;
+	}
+	motion_.StartRelativeMove(steps, now);
+	return DEVICE_OK;
 }
 
 int Stage::Move(double velocity)
 {
 	this->LogMessage("Stage::Move\n", true);
+	motion_.Invalidate();
+	int ret = ReleaseStream();
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
 	// convert velocity from mm/s to Zaber data value
 	long velData = nint(velocity*convFactor_*1000/stepSizeUm_);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "vel", velData);
+	return SendStageMove("vel", velData);
 }
 
 int Stage::Stop()
 {
 	this->LogMessage("Stage::Stop\n", true);
-	return ZaberBase::Stop(deviceAddress_);
+	motion_.Invalidate();
+	int ret = ZaberBase::Stop(deviceAddress_, lockstepGroup_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	return ReleaseStream();
 }
 
 int Stage::Home()
 {
 	this->LogMessage("Stage::Home\n", true);
+	motion_.Invalidate();
+	int ret = ReleaseStream();
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
 	//TODO try tools findrange first?
 	ostringstream cmd;
+	if (lockstepGroup_ > 0)
+	{
+		// Homes both axes of the group together, keeping their offset.
+		cmd << cmdPrefix_ << deviceAddress_ << " lockstep " << lockstepGroup_ << " home";
+		vector<string> resp;
+		ret = QueryCommand(cmd.str().c_str(), resp);
+		InvalidatePositionSnapshot(deviceAddress_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		return PollUntilIdle(deviceAddress_, homingTimeoutMs_);
+	}
 	cmd << cmdPrefix_ << "home";
 	return SendAndPollUntilIdle(deviceAddress_, axisNumber_, cmd.str().c_str(), homingTimeoutMs_);
 }
@@ -264,106 +608,501 @@ int Stage::GetLimits(double& lower, double& upper)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-// Handle changes and updates to property values.
+// Sequence API
+// Sequences are kept on the host and queued into a live stream on Start, or
+// stored once into a controller stream buffer and replayed from there. Each
+// position is gated on the stream trigger input, one per hardware trigger.
+// The stream stays live between starts and is released before the next
+// ordinary move.
 ///////////////////////////////////////////////////////////////////////////////
 
-int Stage::OnPort (MM::PropertyBase* pProp, MM::ActionType eAct)
+int Stage::GetStageSequenceMaxLength(long& nrEvents) const
 {
-	ostringstream os;
-	os << "Stage::OnPort(" << pProp << ", " << eAct << ")\n";
-	this->LogMessage(os.str().c_str(), false);
+	nrEvents = g_MaxSequenceLength;
+	return DEVICE_OK;
+}
 
-	if (eAct == MM::BeforeGet)
-	{
-		pProp->Set(port_.c_str());
-	}
-	else if (eAct == MM::AfterSet)
+int Stage::StartStageSequence()
+{
+	this->LogMessage("Stage::StartStageSequence\n", true);
+
+	motion_.Invalidate();
+	int ret = EnsureStreamLive();
+	if (ret == DEVICE_OK)
 	{
-		if (initialized_)
+		if (streamBuffer_ > 0)
 		{
-			// revert
-			pProp->Set(port_.c_str());
-			return ERR_PORT_CHANGE_FORBIDDEN;
+			ret = StreamCallBuffer(deviceAddress_, g_StreamNumber, streamBuffer_);
+		}
+		else
+		{
+			vector<StreamSegment> segments;
+			BuildSequenceSegments(segments);
+			for (size_t i = 0; i < segments.size() && ret == DEVICE_OK; i++)
+			{
+				ret = StreamSegmentCommand(deviceAddress_, g_StreamNumber, segments[i]);
+			}
 		}
-
-		pProp->Get(port_);
 	}
-	return DEVICE_OK;
+
+	// The stream may already have been live from an earlier start, so this
+	// is the only invalidation the positions get before the axis moves.
+	InvalidatePositionSnapshot(deviceAddress_);
+	return ret;
 }
 
-int Stage::OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct)
+int Stage::StopStageSequence()
 {
-	this->LogMessage("Stage::OnDeviceAddress\n", true);
-
-	if (eAct == MM::AfterSet)
-	{
-		pProp->Get(deviceAddress_);
+	this->LogMessage("Stage::StopStageSequence\n", true);
 
-		ostringstream cmdPrefix;
-		cmdPrefix << "/" << deviceAddress_ << " ";
-		cmdPrefix_ = cmdPrefix.str();
-	}
-	else if (eAct == MM::BeforeGet)
+	// A sequence that ran to completion leaves the stream live for the next
+	// start; an interrupted one is stopped and the stream released.
+	if (!IsBusy(deviceAddress_))
 	{
-		pProp->Set(deviceAddress_);
+		return DEVICE_OK;
 	}
-	return DEVICE_OK;
+	return Stop();
 }
 
-int Stage::OnAxisNumber (MM::PropertyBase* pProp, MM::ActionType eAct)
+int Stage::ClearStageSequence()
 {
-	this->LogMessage("Stage::OnAxisNumber\n", true);
+	sequence_.clear();
+	return DEVICE_OK;
+}
 
-	if (eAct == MM::BeforeGet)
+int Stage::AddToStageSequence(double position)
+{
+	if ((long) sequence_.size() >= g_MaxSequenceLength)
 	{
-		pProp->Set(axisNumber_);
+		return DEVICE_SEQUENCE_TOO_LARGE;
 	}
-	else if (eAct == MM::AfterSet)
+
+	long steps = nint(position/stepSizeUm_);
+	int ret = LimitTarget(deviceAddress_, axisNumber_, steps, clampToLimits_);
+	if (ret != DEVICE_OK)
 	{
-		pProp->Get(axisNumber_);
+		return ret;
 	}
+
+	sequence_.push_back(steps);
 	return DEVICE_OK;
 }
 
-int Stage::OnSpeed (MM::PropertyBase* pProp, MM::ActionType eAct)
+int Stage::SendStageSequence()
 {
-	this->LogMessage("Stage::OnSpeed\n", true);
+	this->LogMessage("Stage::SendStageSequence\n", true);
 
-	if (eAct == MM::BeforeGet)
-	{
-		long speedData;
-		int ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
-		if (ret != DEVICE_OK) 
-		{
-			return ret;
-		}
+	long speedData = nint(streamSpeed_*convFactor_*1000/stepSizeUm_);
 
-		// convert to mm/s
-		double speed = (speedData/convFactor_)*stepSizeUm_/1000;
-		pProp->Set(speed);
-	}
-	else if (eAct == MM::AfterSet)
+	// Nothing to upload ahead of time in live mode, or if the buffer
+	// already holds this sequence.
+	if (streamBuffer_ == 0 || (sequence_ == storedSequence_ && speedData == storedSpeedData_))
 	{
-		double speed;
-		pProp->Get(speed);
+		return DEVICE_OK;
+	}
 
-		// convert to data
-		long speedData = nint(speed*convFactor_*1000/stepSizeUm_);
-		if (speedData == 0 && speed != 0) speedData = 1; // Avoid clipping to 0.
+	// The stream has to be switched from live to store mode.
+	int ret = ReleaseStream();
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
 
-		int ret = SetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
-		if (ret != DEVICE_OK) 
-		{
-			return ret;
-		}
+	vector<StreamSegment> segments;
+	BuildSequenceSegments(segments);
+	storedSequence_.clear();
+	ret = StreamStoreBuffer(deviceAddress_, g_StreamNumber, streamBuffer_, 1, segments);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
 	}
+
+	storedSequence_ = sequence_;
+	storedSpeedData_ = speedData;
 	return DEVICE_OK;
 }
 
-int Stage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
+// One position per trigger: each point waits for the input to go high,
+// moves, and then waits for the input to go low again, so a long trigger
+// pulse does not let the next point through.
+void Stage::BuildSequenceSegments(vector<StreamSegment>& segments) const
 {
-	this->LogMessage("Stage::OnAccel\n", true);
+	long speedData = nint(streamSpeed_*convFactor_*1000/stepSizeUm_);
+	if (speedData == 0 && streamSpeed_ != 0) speedData = 1; // Avoid clipping to 0.
+
+	StreamSegment high;
+	high.type = StreamSegment::WaitInput;
+	high.input = streamTriggerInput_;
+	high.level = 1;
+	StreamSegment low = high;
+	low.level = 0;
+
+	segments.clear();
+	for (size_t i = 0; i < sequence_.size(); i++)
+	{
+		StreamSegment line;
+		line.target.push_back(sequence_[i]);
+		line.maxSpeed = (i == 0) ? speedData : 0;
+
+		segments.push_back(high);
+		segments.push_back(line);
+		segments.push_back(low);
+	}
+}
+
+int Stage::EnsureStreamLive()
+{
+	if (streamLive_)
+	{
+		return DEVICE_OK;
+	}
+
+	vector<long> axes(1, axisNumber_);
+	int ret = StreamSetupLive(deviceAddress_, g_StreamNumber, axes);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	streamLive_ = true;
+	return DEVICE_OK;
+}
+
+// A live stream locks its axes against normal move commands.
+int Stage::ReleaseStream()
+{
+	if (!streamLive_)
+	{
+		return DEVICE_OK;
+	}
+
+	streamLive_ = false;
+	return StreamDisable(deviceAddress_, g_StreamNumber);
+}
+
+// The device toggles the output every trigger distance, so it is given half
+// the interval, and two toggles per pulse. The output starts low, so every
+// first toggle of a pair is a rising edge.
+int Stage::ArmTrigger()
+{
+	long distance = nint(triggerIntervalUm_/(2*stepSizeUm_));
+	if (distance <= 0)
+	{
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+
+	int ret = SetDigitalOutput(deviceAddress_, triggerOutput_, false);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	ret = SetDistanceTrigger(deviceAddress_, triggerOutput_, axisNumber_, distance);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	ret = EnableDistanceTrigger(deviceAddress_, triggerOutput_, 2*triggerCount_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	triggerArmed_ = true;
+	return DEVICE_OK;
+}
+
+// Leaves the output low so the next arming starts from a known level.
+int Stage::DisarmTrigger()
+{
+	if (!triggerArmed_)
+	{
+		return DEVICE_OK;
+	}
+
+	triggerArmed_ = false;
+	int ret = DisableDistanceTrigger(deviceAddress_, triggerOutput_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	return SetDigitalOutput(deviceAddress_, triggerOutput_, false);
+}
+
+// Checks that the lockstep group has this axis as its primary axis, setting
+// the group up first if it is disabled and a secondary axis is configured.
+int Stage::SetUpLockstep()
+{
+	if (lockstepGroup_ == 0)
+	{
+		return DEVICE_OK;
+	}
+	if (streamSequencing_)
+	{
+		return ERR_LOCKSTEP_STREAM;
+	}
+
+	vector<long> axes;
+	int ret = GetLockstepAxes(deviceAddress_, lockstepGroup_, axes);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	if (axes.empty())
+	{
+		if (lockstepSecondaryAxis_ == 0 || lockstepSecondaryAxis_ == axisNumber_)
+		{
+			return ERR_LOCKSTEP_GROUP;
+		}
+		ret = LockstepSetup(deviceAddress_, lockstepGroup_, axisNumber_, lockstepSecondaryAxis_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		lockstepCreated_ = true;
+		return DEVICE_OK;
+	}
+
+	if (axes[0] != axisNumber_ || 
+		(lockstepSecondaryAxis_ != 0 && axes[1] != lockstepSecondaryAxis_))
+	{
+		return ERR_LOCKSTEP_GROUP;
+	}
+	return DEVICE_OK;
+}
+
+// Plans the route through the given points and keeps the order, its time,
+// and the time saved over visiting the points in the order given.
+int Stage::PlanRoute(const string& positions)
+{
+	vector<long> axes(1, axisNumber_);
+	istringstream axisList(routeAxes_);
+	string token;
+	while (getline(axisList, token, ','))
+	{
+		long axis = atol(token.c_str());
+		if (axis < 1 || axis > 9)
+		{
+			return DEVICE_INVALID_INPUT_PARAM;
+		}
+		axes.push_back(axis);
+	}
+
+	vector<RoutePlanner::Point> points;
+	istringstream pointList(positions);
+	while (getline(pointList, token, ';'))
+	{
+		if (token.find_first_not_of(" \t") == string::npos)
+		{
+			continue;
+		}
+		RoutePlanner::Point point;
+		istringstream coordinates(token);
+		string coordinate;
+		while (getline(coordinates, coordinate, ','))
+		{
+			point.push_back(nint(atof(coordinate.c_str())/stepSizeUm_));
+		}
+		if (point.size() != axes.size())
+		{
+			return DEVICE_INVALID_INPUT_PARAM;
+		}
+		for (size_t a = 0; a < axes.size(); a++)
+		{
+			int ret = LimitTarget(deviceAddress_, axes[a], point[a], clampToLimits_);
+			if (ret != DEVICE_OK)
+			{
+				return ret;
+			}
+		}
+		points.push_back(point);
+	}
+
+	// the speed and acceleration of each axis, and where it is now
+	vector<MotionModel> models(axes.size());
+	RoutePlanner::Point start(axes.size(), 0);
+	for (size_t a = 0; a < axes.size(); a++)
+	{
+		if (axes[a] == axisNumber_)
+		{
+			models[a].SetLimits(maxSpeedSteps_, accelSteps_);
+		}
+		else
+		{
+			long speedData, accelData;
+			int ret = GetSetting(deviceAddress_, axes[a], "maxspeed", speedData);
+			if (ret != DEVICE_OK)
+			{
+				return ret;
+			}
+			ret = GetSetting(deviceAddress_, axes[a], "accel", accelData);
+			if (ret != DEVICE_OK)
+			{
+				return ret;
+			}
+			models[a].SetLimits(speedData/convFactor_, accelData*10000/convFactor_);
+		}
+
+		int ret = GetSnapshotPosition(deviceAddress_, axes[a], start[a], positionMaxAgeMs_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+
+	RoutePlanner planner;
+	planner.SetAxes(models);
+	vector<size_t> given(points.size());
+	for (size_t i = 0; i < given.size(); i++)
+	{
+		given[i] = i;
+	}
+	double givenMs = planner.RouteMs(start, points, given);
+
+	vector<size_t> order;
+	routeMs_ = planner.Plan(start, points, order);
+	routeSavedMs_ = givenMs - routeMs_;
+
+	ostringstream os;
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		os << (i > 0 ? "," : "") << order[i];
+	}
+	routeOrder_ = os.str();
+	return DEVICE_OK;
+}
+
+// Moves this axis, or the whole lockstep group with a single command so both
+// motors of a gantry start together and finish with one reply.
+int Stage::SendStageMove(string type, long data)
+{
+	if (lockstepGroup_ > 0)
+	{
+		return SendMoveCommand(deviceAddress_, lockstepGroup_, type, data, true);
+	}
+	return SendMoveCommand(deviceAddress_, axisNumber_, type, data);
+}
+
+// Tells the core about a position read from the device, unless it is the
+// one it was told last.
+void Stage::PublishPosition(long steps)
+{
+	if (!publishPositions_ || (published_ && steps == publishedSteps_))
+	{
+		return;
+	}
+	published_ = true;
+	publishedSteps_ = steps;
+	GetCoreCallback()->OnStagePositionChanged(this, steps * stepSizeUm_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+// Handle changes and updates to property values.
+///////////////////////////////////////////////////////////////////////////////
+
+int Stage::OnPort (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ostringstream os;
+	os << "Stage::OnPort(" << pProp << ", " << eAct << ")\n";
+	this->LogMessage(os.str().c_str(), false);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(port_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (initialized_)
+		{
+			// revert
+			pProp->Set(port_.c_str());
+			return ERR_PORT_CHANGE_FORBIDDEN;
+		}
+
+		pProp->Get(port_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnDeviceAddress\n", true);
+
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(deviceAddress_);
+
+		ostringstream cmdPrefix;
+		cmdPrefix << "/" << deviceAddress_ << " ";
+		cmdPrefix_ = cmdPrefix.str();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(deviceAddress_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnAxisNumber (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnAxisNumber\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(axisNumber_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(axisNumber_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnSpeed (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSpeed\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		long speedData;
+		int ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		// convert to mm/s
+		double speed = (speedData/convFactor_)*stepSizeUm_/1000;
+		pProp->Set(speed);
+
+		maxSpeedSteps_ = speedData/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double speed;
+		pProp->Get(speed);
+
+		// convert to data
+		long speedData = nint(speed*convFactor_*1000/stepSizeUm_);
+		if (speedData == 0 && speed != 0) speedData = 1; // Avoid clipping to 0.
+
+		int ret = SetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		maxSpeedSteps_ = speedData/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnAccel\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
@@ -377,6 +1116,9 @@ int Stage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
 		// convert to m/s�
 		double accel = (accelData*10/convFactor_)*stepSizeUm_/1000;
 		pProp->Set(accel);
+
+		accelSteps_ = accelData*10000/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
 	}
 	else if (eAct == MM::AfterSet)
 	{
@@ -392,6 +1134,9 @@ int Stage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
 		{
 			return ret;
 		}
+
+		accelSteps_ = accelData*10000/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
 	}
 	return DEVICE_OK;
 }
@@ -424,4 +1169,311 @@ int Stage::OnLinearMotion(MM::PropertyBase* pProp, MM::ActionType eAct)
 		pProp->Get(linearMotion_);
 	}
 	return DEVICE_OK;
-}
\ No newline at end of file
+}
+
+int Stage::OnPositionMaxAge(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnPositionMaxAge\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(positionMaxAgeMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(positionMaxAgeMs_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnResyncInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnResyncInterval\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(resyncIntervalMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(resyncIntervalMs_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnPublishPositions(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnPublishPositions\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(publishPositions_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		publishPositions_ = (value == "Yes");
+		published_ = false;
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnOutOfRangeMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnOutOfRangeMoves\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(clampToLimits_ ? "Clamp" : "Reject");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		clampToLimits_ = (value == "Clamp");
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnStreamSequencing(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnStreamSequencing\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(streamSequencing_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		streamSequencing_ = (value == "Yes");
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnStreamSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnStreamSpeed\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(streamSpeed_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(streamSpeed_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnStreamBuffer(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnStreamBuffer\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(streamBuffer_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long buffer;
+		pProp->Get(buffer);
+		if (buffer != streamBuffer_)
+		{
+			streamBuffer_ = buffer;
+			storedSequence_.clear();
+		}
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnStreamTriggerInput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnStreamTriggerInput\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(streamTriggerInput_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long input;
+		pProp->Get(input);
+		if (input != streamTriggerInput_)
+		{
+			streamTriggerInput_ = input;
+			storedSequence_.clear(); // the stored buffer waits on the old input
+		}
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnTriggerOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnTriggerOutput\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(triggerOutput_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (triggerArmed_)
+		{
+			// revert
+			pProp->Set(triggerOutput_);
+			return DEVICE_CAN_NOT_SET_PROPERTY;
+		}
+		pProp->Get(triggerOutput_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnTriggerInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnTriggerInterval\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(triggerIntervalUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(triggerIntervalUm_);
+		if (triggerArmed_)
+		{
+			return ArmTrigger();
+		}
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnTriggerCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnTriggerCount\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(triggerCount_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(triggerCount_);
+		if (triggerArmed_)
+		{
+			return ArmTrigger();
+		}
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnTriggerArmed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnTriggerArmed\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(triggerArmed_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		if (value == "Yes")
+		{
+			return ArmTrigger();
+		}
+		return DisarmTrigger();
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnLockstepGroup(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnLockstepGroup\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(lockstepGroup_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lockstepGroup_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnLockstepSecondaryAxis(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnLockstepSecondaryAxis\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(lockstepSecondaryAxis_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lockstepSecondaryAxis_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnRouteAxes(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnRouteAxes\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(routeAxes_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(routeAxes_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnRoutePositions(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnRoutePositions\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(routePositions_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(routePositions_);
+		return PlanRoute(routePositions_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnRouteOrder(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(routeOrder_.c_str());
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnRouteTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(routeMs_);
+	}
+	return DEVICE_OK;
+}
+
+int Stage::OnRouteTimeSaved(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(routeSavedMs_);
+	}
+	return DEVICE_OK;
+}
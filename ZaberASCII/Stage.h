@@ -56,9 +56,18 @@ public:
 	int SetOrigin();
 	int GetLimits(double& lower, double& upper);
 
-	int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
+	int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = streamSequencing_; return DEVICE_OK;}
 	bool IsContinuousFocusDrive() const {return false;}
 
+	// Sequence API (stream mode)
+	// --------------------------
+	int GetStageSequenceMaxLength(long& nrEvents) const;
+	int StartStageSequence();
+	int StopStageSequence();
+	int ClearStageSequence();
+	int AddToStageSequence(double position);
+	int SendStageSequence();
+
 	// action interface
 	// ----------------
 	int OnPort          (MM::PropertyBase* pProp, MM::ActionType eAct);
@@ -68,8 +77,37 @@ public:
 	int OnLinearMotion  (MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnSpeed         (MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnAccel         (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPositionMaxAge(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnResyncInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamSequencing(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamSpeed   (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamBuffer  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamTriggerInput(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTriggerOutput (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTriggerInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTriggerCount  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTriggerArmed  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLockstepGroup (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLockstepSecondaryAxis(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRouteAxes     (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRoutePositions(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRouteOrder    (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRouteTime     (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRouteTimeSaved(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPublishPositions(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOutOfRangeMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
+	void BuildSequenceSegments(std::vector<StreamSegment>& segments) const;
+	int EnsureStreamLive();
+	int ReleaseStream();
+	int ArmTrigger();
+	int DisarmTrigger();
+	int SetUpLockstep();
+	int SendStageMove(std::string type, long data);
+	int PlanRoute(const std::string& positions);
+	void PublishPosition(long steps);
+
 	long deviceAddress_;
 	long axisNumber_;
 	int homingTimeoutMs_;
@@ -79,6 +117,36 @@ private:
 	long resolution_;
 	long motorSteps_;
 	double linearMotion_;
+	double positionMaxAgeMs_;
+	double resyncIntervalMs_; // 0 disables position estimation
+	double maxSpeedSteps_;    // steps/s
+	double accelSteps_;       // steps/s^2
+	MotionModel motion_;
+	bool streamSequencing_;
+	double streamSpeed_; // mm/s, 0 uses the axis maxspeed
+	std::vector<long> sequence_; // steps
+	long streamBuffer_; // 0 streams the sequence live on every start
+	std::vector<long> storedSequence_; // contents of streamBuffer_
+	long storedSpeedData_;
+	bool streamLive_;
+	long streamTriggerInput_; // digital input that advances the sequence
+	long triggerOutput_;
+	double triggerIntervalUm_;
+	long triggerCount_; // 0 = until disarmed
+	bool triggerArmed_;
+	long lockstepGroup_; // 0 = this axis moves alone
+	long lockstepSecondaryAxis_; // 0 = use the group as set up on the device
+	bool lockstepCreated_; // the group was set up by Initialize
+	std::string routeAxes_;      // further axes of the controller in route points
+	std::string routePositions_; // um, points separated by ';', axes by ','
+	std::string routeOrder_;     // planned order, as indices into the points
+	double routeMs_;
+	double routeSavedMs_;        // against the order given
+	bool publishPositions_; // pass positions read from the device on to the core
+	bool published_;
+	long publishedSteps_;
+	bool wasBusy_;
+	bool clampToLimits_; // out of range targets are clamped rather than refused
 };
 
 #endif //_STAGE_H_
\ No newline at end of file
@@ -30,6 +30,10 @@
 #include "XYStage.h"
 #include "Stage.h"
 #include "FilterWheel.h"
+#include "DeviceThreads.h"
+#include <algorithm>
+#include <map>
+#include <math.h>
 
 using namespace std;
 
@@ -41,6 +45,10 @@ const char* g_Msg_COMMAND_REJECTED = "The device rejected the command.";
 const char* g_Msg_NO_REFERENCE_POS = "The device has not had a reference position established.";
 const char* g_Msg_SETTING_FAILED = "The property could not be set. Is the value in the valid range?";
 const char* g_Msg_INVALID_DEVICE_NUM = "Device numbers must be in the range of 1 to 99.";
+const char* g_Msg_STREAM_SEGMENT = "The stream segment does not match the axes the stream was set up with.";
+const char* g_Msg_LOCKSTEP_GROUP = "The lockstep group is not set up with this axis as its primary axis.";
+const char* g_Msg_LOCKSTEP_STREAM = "Stream sequencing cannot be used with a lockstep group.";
+const char* g_Msg_POSITION_OUT_OF_RANGE = "The target position is outside the travel limits of the axis.";
 
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -81,6 +89,54 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Controller position snapshots
+// A multi-axis controller reports every axis in one "get pos" reply, so all
+// devices on the same port and device address share one snapshot.
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+	struct PositionSnapshot
+	{
+		PositionSnapshot() : valid(false), generation(0) {}
+
+		bool valid;
+		long generation; // advanced by every invalidation
+		MM::MMTime stamp;
+		vector<long> positions; // indexed by axis number - 1
+	};
+
+	MMThreadLock g_snapshotLock;
+	map<string, PositionSnapshot> g_snapshots;
+
+	string SnapshotKey(const string& port, long device)
+	{
+		ostringstream key;
+		key << port << "/" << device;
+		return key.str();
+	}
+
+	// One lock per port keeps devices on the same port from interleaving
+	// their commands and taking each other's replies. ASCII commands are
+	// answered at once (a move is acknowledged when it starts, not when it
+	// ends), so the lock is held for about one line time per query.
+	MMThreadLock g_portLocksLock;
+	map<string, MMThreadLock*> g_portLocks;
+
+	MMThreadLock& PortLock(const string& port)
+	{
+		MMThreadGuard guard(g_portLocksLock);
+		MMThreadLock*& lock = g_portLocks[port];
+		if (lock == 0)
+		{
+			lock = new MMThreadLock();
+		}
+		return *lock;
+	}
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // ZaberBase (convenience parent class)
 ///////////////////////////////////////////////////////////////////////////////
@@ -105,6 +161,7 @@ int ZaberBase::ClearPort() const
 {
 	core_->LogMessage(device_, "ZaberBase::ClearPort\n", true);
 
+	MMThreadGuard guard(PortLock(port_));
 	const int bufSize = 255;
 	unsigned char clear[bufSize];
 	unsigned long read = bufSize;
@@ -145,6 +202,7 @@ int ZaberBase::QueryCommand(const string command, vector<string>& reply) const
 	const size_t BUFSIZE = 2048;
 	char buf[BUFSIZE] = {'\0'};
 
+	MMThreadGuard guard(PortLock(port_));
 	int ret = SendCommand(command);
 	if (ret != DEVICE_OK) 
 	{
@@ -215,6 +273,55 @@ int ZaberBase::GetSetting(long device, long axis, string setting, long& data) co
 }
 
 
+// Reads a setting for all axes of a device with a single exchange. The
+// controller replies with one data field per axis, in axis order. idle, if
+// given, is set to whether the device reported all its axes idle.
+int ZaberBase::GetSettings(long device, string setting, vector<long>& data, bool* idle) const
+{
+	core_->LogMessage(device_, "ZaberBase::GetSettings\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " get " << setting;
+	vector<string> resp;
+
+	int ret = QueryCommand(cmd.str().c_str(), resp);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	if (idle != 0)
+	{
+		*idle = (resp[3] == "IDLE");
+	}
+	return ParseReplyData(resp, data);
+}
+
+
+// Converts the data fields of a tokenized reply (reply[5] onwards) to numbers.
+int ZaberBase::ParseReplyData(const vector<string>& reply, vector<long>& data)
+{
+	data.clear();
+	if (reply.size() < 6)
+	{
+		return DEVICE_SERIAL_INVALID_RESPONSE;
+	}
+
+	for (size_t i = 5; i < reply.size(); i++)
+	{
+		istringstream field(reply[i]);
+		long value;
+		if (!(field >> value))
+		{
+			return DEVICE_SERIAL_INVALID_RESPONSE;
+		}
+		data.push_back(value);
+	}
+
+	return DEVICE_OK;
+}
+
+
 int ZaberBase::SetSetting(long device, long axis, string setting, long data) const
 {
 	core_->LogMessage(device_, "ZaberBase::SetSetting\n", true);
@@ -229,6 +336,17 @@ int ZaberBase::SetSetting(long device, long axis, string setting, long data) con
 		return ERR_SETTING_FAILED;
 	}
 
+	// keep the cached travel limits current
+	if (setting == "limit.min" || setting == "limit.max")
+	{
+		MMThreadGuard guard(limitsLock_);
+		map<long, pair<long, long> >::iterator it = limits_.find((device << 8) | axis);
+		if (it != limits_.end())
+		{
+			(setting == "limit.min" ? it->second.first : it->second.second) = data;
+		}
+	}
+
 	return DEVICE_OK;
 }
 
@@ -254,39 +372,111 @@ bool ZaberBase::IsBusy(long device) const
 }
 
 
-int ZaberBase::Stop(long device) const
+// With a lockstep group, only the axes of the group are stopped.
+int ZaberBase::Stop(long device, long lockstepGroup) const
 {
 	core_->LogMessage(device_, "ZaberBase::Stop\n", true);
 
 	ostringstream cmd;
-	cmd << cmdPrefix_ << device << " stop";
+	if (lockstepGroup > 0)
+	{
+		cmd << cmdPrefix_ << device << " lockstep " << lockstepGroup << " stop";
+	}
+	else
+	{
+		cmd << cmdPrefix_ << device << " stop";
+	}
 	vector<string> resp;
-	return QueryCommand(cmd.str().c_str(), resp);
+	int ret = QueryCommand(cmd.str().c_str(), resp);
+	InvalidatePositionSnapshot(device);
+	return ret;
 }
 
 
+// Read from the device the first time only.
 int ZaberBase::GetLimits(long device, long axis, long& min, long& max) const
 {
 	core_->LogMessage(device_, "ZaberBase::GetLimits\n", true);
 
+	long key = (device << 8) | axis;
+	{
+		MMThreadGuard guard(limitsLock_);
+		map<long, pair<long, long> >::const_iterator it = limits_.find(key);
+		if (it != limits_.end())
+		{
+			min = it->second.first;
+			max = it->second.second;
+			return DEVICE_OK;
+		}
+	}
+
 	int ret = GetSetting(device, axis, "limit.min", min);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
+	ret = GetSetting(device, axis, "limit.max", max);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-	return GetSetting(device, axis, "limit.max", max);
+	// another thread may have stored them meanwhile, and perhaps updated
+	// them since; its entry is kept
+	MMThreadGuard guard(limitsLock_);
+	limits_.insert(make_pair(key, make_pair(min, max)));
+	return DEVICE_OK;
 }
 
 
-int ZaberBase::SendMoveCommand(long device, long axis, std::string type, long data) const
+// Checks a target against the travel limits of the axis before it is sent,
+// so an unreachable target fails without a round trip. With clamp set, the
+// target is moved to the nearest limit instead.
+int ZaberBase::LimitTarget(long device, long axis, long& steps, bool clamp) const
+{
+	long min, max;
+	int ret = GetLimits(device, axis, min, max);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	if (steps >= min && steps <= max)
+	{
+		return DEVICE_OK;
+	}
+	if (!clamp)
+	{
+		return ERR_POSITION_OUT_OF_RANGE;
+	}
+
+	ostringstream os;
+	os << "ZaberBase::LimitTarget clamped " << steps << " to [" << min << ", " << max << "]";
+	core_->LogMessage(device_, os.str().c_str(), true);
+	steps = (steps < min) ? min : max;
+	return DEVICE_OK;
+}
+
+
+// For a lockstep move, axis is the lockstep group number; the device moves
+// all axes of the group together.
+int ZaberBase::SendMoveCommand(long device, long axis, std::string type, long data, bool lockstep) const
 {
 	core_->LogMessage(device_, "ZaberBase::SendMoveCommand\n", true);
 
 	ostringstream cmd;
-	cmd << cmdPrefix_ << device << " " << axis << " move " << type << " " << data;
+	if (lockstep)
+	{
+		cmd << cmdPrefix_ << device << " lockstep " << axis << " move " << type << " " << data;
+	}
+	else
+	{
+		cmd << cmdPrefix_ << device << " " << axis << " move " << type << " " << data;
+	}
 	vector<string> resp;
-	return QueryCommand(cmd.str().c_str(), resp);
+	int ret = QueryCommand(cmd.str().c_str(), resp);
+	InvalidatePositionSnapshot(device);
+	return ret;
 }
 
 
@@ -299,11 +489,21 @@ int ZaberBase::SendAndPollUntilIdle(long device, long axis, string command, int
 	vector<string> resp;
 
 	int ret = QueryCommand(cmd.str().c_str(), resp);
+	InvalidatePositionSnapshot(device);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
 
+	return PollUntilIdle(device, timeoutMs);
+}
+
+
+// For a command already sent: waits for the device to finish it.
+int ZaberBase::PollUntilIdle(long device, int timeoutMs) const
+{
+	core_->LogMessage(device_, "ZaberBase::PollUntilIdle\n", true);
+
 	int numTries = 0, pollIntervalMs = 100;
 	do
 	{
@@ -321,4 +521,457 @@ int ZaberBase::SendAndPollUntilIdle(long device, long axis, string command, int
 	os << "Completed after " << (numTries*pollIntervalMs/1000.0) << " seconds.";
 	core_->LogMessage(device_, os.str().c_str(), true);
 	return DEVICE_OK;
-}
\ No newline at end of file
+}
+
+
+// Returns the position of one axis from the controller's shared snapshot,
+// refreshing all axes with one query if the snapshot is older than maxAgeMs.
+// The lock is not held for the query. A reading is only kept if the device
+// was idle and nothing moved it while the query was out, so a moving axis is
+// always read afresh.
+int ZaberBase::GetSnapshotPosition(long device, long axis, long& steps, double maxAgeMs) const
+{
+	core_->LogMessage(device_, "ZaberBase::GetSnapshotPosition\n", true);
+
+	string key = SnapshotKey(port_, device);
+	MM::MMTime now = core_->GetCurrentMMTime();
+	long generation;
+	{
+		MMThreadGuard guard(g_snapshotLock);
+		PositionSnapshot& snapshot = g_snapshots[key];
+		if (snapshot.valid && (now - snapshot.stamp).getMsec() <= maxAgeMs)
+		{
+			if (axis < 1 || axis > (long) snapshot.positions.size())
+			{
+				return DEVICE_SERIAL_INVALID_RESPONSE;
+			}
+			steps = snapshot.positions[axis - 1];
+			return DEVICE_OK;
+		}
+		generation = snapshot.generation;
+	}
+
+	vector<long> positions;
+	bool idle;
+	int ret = GetSettings(device, "pos", positions, &idle);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	if (idle)
+	{
+		MMThreadGuard guard(g_snapshotLock);
+		PositionSnapshot& snapshot = g_snapshots[key];
+		if (snapshot.generation == generation)
+		{
+			snapshot.valid = true;
+			snapshot.stamp = now;
+			snapshot.positions = positions;
+		}
+	}
+
+	if (axis < 1 || axis > (long) positions.size())
+	{
+		return DEVICE_SERIAL_INVALID_RESPONSE;
+	}
+	steps = positions[axis - 1];
+	return DEVICE_OK;
+}
+
+
+// Called once a command that moves an axis of the device has been sent.
+// Also discards any reading still in progress, which may predate the move.
+void ZaberBase::InvalidatePositionSnapshot(long device) const
+{
+	MMThreadGuard guard(g_snapshotLock);
+	PositionSnapshot& snapshot = g_snapshots[SnapshotKey(port_, device)];
+	snapshot.valid = false;
+	snapshot.generation++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Stream mode
+// Segments are queued on the controller and executed back-to-back, with no
+// host round trip between them.
+///////////////////////////////////////////////////////////////////////////////
+
+int ZaberBase::StreamSetupLive(long device, long stream, const vector<long>& axes) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamSetupLive\n", true);
+
+	ostringstream cmd;
+	cmd << "setup live";
+	for (size_t i = 0; i < axes.size(); i++)
+	{
+		cmd << " " << axes[i];
+	}
+
+	int ret = QueryStreamCommand(device, stream, cmd.str());
+	InvalidatePositionSnapshot(device);
+	return ret;
+}
+
+
+int ZaberBase::StreamDisable(long device, long stream) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamDisable\n", true);
+
+	return QueryStreamCommand(device, stream, "setup disable");
+}
+
+
+int ZaberBase::StreamSegmentCommand(long device, long stream, const StreamSegment& segment) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamSegmentCommand\n", true);
+
+	if (segment.maxSpeed > 0)
+	{
+		ostringstream speedCmd;
+		speedCmd << "set maxspeed " << segment.maxSpeed;
+		int ret = QueryStreamCommand(device, stream, speedCmd.str());
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+
+	ostringstream cmd;
+	const char* mode = segment.relative ? "rel" : "abs";
+	if (segment.type == StreamSegment::Line)
+	{
+		if (segment.target.empty())
+		{
+			return ERR_STREAM_SEGMENT;
+		}
+
+		cmd << "line " << mode;
+		for (size_t i = 0; i < segment.target.size(); i++)
+		{
+			cmd << " " << segment.target[i];
+		}
+	}
+	else if (segment.type == StreamSegment::WaitInput)
+	{
+		cmd << "wait io di " << segment.input << " == " << segment.level;
+	}
+	else
+	{
+		// arcs are always in the plane of exactly two axes
+		if (segment.target.size() != 2 || segment.center.size() != 2)
+		{
+			return ERR_STREAM_SEGMENT;
+		}
+
+		cmd << "arc " << mode << " " << (segment.clockwise ? "cw" : "ccw")
+			<< " " << segment.center[0] << " " << segment.center[1]
+			<< " " << segment.target[0] << " " << segment.target[1];
+	}
+
+	return QueryStreamCommand(device, stream, cmd.str());
+}
+
+
+// Records segments into a stream buffer on the controller. Stored sequences
+// are not tied to particular axes; they are replayed on whatever axes the
+// calling stream is set up with.
+int ZaberBase::StreamStoreBuffer(long device, long stream, long buffer, long axisCount, const vector<StreamSegment>& segments) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamStoreBuffer\n", true);
+
+	int ret = StreamEraseBuffer(device, buffer);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	ostringstream setup;
+	setup << "setup store " << buffer << " " << axisCount;
+	ret = QueryStreamCommand(device, stream, setup.str());
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		if (segments[i].type != StreamSegment::WaitInput && (long) segments[i].target.size() != axisCount)
+		{
+			StreamDisable(device, stream);
+			return ERR_STREAM_SEGMENT;
+		}
+
+		ret = StreamSegmentCommand(device, stream, segments[i]);
+		if (ret != DEVICE_OK)
+		{
+			StreamDisable(device, stream);
+			return ret;
+		}
+	}
+
+	// disabling the stream closes the buffer
+	return StreamDisable(device, stream);
+}
+
+
+// Replays a stored buffer. The stream must already be set up live.
+int ZaberBase::StreamCallBuffer(long device, long stream, long buffer) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamCallBuffer\n", true);
+
+	ostringstream cmd;
+	cmd << "call " << buffer;
+	int ret = QueryStreamCommand(device, stream, cmd.str());
+	InvalidatePositionSnapshot(device);
+	return ret;
+}
+
+
+int ZaberBase::StreamEraseBuffer(long device, long buffer) const
+{
+	core_->LogMessage(device_, "ZaberBase::StreamEraseBuffer\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " stream buffer " << buffer << " erase";
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+// Sends "stream <n> <command>". The controller rejects segments with AGAIN
+// while its stream queue is full, so those are retried until there is room.
+int ZaberBase::QueryStreamCommand(long device, long stream, string command) const
+{
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " stream " << stream << " " << command;
+	vector<string> resp;
+
+	const int pollIntervalMs = 10, timeoutMs = 60000;
+	int numTries = 0;
+	int ret;
+	do
+	{
+		ret = QueryCommand(cmd.str().c_str(), resp);
+		if (ret != ERR_COMMAND_REJECTED || resp.size() < 6 || resp[5] != "AGAIN")
+		{
+			return ret;
+		}
+
+		numTries++;
+		CDeviceUtils::SleepMs(pollIntervalMs);
+	}
+	while (numTries*pollIntervalMs < timeoutMs);
+
+	return ERR_BUSY_TIMEOUT;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Triggers and digital I/O
+// A distance trigger toggles the digital output of the same number each time
+// the axis has travelled the given distance, with no host involvement.
+///////////////////////////////////////////////////////////////////////////////
+
+int ZaberBase::SetDistanceTrigger(long device, long trigger, long axis, long distance) const
+{
+	core_->LogMessage(device_, "ZaberBase::SetDistanceTrigger\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " trigger dist " << trigger << " " << axis << " " << distance;
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+// A count of 0 keeps the trigger armed until it is disabled.
+int ZaberBase::EnableDistanceTrigger(long device, long trigger, long count) const
+{
+	core_->LogMessage(device_, "ZaberBase::EnableDistanceTrigger\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " trigger dist " << trigger << " enable";
+	if (count > 0)
+	{
+		cmd << " " << count;
+	}
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+int ZaberBase::DisableDistanceTrigger(long device, long trigger) const
+{
+	core_->LogMessage(device_, "ZaberBase::DisableDistanceTrigger\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " trigger dist " << trigger << " disable";
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+int ZaberBase::SetDigitalOutput(long device, long channel, bool high) const
+{
+	core_->LogMessage(device_, "ZaberBase::SetDigitalOutput\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " io set do " << channel << " " << (high ? 1 : 0);
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+// Ties two axes of a device together; the device keeps their offset when it
+// moves them. The group stays set up across power cycles.
+int ZaberBase::LockstepSetup(long device, long group, long primaryAxis, long secondaryAxis) const
+{
+	core_->LogMessage(device_, "ZaberBase::LockstepSetup\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " lockstep " << group << " setup enable " << primaryAxis << " " << secondaryAxis;
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+int ZaberBase::LockstepDisable(long device, long group) const
+{
+	core_->LogMessage(device_, "ZaberBase::LockstepDisable\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " lockstep " << group << " setup disable";
+	vector<string> resp;
+	return QueryCommand(cmd.str().c_str(), resp);
+}
+
+
+// Returns the axes of a lockstep group, primary first, or none if the group
+// is disabled. "lockstep <group> info" answers with the axes followed by
+// their offsets, or with "disabled".
+int ZaberBase::GetLockstepAxes(long device, long group, vector<long>& axes) const
+{
+	core_->LogMessage(device_, "ZaberBase::GetLockstepAxes\n", true);
+
+	ostringstream cmd;
+	cmd << cmdPrefix_ << device << " lockstep " << group << " info";
+	vector<string> resp;
+	int ret = QueryCommand(cmd.str().c_str(), resp);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	axes.clear();
+	if (resp.size() < 7 || resp[5] == "disabled")
+	{
+		return DEVICE_OK;
+	}
+	axes.push_back(atol(resp[5].c_str()));
+	axes.push_back(atol(resp[6].c_str()));
+	return DEVICE_OK;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// RoutePlanner
+///////////////////////////////////////////////////////////////////////////////
+
+double RoutePlanner::HopMs(const Point& from, const Point& to) const
+{
+	double ms = 0.0;
+	for (size_t a = 0; a < axes_.size() && a < from.size() && a < to.size(); a++)
+	{
+		double axisMs = axes_[a].MoveDurationMs(to[a] - from[a]);
+		if (axisMs > ms)
+		{
+			ms = axisMs;
+		}
+	}
+	return ms;
+}
+
+
+double RoutePlanner::RouteMs(const Point& start, const vector<Point>& points, const vector<size_t>& order) const
+{
+	double ms = 0.0;
+	const Point* at = &start;
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		ms += HopMs(*at, points[order[i]]);
+		at = &points[order[i]];
+	}
+	return ms;
+}
+
+
+// Returns the estimated time of the planned route. The route is open: it
+// starts at start and ends wherever the last point is.
+double RoutePlanner::Plan(const Point& start, const vector<Point>& points, vector<size_t>& order) const
+{
+	const size_t n = points.size();
+	order.clear();
+	if (n == 0)
+	{
+		return 0.0;
+	}
+
+	// hop times between all points; row n is the start
+	vector<double> cost((n + 1) * n);
+	for (size_t i = 0; i <= n; i++)
+	{
+		const Point& from = (i < n) ? points[i] : start;
+		for (size_t j = 0; j < n; j++)
+		{
+			cost[i * n + j] = HopMs(from, points[j]);
+		}
+	}
+
+	// nearest neighbour
+	vector<bool> visited(n, false);
+	size_t at = n;
+	for (size_t k = 0; k < n; k++)
+	{
+		size_t best = n;
+		for (size_t j = 0; j < n; j++)
+		{
+			if (!visited[j] && (best == n || cost[at * n + j] < cost[at * n + best]))
+			{
+				best = j;
+			}
+		}
+		visited[best] = true;
+		order.push_back(best);
+		at = best;
+	}
+
+	// 2-opt: reversing order[i..j] replaces the hops into order[i] and out
+	// of order[j]; hop times are symmetric, so the hops inside the reversed
+	// stretch keep their cost
+	bool improved = true;
+	for (int pass = 0; improved && pass < 100; pass++)
+	{
+		improved = false;
+		for (size_t i = 0; i + 1 < n; i++)
+		{
+			size_t before = (i == 0) ? n : order[i - 1];
+			for (size_t j = i + 1; j < n; j++)
+			{
+				double oldMs = cost[before * n + order[i]];
+				double newMs = cost[before * n + order[j]];
+				if (j + 1 < n)
+				{
+					oldMs += cost[order[j] * n + order[j + 1]];
+					newMs += cost[order[i] * n + order[j + 1]];
+				}
+				if (newMs < oldMs - 1e-9)
+				{
+					reverse(order.begin() + i, order.begin() + j + 1);
+					improved = true;
+				}
+			}
+		}
+	}
+
+	return RouteMs(start, points, order);
+}
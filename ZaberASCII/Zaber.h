@@ -25,9 +25,13 @@
 
 #include <MMDevice.h>
 #include <DeviceBase.h>
+#include <DeviceThreads.h>
 #include <ModuleInterface.h>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
+#include "../ZaberCommon/MotionModel.h"
 
 //////////////////////////////////////////////////////////////////////////////
 // Various constants: error codes, error messages
@@ -41,6 +45,10 @@
 #define	ERR_NO_REFERENCE_POS         10064
 #define	ERR_SETTING_FAILED           10128
 #define	ERR_INVALID_DEVICE_NUM       10256
+#define	ERR_STREAM_SEGMENT           10512
+#define	ERR_LOCKSTEP_GROUP           11024
+#define	ERR_LOCKSTEP_STREAM          12048
+#define	ERR_POSITION_OUT_OF_RANGE    14096
 
 extern const char* g_Msg_PORT_CHANGE_FORBIDDEN;
 extern const char* g_Msg_DRIVER_DISABLED;
@@ -50,6 +58,47 @@ extern const char* g_Msg_COMMAND_REJECTED;
 extern const char* g_Msg_NO_REFERENCE_POS;
 extern const char* g_Msg_SETTING_FAILED;
 extern const char* g_Msg_INVALID_DEVICE_NUM;
+extern const char* g_Msg_STREAM_SEGMENT;
+extern const char* g_Msg_LOCKSTEP_GROUP;
+extern const char* g_Msg_LOCKSTEP_STREAM;
+extern const char* g_Msg_POSITION_OUT_OF_RANGE;
+
+// One segment of a streamed trajectory. Coordinates are in device steps and
+// ordered like the axes the stream was set up with. A WaitInput segment
+// moves nothing; the stream holds until the digital input is at the level.
+struct StreamSegment
+{
+	enum Type { Line, Arc, WaitInput };
+
+	StreamSegment() : type(Line), relative(false), clockwise(false), maxSpeed(0), input(0), level(0) {}
+
+	Type type;
+	bool relative;
+	std::vector<long> target; // end point
+	std::vector<long> center; // arcs only
+	bool clockwise;           // arcs only
+	long maxSpeed;            // 0 keeps the current stream speed
+	long input;               // WaitInput only
+	long level;               // WaitInput only
+};
+
+// Orders a set of target points for the least total travel time, starting
+// from the current position. Axes move at the same time, so a hop takes as
+// long as its slowest axis, timed from each axis's motion profile. The
+// order is built nearest neighbour first and then improved by 2-opt.
+class RoutePlanner
+{
+public:
+	typedef std::vector<long> Point; // steps, one per axis
+
+	void SetAxes(const std::vector<MotionModel>& axes) { axes_ = axes; }
+	double HopMs(const Point& from, const Point& to) const;
+	double RouteMs(const Point& start, const std::vector<Point>& points, const std::vector<size_t>& order) const;
+	double Plan(const Point& start, const std::vector<Point>& points, std::vector<size_t>& order) const;
+
+private:
+	std::vector<MotionModel> axes_;
+};
 
 // N.B. Concrete device classes deriving ZaberBase must set core_ in
 // Initialize().
@@ -64,18 +113,45 @@ protected:
 	int SendCommand(const std::string command) const;
 	int QueryCommand(const std::string command, std::vector<std::string>& reply) const;
 	int GetSetting(long device, long axis, std::string setting, long& data) const;
+	int GetSettings(long device, std::string setting, std::vector<long>& data, bool* idle=0) const;
 	int SetSetting(long device, long axis, std::string setting, long data) const;
 	bool IsBusy(long device) const;
-	int Stop(long device) const;
+	int Stop(long device, long lockstepGroup = 0) const;
 	int GetLimits(long device, long axis, long& min, long& max) const;
-	int SendMoveCommand(long device, long axis, std::string type, long data) const;
+	int LimitTarget(long device, long axis, long& steps, bool clamp) const;
+	int SendMoveCommand(long device, long axis, std::string type, long data, bool lockstep = false) const;
 	int SendAndPollUntilIdle(long device, long axis, std::string command, int timeoutMs) const;
+	int PollUntilIdle(long device, int timeoutMs) const;
+	int GetSnapshotPosition(long device, long axis, long& steps, double maxAgeMs) const;
+	void InvalidatePositionSnapshot(long device) const;
+	static int ParseReplyData(const std::vector<std::string>& reply, std::vector<long>& data);
+	int StreamSetupLive(long device, long stream, const std::vector<long>& axes) const;
+	int StreamDisable(long device, long stream) const;
+	int StreamSegmentCommand(long device, long stream, const StreamSegment& segment) const;
+	int StreamStoreBuffer(long device, long stream, long buffer, long axisCount, const std::vector<StreamSegment>& segments) const;
+	int StreamCallBuffer(long device, long stream, long buffer) const;
+	int StreamEraseBuffer(long device, long buffer) const;
+	int QueryStreamCommand(long device, long stream, std::string command) const;
+	int SetDistanceTrigger(long device, long trigger, long axis, long distance) const;
+	int EnableDistanceTrigger(long device, long trigger, long count) const;
+	int DisableDistanceTrigger(long device, long trigger) const;
+	int SetDigitalOutput(long device, long channel, bool high) const;
+	int LockstepSetup(long device, long group, long primaryAxis, long secondaryAxis) const;
+	int LockstepDisable(long device, long group) const;
+	int GetLockstepAxes(long device, long group, std::vector<long>& axes) const;
 
 	bool initialized_;
 	std::string port_;
 	MM::Device *device_;
 	MM::Core *core_;
 	std::string cmdPrefix_;
+
+private:
+	// Travel limits in steps, by device << 8 | axis. Read once and updated
+	// when set through SetSetting, from any thread that moves or sets up the
+	// axis; the lock is never held for serial I/O.
+	mutable std::map<long, std::pair<long, long> > limits_;
+	mutable MMThreadLock limitsLock_;
 };
 
 #endif //_ZABER_H_
\ No newline at end of file
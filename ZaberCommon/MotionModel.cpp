@@ -0,0 +1,191 @@
+#include "MotionModel.h"
+#include <math.h>
+
+MotionModel::MotionModel() :
+	known_(false),
+	confirmed_(false),
+	start_(0),
+	target_(0),
+	durationMs_(0.0),
+	maxSpeed_(0.0),
+	accel_(0.0)
+{
+}
+
+
+void MotionModel::SetLimits(double maxSpeed, double accel)
+{
+	maxSpeed_ = maxSpeed;
+	accel_ = accel;
+}
+
+
+// Starts a new profile from the current (estimated) position. Without a
+// known position there is nothing to start from and the model stays unknown.
+void MotionModel::StartMove(long target, MM::MMTime now)
+{
+	if (!known_)
+	{
+		return;
+	}
+
+	long current = target_;
+	Estimate(now, 1e300, current);
+
+	start_ = current;
+	target_ = target;
+	startTime_ = now;
+	durationMs_ = MoveDurationMs(target_ - start_);
+	confirmed_ = false;
+}
+
+
+void MotionModel::StartRelativeMove(long delta, MM::MMTime now)
+{
+	long current = target_;
+	Estimate(now, 1e300, current);
+	StartMove(current + delta, now);
+}
+
+
+// Records a real position reading. Readings taken while the profile says the
+// axis is moving only reset the resync clock; once idle, two equal readings
+// in a row confirm that the axis has settled.
+void MotionModel::Sync(long steps, MM::MMTime now)
+{
+	syncTime_ = now;
+	if (known_ && IsMoving(now))
+	{
+		return;
+	}
+
+	confirmed_ = known_ && (steps == target_);
+	start_ = steps;
+	target_ = steps;
+	durationMs_ = 0.0;
+	known_ = true;
+}
+
+
+// Records the position a move ended at, from the device's own completion
+// reply (or an idle reading). Unlike Sync() it is taken even while the
+// profile says the axis should still be moving: the move ended early or
+// stopped short, and the profile is over.
+void MotionModel::Complete(long steps, MM::MMTime now)
+{
+	syncTime_ = now;
+	start_ = steps;
+	target_ = steps;
+	startTime_ = now;
+	durationMs_ = 0.0;
+	known_ = true;
+	confirmed_ = true;
+}
+
+
+// Used for moves the model cannot predict (velocity moves, homing, stops).
+void MotionModel::Invalidate()
+{
+	known_ = false;
+	confirmed_ = false;
+}
+
+
+// Returns false when a real reading is needed instead: position unknown,
+// resync interval elapsed, or a finished move not yet confirmed.
+bool MotionModel::Estimate(MM::MMTime now, double resyncIntervalMs, long& steps) const
+{
+	if (!known_ || resyncIntervalMs <= 0 || (now - syncTime_).getMsec() >= resyncIntervalMs)
+	{
+		return false;
+	}
+
+	if (IsMoving(now))
+	{
+		double distance = (double) (target_ - start_);
+		double travelled = Travelled((now - startTime_).getMsec() / 1000.0, fabs(distance));
+		steps = start_ + (long) (distance < 0 ? -travelled : travelled);
+		return true;
+	}
+
+	if (!confirmed_)
+	{
+		return false;
+	}
+
+	steps = target_;
+	return true;
+}
+
+
+bool MotionModel::IsMoving(MM::MMTime now) const
+{
+	return (now - startTime_).getMsec() < durationMs_;
+}
+
+
+double MotionModel::MoveDurationMs(long distance) const
+{
+	double d = fabs((double) distance);
+	if (maxSpeed_ <= 0 || accel_ <= 0 || d == 0)
+	{
+		return 0.0;
+	}
+
+	double tAcc = maxSpeed_ / accel_;
+	double dAcc = 0.5 * accel_ * tAcc * tAcc;
+	if (2 * dAcc >= d)
+	{
+		// never reaches full speed
+		return 2000.0 * sqrt(d / accel_);
+	}
+	return 1000.0 * (2 * tAcc + (d - 2 * dAcc) / maxSpeed_);
+}
+
+
+// Time left until the profile of the current move ends, 0 once it has.
+double MotionModel::RemainingMs(MM::MMTime now) const
+{
+	if (!known_)
+	{
+		return 0.0;
+	}
+	double remaining = durationMs_ - (now - startTime_).getMsec();
+	return remaining > 0 ? remaining : 0.0;
+}
+
+
+double MotionModel::Travelled(double elapsedS, double distance) const
+{
+	if (maxSpeed_ <= 0 || accel_ <= 0 || elapsedS <= 0)
+	{
+		return elapsedS <= 0 ? 0.0 : distance;
+	}
+
+	double tAcc = maxSpeed_ / accel_;
+	double dAcc = 0.5 * accel_ * tAcc * tAcc;
+	double vPeak = maxSpeed_;
+	if (2 * dAcc >= distance)
+	{
+		tAcc = sqrt(distance / accel_);
+		dAcc = distance / 2;
+		vPeak = accel_ * tAcc;
+	}
+	double tCruise = (distance - 2 * dAcc) / vPeak;
+
+	if (elapsedS < tAcc)
+	{
+		return 0.5 * accel_ * elapsedS * elapsedS;
+	}
+	if (elapsedS < tAcc + tCruise)
+	{
+		return dAcc + vPeak * (elapsedS - tAcc);
+	}
+
+	double remaining = 2 * tAcc + tCruise - elapsedS;
+	if (remaining <= 0)
+	{
+		return distance;
+	}
+	return distance - 0.5 * accel_ * remaining * remaining;
+}
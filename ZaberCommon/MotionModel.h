@@ -0,0 +1,42 @@
+#ifndef _ZABER_MOTION_MODEL_H_
+#define _ZABER_MOTION_MODEL_H_
+
+#include <MMDevice.h>
+
+// Trapezoidal velocity profile of the current point-to-point move. Lets the
+// adapter answer position requests during a move without a serial query.
+// Positions are in steps, speed in steps/s and acceleration in steps/s^2.
+// Shared by the ASCII and binary adapters.
+class MotionModel
+{
+public:
+	MotionModel();
+
+	void SetLimits(double maxSpeed, double accel);
+	void StartMove(long target, MM::MMTime now);
+	void StartRelativeMove(long delta, MM::MMTime now);
+	void Sync(long steps, MM::MMTime now);
+	void Complete(long steps, MM::MMTime now);
+	void Invalidate();
+	bool Estimate(MM::MMTime now, double resyncIntervalMs, long& steps) const;
+	bool IsKnown() const { return known_; }
+	long Target() const { return target_; } // only meaningful while known
+	double MoveDurationMs(long distance) const;
+	double RemainingMs(MM::MMTime now) const;
+
+private:
+	bool IsMoving(MM::MMTime now) const;
+	double Travelled(double elapsedS, double distance) const;
+
+	bool known_;
+	bool confirmed_; // the last idle reading matched the target
+	long start_;
+	long target_;
+	MM::MMTime startTime_;
+	MM::MMTime syncTime_;
+	double durationMs_;
+	double maxSpeed_;
+	double accel_;
+};
+
+#endif //_ZABER_MOTION_MODEL_H_
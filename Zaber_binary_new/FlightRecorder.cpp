@@ -0,0 +1,131 @@
+#ifdef WIN32
+#define snprintf _snprintf 
+#pragma warning(disable: 4355)
+#endif
+
+#include "FlightRecorder.h"
+#include "ZaberAtomic.h"
+#include <MMDevice.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+	// Appends value least significant byte first, whatever the host order.
+	void PutLittleEndian(vector<unsigned char>& out, unsigned long long value, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+		{
+			out.push_back((unsigned char) (value >> (8 * i)));
+		}
+	}
+
+	void PutDouble(vector<unsigned char>& out, double value)
+	{
+		unsigned long long bits;
+		memcpy(&bits, &value, sizeof(bits));
+		PutLittleEndian(out, bits, 8);
+	}
+
+	void PutFloat(vector<unsigned char>& out, float value)
+	{
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof(bits));
+		PutLittleEndian(out, bits, 4);
+	}
+}
+
+FlightRecorder::FlightRecorder() :
+	enabled_(false),
+	head_(0)
+{
+	memset(entries_, 0, sizeof(entries_));
+}
+
+
+void FlightRecorder::Record(Direction direction, const unsigned char* frame, double timeUs, double latencyUs)
+{
+	if (!enabled_)
+	{
+		return;
+	}
+
+	long slot = AtomicIncrement(&head_) - 1;
+	Entry& entry = entries_[(unsigned long) slot & (Capacity - 1)];
+
+	AtomicStore(&entry.seq, 0);
+	entry.timeUs = timeUs;
+	entry.latencyUs = (float) latencyUs;
+	entry.direction = (unsigned char) direction;
+	memcpy(entry.frame, frame, FrameLength);
+	AtomicStore(&entry.seq, slot + 1);
+}
+
+
+void FlightRecorder::Clear()
+{
+	for (unsigned long i = 0; i < Capacity; i++)
+	{
+		AtomicStore(&entries_[i].seq, 0);
+	}
+}
+
+
+// File layout, little-endian: "ZBFR", version (uint32), record count (uint32),
+// then per record: time [us] (double), latency [us] (float), direction
+// (uint8), frame (6 bytes), oldest record first.
+int FlightRecorder::Dump(const string& path) const
+{
+	long head = AtomicLoad(const_cast<volatile long*>(&head_));
+	long first = head > (long) Capacity ? head - (long) Capacity : 0;
+
+	vector<Entry> records;
+	records.reserve(head - first);
+	for (long slot = first; slot < head; slot++)
+	{
+		const Entry& entry = entries_[(unsigned long) slot & (Capacity - 1)];
+		long seq = AtomicLoad(const_cast<volatile long*>(&entry.seq));
+		if (seq != slot + 1)
+		{
+			continue;
+		}
+
+		Entry copy;
+		copy.timeUs = entry.timeUs;
+		copy.latencyUs = entry.latencyUs;
+		copy.direction = entry.direction;
+		memcpy(copy.frame, entry.frame, FrameLength);
+
+		// overwritten while copying
+		if (AtomicLoad(const_cast<volatile long*>(&entry.seq)) != seq)
+		{
+			continue;
+		}
+		records.push_back(copy);
+	}
+
+	vector<unsigned char> out;
+	out.reserve(12 + records.size() * (13 + FrameLength));
+	out.insert(out.end(), "ZBFR", "ZBFR" + 4);
+	PutLittleEndian(out, 1, 4); // version
+	PutLittleEndian(out, records.size(), 4);
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		PutDouble(out, records[i].timeUs);
+		PutFloat(out, records[i].latencyUs);
+		out.push_back(records[i].direction);
+		out.insert(out.end(), records[i].frame, records[i].frame + FrameLength);
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == 0)
+	{
+		return DEVICE_ERR;
+	}
+	bool failed = fwrite(&out[0], 1, out.size(), file) != out.size();
+	failed = (fclose(file) != 0) || failed;
+	return failed ? DEVICE_ERR : DEVICE_OK;
+}
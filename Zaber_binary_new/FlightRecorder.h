@@ -0,0 +1,43 @@
+#ifndef _ZABER_FLIGHT_RECORDER_H_
+#define _ZABER_FLIGHT_RECORDER_H_
+
+#include <string>
+
+// Fixed-size ring of the most recent frames sent and received, with MM
+// timestamps. Recording is lock-free: each writer claims a slot with one
+// atomic increment, and each slot carries a sequence number so that Dump()
+// can skip records that are being overwritten while it reads.
+class FlightRecorder
+{
+public:
+	enum Direction { Sent = 0, Received = 1 };
+
+	static const unsigned long Capacity = 4096; // power of 2
+	static const unsigned long FrameLength = 6;
+
+	FlightRecorder();
+
+	void SetEnabled(bool enabled) { enabled_ = enabled; }
+	bool IsEnabled() const { return enabled_; }
+
+	// latencyUs is the time since the matching request was sent (replies only)
+	void Record(Direction direction, const unsigned char* frame, double timeUs, double latencyUs);
+	void Clear();
+	int Dump(const std::string& path) const;
+
+private:
+	struct Entry
+	{
+		volatile long seq; // slot number + 1 once complete, 0 while writing
+		double timeUs;
+		float latencyUs;
+		unsigned char direction;
+		unsigned char frame[FrameLength];
+	};
+
+	volatile bool enabled_;
+	volatile long head_;
+	Entry entries_[Capacity];
+};
+
+#endif //_ZABER_FLIGHT_RECORDER_H_
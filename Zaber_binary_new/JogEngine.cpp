@@ -0,0 +1,169 @@
+#include "JogEngine.h"
+#include <math.h>
+
+JogEngine::JogEngine(JogOutput* output) :
+	output_(output),
+	core_(0),
+	timer_(this),
+	intervalMs_(50.0),
+	smoothingMs_(100.0),
+	active_(false),
+	tickScheduled_(false),
+	target_(0),
+	current_(0.0),
+	lastData_(0),
+	stepped_(false),
+	setpoints_(0),
+	commands_(0)
+{
+}
+
+
+void JogEngine::SetClock(MM::Core* core)
+{
+	core_ = core;
+	timer_.SetClock(core);
+}
+
+
+void JogEngine::SetUpdateInterval(double ms)
+{
+	MMThreadGuard guard(lock_);
+	intervalMs_ = ms;
+}
+
+
+void JogEngine::SetSmoothing(double ms)
+{
+	MMThreadGuard guard(lock_);
+	smoothingMs_ = ms;
+}
+
+
+// The latest setpoint wins. Zero stops the axis at once, whether a jog was
+// on or not, since a move or a home it supersedes may still be running;
+// anything else goes out now if the last command is older than the update
+// interval, or else on the next tick.
+int JogEngine::SetVelocity(long velocityData)
+{
+	MMThreadGuard guard(lock_);
+	setpoints_++;
+	target_ = velocityData;
+
+	if (velocityData == 0)
+	{
+		active_ = false;
+		current_ = 0.0;
+		lastData_ = 0;
+		commands_++;
+		return output_->SendJogStop();
+	}
+
+	if (!active_)
+	{
+		active_ = true;
+		stepped_ = false;
+		current_ = 0.0;
+		lastData_ = 0;
+	}
+	return Update(core_->GetCurrentMMTime());
+}
+
+
+// Forgets the jog without sending anything, for commands that supersede
+// it. Leaves no tick pending, and waits for a command being sent, so none
+// goes out once this returns. Returns whether a jog was on; a command of
+// it may have reached the device after anything the caller sent before.
+bool JogEngine::Cancel()
+{
+	bool wasActive;
+	{
+		MMThreadGuard guard(lock_);
+		wasActive = active_;
+		active_ = false;
+		target_ = 0;
+		current_ = 0.0;
+		lastData_ = 0;
+	}
+	timer_.Clear();
+
+	MMThreadGuard guard(lock_);
+	tickScheduled_ = false;
+	return wasActive;
+}
+
+
+void JogEngine::Stop()
+{
+	Cancel();
+	timer_.Stop();
+}
+
+
+bool JogEngine::IsJogging()
+{
+	MMThreadGuard guard(lock_);
+	return active_;
+}
+
+
+void JogEngine::OnTimer(long /*payload*/, MM::MMTime /*due*/)
+{
+	MMThreadGuard guard(lock_);
+	tickScheduled_ = false;
+	Update(core_->GetCurrentMMTime());
+}
+
+
+// Takes one smoothing step and sends the result if it changed, at most once
+// per update interval, and keeps ticking until the target is reached.
+// Called with lock_ held.
+int JogEngine::Update(MM::MMTime now)
+{
+	if (!active_)
+	{
+		return DEVICE_OK;
+	}
+
+	double sinceMs = stepped_ ? (now - lastStep_).getMsec() : intervalMs_;
+	if (sinceMs < intervalMs_)
+	{
+		if (!tickScheduled_)
+		{
+			tickScheduled_ = (timer_.Schedule(lastStep_ + MM::MMTime(intervalMs_ * 1000.0), 0) == DEVICE_OK);
+		}
+		return DEVICE_OK;
+	}
+
+	double error = target_ - current_;
+	if (smoothingMs_ > 0)
+	{
+		current_ += error * (1.0 - exp(-sinceMs / smoothingMs_));
+	}
+	else
+	{
+		current_ = target_;
+	}
+	// close enough: the last step of an exponential approach never arrives
+	if (fabs(target_ - current_) <= 1.0 || fabs(target_ - current_) < 0.01 * fabs((double) target_))
+	{
+		current_ = target_;
+	}
+	stepped_ = true;
+	lastStep_ = now;
+
+	int ret = DEVICE_OK;
+	long data = (long) floor(current_ + 0.5);
+	if (data != lastData_)
+	{
+		lastData_ = data;
+		commands_++;
+		ret = output_->SendJogVelocity(data);
+	}
+
+	if (current_ != target_ && !tickScheduled_)
+	{
+		tickScheduled_ = (timer_.Schedule(now + MM::MMTime(intervalMs_ * 1000.0), 0) == DEVICE_OK);
+	}
+	return ret;
+}
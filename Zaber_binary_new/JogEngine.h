@@ -0,0 +1,61 @@
+#ifndef _ZABER_JOG_ENGINE_H_
+#define _ZABER_JOG_ENGINE_H_
+
+#include "TimerWheel.h"
+
+// Where a JogEngine sends its commands: move at velocity (command 22, the
+// velocity as the device's data value) and stop.
+class JogOutput
+{
+public:
+	virtual ~JogOutput() {}
+	virtual int SendJogVelocity(long velocityData) = 0;
+	virtual int SendJogStop() = 0;
+};
+
+
+// Turns velocity setpoints arriving at any rate, from a joystick or key
+// repeat, into a bounded stream of velocity commands. A setpoint replaces
+// the previous one; the command sent moves towards it by exponential
+// smoothing, no more often than the update interval. Ticks between
+// setpoints come from the engine's own timer thread. Releasing (a setpoint
+// of 0) sends a stop at once.
+class JogEngine : public TimerListener
+{
+public:
+	JogEngine(JogOutput* output);
+
+	void SetClock(MM::Core* core);
+	void SetUpdateInterval(double ms);
+	void SetSmoothing(double ms);
+	int SetVelocity(long velocityData);
+	bool Cancel();
+	void Stop();
+	bool IsJogging();
+	long SetpointCount() const { return setpoints_; }
+	long CommandCount() const { return commands_; }
+
+	// TimerListener API
+	void OnTimer(long payload, MM::MMTime due);
+
+private:
+	int Update(MM::MMTime now);
+
+	JogOutput* output_;
+	MM::Core* core_;
+	TimerWheel timer_;
+	MMThreadLock lock_; // held while a command is sent, so commands go out in order
+	double intervalMs_;
+	double smoothingMs_; // time constant, 0 sends each setpoint as it is
+	bool active_;
+	bool tickScheduled_;
+	long target_;
+	double current_;     // smoothed velocity
+	long lastData_;      // velocity last sent
+	bool stepped_;       // lastStep_ is valid
+	MM::MMTime lastStep_;
+	long setpoints_;
+	long commands_;
+};
+
+#endif //_ZABER_JOG_ENGINE_H_
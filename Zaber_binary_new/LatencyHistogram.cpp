@@ -0,0 +1,127 @@
+#include "LatencyHistogram.h"
+#include "ZaberAtomic.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+
+
+void LatencyHistogram::Record(double latencyUs)
+{
+	long value = latencyUs < 0 ? 0 : (latencyUs > 2e9 ? 2000000000L : (long) latencyUs);
+
+	AtomicIncrement(&counts_[BucketIndex(value)]);
+	AtomicIncrement(&count_);
+
+	long max = AtomicLoad(&max_);
+	while (value > max && !AtomicCompareExchange(&max_, max, value))
+	{
+		max = AtomicLoad(&max_);
+	}
+}
+
+
+void LatencyHistogram::Reset()
+{
+	for (int i = 0; i < BucketCount; i++)
+	{
+		AtomicStore(&counts_[i], 0);
+	}
+	AtomicStore(&count_, 0);
+	AtomicStore(&max_, 0);
+}
+
+
+long LatencyHistogram::Count() const
+{
+	return AtomicLoad(const_cast<volatile long*>(&count_));
+}
+
+
+// Returns the upper bound of the bucket holding the given percentile (0-100).
+double LatencyHistogram::PercentileUs(double percentile) const
+{
+	long total = Count();
+	if (total == 0)
+	{
+		return 0.0;
+	}
+
+	long rank = (long) (percentile / 100.0 * total + 0.5);
+	if (rank < 1)
+	{
+		rank = 1;
+	}
+
+	long seen = 0;
+	for (int i = 0; i < BucketCount; i++)
+	{
+		seen += AtomicLoad(const_cast<volatile long*>(&counts_[i]));
+		if (seen >= rank)
+		{
+			double bound = (double) BucketUpperBound(i);
+			double max = MaxUs();
+			return bound < max ? bound : max;
+		}
+	}
+	return MaxUs();
+}
+
+
+double LatencyHistogram::MaxUs() const
+{
+	return (double) AtomicLoad(const_cast<volatile long*>(&max_));
+}
+
+
+// Bucket 0..SubBuckets-1 hold exact values; above that each octave [2^k, 2^(k+1))
+// is split into SubBuckets equal buckets.
+int LatencyHistogram::BucketIndex(long value)
+{
+	if (value < SubBuckets)
+	{
+		return (int) value;
+	}
+
+	int octave = 0;
+	while ((value >> octave) >= 2 * SubBuckets)
+	{
+		octave++;
+	}
+	int index = (octave + 1) * SubBuckets + (int) ((value >> octave) - SubBuckets);
+	return index < BucketCount ? index : BucketCount - 1;
+}
+
+
+long LatencyHistogram::BucketUpperBound(int index)
+{
+	if (index < SubBuckets)
+	{
+		return index;
+	}
+
+	int octave = index / SubBuckets - 1;
+	long mantissa = SubBuckets + index % SubBuckets;
+	return ((mantissa + 1) << octave) - 1;
+}
+
+
+ScopedLatency::ScopedLatency(MM::Core* core, LatencyHistogram& histogram) :
+	core_(core),
+	histogram_(histogram)
+{
+	if (core_ != 0)
+	{
+		start_ = core_->GetCurrentMMTime();
+	}
+}
+
+
+ScopedLatency::~ScopedLatency()
+{
+	if (core_ != 0)
+	{
+		histogram_.Record((core_->GetCurrentMMTime() - start_).getUsec());
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef _ZABER_LATENCY_HISTOGRAM_H_
+#define _ZABER_LATENCY_HISTOGRAM_H_
+
+#include <MMDevice.h>
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// SubBuckets microseconds are counted exactly, larger ones in SubBuckets
+// buckets per power of two, so percentiles are within 1/SubBuckets of the
+// true value. Recording is lock-free and may happen from any thread.
+class LatencyHistogram
+{
+public:
+	static const int SubBucketBits = 4;
+	static const long SubBuckets = 1 << SubBucketBits;
+	static const int Octaves = 28; // up to about 2^31 us
+	static const int BucketCount = SubBuckets * (Octaves + 1);
+
+	LatencyHistogram();
+
+	void Record(double latencyUs);
+	void Reset();
+	long Count() const;
+	double PercentileUs(double percentile) const;
+	double MaxUs() const;
+
+private:
+	static int BucketIndex(long value);
+	static long BucketUpperBound(int index);
+
+	volatile long counts_[BucketCount];
+	volatile long count_;
+	volatile long max_;
+};
+
+
+// Records the time from construction to destruction into a histogram.
+class ScopedLatency
+{
+public:
+	ScopedLatency(MM::Core* core, LatencyHistogram& histogram);
+	~ScopedLatency();
+
+private:
+	MM::Core* core_;
+	LatencyHistogram& histogram_;
+	MM::MMTime start_;
+};
+
+#endif //_ZABER_LATENCY_HISTOGRAM_H_
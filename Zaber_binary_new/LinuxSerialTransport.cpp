@@ -0,0 +1,214 @@
+#include "LinuxSerialTransport.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+	bool BaudConstant(long baud, speed_t& speed)
+	{
+		switch (baud)
+		{
+		case 9600: speed = B9600; return true;
+		case 19200: speed = B19200; return true;
+		case 38400: speed = B38400; return true;
+		case 57600: speed = B57600; return true;
+		case 115200: speed = B115200; return true;
+		default: return false;
+		}
+	}
+}
+#endif
+
+using namespace std;
+
+LinuxSerialTransport::LinuxSerialTransport() :
+	fd_(-1),
+	epoll_(-1)
+{
+}
+
+
+LinuxSerialTransport::~LinuxSerialTransport()
+{
+	Close();
+}
+
+
+#ifdef __linux__
+
+int LinuxSerialTransport::Open(const string& path, long baud)
+{
+	Close();
+
+	speed_t speed;
+	if (!BaudConstant(baud, speed))
+	{
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+
+	fd_ = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd_ < 0)
+	{
+		return DEVICE_NOT_CONNECTED;
+	}
+
+	// Raw 8N1. A read blocks until a full frame is in, or 100 ms after the
+	// last byte if the frame is cut short; epoll makes sure a read is only
+	// started once input is there.
+	termios tio;
+	if (tcgetattr(fd_, &tio) != 0)
+	{
+		Close();
+		return DEVICE_NOT_CONNECTED;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cc[VMIN] = 6;
+	tio.c_cc[VTIME] = 1;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(fd_, TCSANOW, &tio) != 0)
+	{
+		Close();
+		return DEVICE_NOT_CONNECTED;
+	}
+
+	// not supported by every driver (or by a pty); best effort
+	serial_struct serial;
+	if (ioctl(fd_, TIOCGSERIAL, &serial) == 0)
+	{
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd_, TIOCSSERIAL, &serial);
+	}
+
+	epoll_ = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = fd_;
+	if (epoll_ < 0 || epoll_ctl(epoll_, EPOLL_CTL_ADD, fd_, &event) != 0)
+	{
+		Close();
+		return DEVICE_NOT_CONNECTED;
+	}
+
+	tcflush(fd_, TCIOFLUSH);
+	return DEVICE_OK;
+}
+
+
+void LinuxSerialTransport::Close()
+{
+	if (epoll_ >= 0)
+	{
+		close(epoll_);
+		epoll_ = -1;
+	}
+	if (fd_ >= 0)
+	{
+		close(fd_);
+		fd_ = -1;
+	}
+}
+
+
+int LinuxSerialTransport::Write(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, const unsigned char* buf, unsigned long len)
+{
+	unsigned long written = 0;
+	while (written < len)
+	{
+		ssize_t n = write(fd_, buf + written, len - written);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return DEVICE_SERIAL_COMMAND_FAILED;
+		}
+		written += (unsigned long) n;
+	}
+	return DEVICE_OK;
+}
+
+
+// Returns what has arrived, waiting up to ReadWaitMs for the first byte.
+int LinuxSerialTransport::Read(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, unsigned char* buf, unsigned long bufLen, unsigned long& read)
+{
+	read = 0;
+	epoll_event event;
+	int ready = epoll_wait(epoll_, &event, 1, ReadWaitMs);
+	if (ready < 0)
+	{
+		return (errno == EINTR) ? DEVICE_OK : DEVICE_SERIAL_INVALID_RESPONSE;
+	}
+	if (ready == 0)
+	{
+		return DEVICE_OK;
+	}
+
+	// returns everything waiting, but no less than a frame unless the line
+	// goes quiet mid-frame
+	ssize_t n = ::read(fd_, buf, bufLen);
+	if (n < 0)
+	{
+		return (errno == EINTR || errno == EAGAIN) ? DEVICE_OK : DEVICE_SERIAL_INVALID_RESPONSE;
+	}
+	read = (unsigned long) n;
+	return DEVICE_OK;
+}
+
+
+// The core clock, so that request times compare with the devices' own
+// timestamps; a monotonic clock when run without a core.
+MM::MMTime LinuxSerialTransport::Now(MM::Core* core)
+{
+	if (core != 0)
+	{
+		return core->GetCurrentMMTime();
+	}
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return MM::MMTime((long) ts.tv_sec, (long) (ts.tv_nsec / 1000));
+}
+
+#else
+
+int LinuxSerialTransport::Open(const string& /*path*/, long /*baud*/)
+{
+	return DEVICE_NOT_SUPPORTED;
+}
+
+
+void LinuxSerialTransport::Close()
+{
+}
+
+
+int LinuxSerialTransport::Write(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, const unsigned char* /*buf*/, unsigned long /*len*/)
+{
+	return DEVICE_NOT_SUPPORTED;
+}
+
+
+int LinuxSerialTransport::Read(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, unsigned char* /*buf*/, unsigned long /*bufLen*/, unsigned long& read)
+{
+	read = 0;
+	return DEVICE_NOT_SUPPORTED;
+}
+
+
+MM::MMTime LinuxSerialTransport::Now(MM::Core* core)
+{
+	return core->GetCurrentMMTime();
+}
+
+#endif
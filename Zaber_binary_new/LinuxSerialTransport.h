@@ -0,0 +1,37 @@
+#ifndef _ZABER_LINUX_SERIAL_TRANSPORT_H_
+#define _ZABER_LINUX_SERIAL_TRANSPORT_H_
+
+#include "SerialTransport.h"
+
+// Talks to a tty directly instead of through the core's serial port, for
+// the lowest and most predictable latency on Linux. The port is put in raw
+// mode with VMIN set to one binary frame, so a read returns a whole frame
+// in one call whenever one is arriving, and the FTDI/USB driver latency
+// timer is bypassed with low_latency where the driver supports it. Reads
+// wait for input with epoll instead of sleeping between polls.
+//
+// On other platforms Open() fails with DEVICE_NOT_SUPPORTED.
+class LinuxSerialTransport: public SerialTransport
+{
+public:
+	LinuxSerialTransport();
+	~LinuxSerialTransport();
+
+	int Open(const std::string& path, long baud);
+	void Close();
+	bool IsOpen() const { return fd_ >= 0; }
+
+	int Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len);
+	int Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read);
+	MM::MMTime Now(MM::Core* core);
+	bool WaitsForInput() const { return true; }
+
+	// Longest a read waits for the first byte to arrive.
+	static const int ReadWaitMs = 2;
+
+private:
+	int fd_;
+	int epoll_;
+};
+
+#endif //_ZABER_LINUX_SERIAL_TRANSPORT_H_
@@ -0,0 +1,1077 @@
+#ifdef WIN32
+#define snprintf _snprintf 
+#pragma warning(disable: 4355)
+#endif
+
+#include "PortScheduler.h"
+#include "ZaberAtomic.h"
+#include "ZaberBinary.h"
+#include <DeviceBase.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+	MMThreadLock g_registryLock;
+	map<string, PortScheduler*> g_schedulers;
+}
+
+
+PortRequest::PortRequest() :
+	urgent(false),
+	replyFrom(0),
+	deferred(false),
+	done(false),
+	result(DEVICE_OK),
+	next(0)
+{
+	memset(frame, 0, sizeof(frame));
+	memset(reply, 0, sizeof(reply));
+}
+
+
+PortScheduler::PortScheduler(const string& port) :
+	port_(port),
+	users_(0),
+	native_(0),
+	replay_(0),
+	transport_(&coreTransport_),
+	submitted_(0),
+	flushing_(0),
+	reading_(0),
+	lastRxUs_(0.0),
+	nextMessageId_(0),
+	resyncCount_(0),
+	frameTimeUs_(0.0),
+	lineFreeUs_(0.0),
+	deviceBuffer_(4),
+	deviceIntervalUs_(1000.0),
+	queueLimit_(32),
+	maxQueueDepth_(0),
+	deferredCount_(0),
+	waitCount_(0),
+	waitTotalUs_(0.0),
+	waitMaxUs_(0.0)
+{
+	memset(messageIds_, 0, sizeof(messageIds_));
+	memset(deviceDueUs_, 0, sizeof(deviceDueUs_));
+	memset(listeners_, 0, sizeof(listeners_));
+	SetBaudRate(9600);
+}
+
+
+PortScheduler::~PortScheduler()
+{
+	transport_.Stop();
+	delete native_;
+	delete replay_;
+}
+
+
+// Returns the scheduler for a port, creating it for the first device.
+PortScheduler* PortScheduler::Acquire(const string& port)
+{
+	MMThreadGuard guard(g_registryLock);
+	PortScheduler*& scheduler = g_schedulers[port];
+	if (scheduler == 0)
+	{
+		scheduler = new PortScheduler(port);
+	}
+	scheduler->users_++;
+	return scheduler;
+}
+
+
+void PortScheduler::Release(PortScheduler* scheduler)
+{
+	if (scheduler == 0)
+	{
+		return;
+	}
+
+	MMThreadGuard guard(g_registryLock);
+	if (--scheduler->users_ == 0)
+	{
+		g_schedulers.erase(scheduler->port_);
+		delete scheduler;
+	}
+}
+
+
+void PortScheduler::SetMessageIds(long device, bool enabled)
+{
+	MMThreadGuard guard(stateLock_);
+	messageIds_[device & 0xFF] = enabled;
+}
+
+
+// Every device on the port keeps its own recorder. Once DetachRecorder
+// returns, the recorder is not written to again.
+void PortScheduler::AttachRecorder(FlightRecorder* recorder)
+{
+	MMThreadGuard guard(recorderLock_);
+	if (find(recorders_.begin(), recorders_.end(), recorder) == recorders_.end())
+	{
+		recorders_.push_back(recorder);
+	}
+}
+
+
+void PortScheduler::DetachRecorder(FlightRecorder* recorder)
+{
+	MMThreadGuard guard(recorderLock_);
+	recorders_.erase(remove(recorders_.begin(), recorders_.end(), recorder), recorders_.end());
+}
+
+
+void PortScheduler::Record(FlightRecorder::Direction direction, const unsigned char* frame, double timeUs, double latencyUs)
+{
+	MMThreadGuard guard(recorderLock_);
+	for (size_t i = 0; i < recorders_.size(); i++)
+	{
+		recorders_[i]->Record(direction, frame, timeUs, latencyUs);
+	}
+}
+
+
+// One listener per device number. Once DetachListener returns, the listener
+// is not called again.
+void PortScheduler::AttachListener(long device, PositionListener* listener)
+{
+	MMThreadGuard guard(listenerLock_);
+	listeners_[device & 0xFF] = listener;
+}
+
+
+void PortScheduler::DetachListener(long device, PositionListener* listener)
+{
+	MMThreadGuard guard(listenerLock_);
+	if (listeners_[device & 0xFF] == listener)
+	{
+		listeners_[device & 0xFF] = 0;
+	}
+}
+
+
+// A frame is 6 bytes of 10 bits each (8N1), about 6.25 ms at 9600 baud.
+void PortScheduler::SetBaudRate(long baud)
+{
+	MMThreadGuard guard(stateLock_);
+	frameTimeUs_ = (baud > 0) ? PortRequest::FrameLength * 10 * 1e6 / baud : 0.0;
+}
+
+
+// A device buffers bufferFrames frames and takes one in per
+// commandIntervalMs; an interval of 0 leaves only the line budget.
+void PortScheduler::SetDeviceBudget(long bufferFrames, double commandIntervalMs)
+{
+	MMThreadGuard guard(stateLock_);
+	deviceBuffer_ = (bufferFrames > 0) ? bufferFrames : 1;
+	deviceIntervalUs_ = commandIntervalMs * 1000.0;
+}
+
+
+void PortScheduler::SetQueueLimit(long limit)
+{
+	MMThreadGuard guard(stateLock_);
+	queueLimit_ = (limit > 0) ? (size_t) limit : 0;
+}
+
+
+long PortScheduler::QueueLimit()
+{
+	MMThreadGuard guard(stateLock_);
+	return (long) queueLimit_;
+}
+
+
+long PortScheduler::DeviceBuffer()
+{
+	MMThreadGuard guard(stateLock_);
+	return deviceBuffer_;
+}
+
+
+double PortScheduler::DeviceIntervalMs()
+{
+	MMThreadGuard guard(stateLock_);
+	return deviceIntervalUs_ / 1000.0;
+}
+
+
+void PortScheduler::GetStats(Stats& stats)
+{
+	MMThreadGuard guard(stateLock_);
+	Collect();
+	stats.queueDepth = (long) queued_.size();
+	stats.maxQueueDepth = maxQueueDepth_;
+	stats.inFlight = (long) inFlight_.size();
+	stats.deferred = deferredCount_;
+	stats.meanWaitMs = (waitCount_ > 0) ? waitTotalUs_ / waitCount_ / 1000.0 : 0.0;
+	stats.maxWaitMs = waitMaxUs_ / 1000.0;
+}
+
+
+void PortScheduler::ResetStats()
+{
+	MMThreadGuard guard(stateLock_);
+	maxQueueDepth_ = 0;
+	deferredCount_ = 0;
+	waitCount_ = 0;
+	waitTotalUs_ = 0.0;
+	waitMaxUs_ = 0.0;
+}
+
+
+// Records everything written to and read from the port, by every device on
+// it, to a session file until stopped. Starting again begins a new file.
+int PortScheduler::StartRecording(const string& path)
+{
+	int ret = transport_.Start(path, port_);
+	MMThreadGuard guard(stateLock_);
+	recordingPath_ = (ret == DEVICE_OK) ? path : "";
+	return ret;
+}
+
+
+void PortScheduler::StopRecording()
+{
+	transport_.Stop();
+	MMThreadGuard guard(stateLock_);
+	recordingPath_.clear();
+}
+
+
+string PortScheduler::RecordingPath()
+{
+	MMThreadGuard guard(stateLock_);
+	return recordingPath_;
+}
+
+
+// Plays a recorded session back in place of the port. Only possible before
+// the port has seen any traffic; the port stays in replay until the last
+// device on it is gone.
+int PortScheduler::Replay(const string& path)
+{
+	MMThreadGuard guard(writeLock_);
+	{
+		MMThreadGuard state(stateLock_);
+		Collect();
+		if (replay_ != 0 || !inFlight_.empty() || !queued_.empty())
+		{
+			return DEVICE_ERR;
+		}
+	}
+
+	ReplayTransport* replay = new ReplayTransport();
+	int ret = replay->Load(path);
+	if (ret != DEVICE_OK)
+	{
+		delete replay;
+		return ret;
+	}
+	replay_ = replay;
+	transport_.SetInner(replay_);
+	return DEVICE_OK;
+}
+
+
+// Bypasses the core and drives the tty itself (Linux only). Like Replay(),
+// only possible before the port has seen any traffic.
+int PortScheduler::UseNativePort(const string& path, long baud)
+{
+	MMThreadGuard guard(writeLock_);
+	{
+		MMThreadGuard state(stateLock_);
+		Collect();
+		if (native_ != 0 || replay_ != 0 || !inFlight_.empty() || !queued_.empty())
+		{
+			return DEVICE_ERR;
+		}
+	}
+
+	LinuxSerialTransport* native = new LinuxSerialTransport();
+	int ret = native->Open(path, baud);
+	if (ret != DEVICE_OK)
+	{
+		delete native;
+		return ret;
+	}
+	native_ = native;
+	transport_.SetInner(native_);
+	return DEVICE_OK;
+}
+
+
+// Hands a request to the scheduler: urgent requests are written at once,
+// the rest are pushed onto the submission stack and flushed.
+int PortScheduler::Submit(MM::Core* core, const MM::Device* caller, PortRequest& request)
+{
+	request.done = false;
+	request.result = DEVICE_OK;
+
+	request.deferred = false;
+	request.submitTime = transport_.Now(core);
+
+	if (request.urgent)
+	{
+		MMThreadGuard guard(writeLock_);
+		if (request.frame[1] == 23)
+		{
+			Preempt(core, request.frame[0]);
+		}
+		return Write(core, caller, request);
+	}
+
+	int ret = WaitForRoom(core, caller);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	void* head;
+	do
+	{
+		head = submitted_;
+		request.next = (PortRequest*) head;
+	} while (!AtomicCompareExchangePointer((void* volatile*) &submitted_, head, &request));
+
+	return Flush(core, caller);
+}
+
+
+// Writes a frame that no reply is expected for.
+int PortScheduler::Send(MM::Core* core, const MM::Device* caller, const unsigned char* frame)
+{
+	MMThreadGuard guard(writeLock_);
+	{
+		MMThreadGuard state(stateLock_);
+		Charge(frame[0], transport_.Now(core).getUsec());
+	}
+	int ret = transport_.Write(core, caller, port_.c_str(), frame, PortRequest::FrameLength);
+	if (ret == DEVICE_OK)
+	{
+		Record(FlightRecorder::Sent, frame, transport_.Now(core).getUsec(), 0);
+	}
+	return ret;
+}
+
+
+// Moves the submission stack to the end of the queue in submission order.
+// Called with stateLock_ held.
+void PortScheduler::Collect()
+{
+	PortRequest* request = (PortRequest*) AtomicExchangePointer((void* volatile*) &submitted_, 0);
+	size_t end = queued_.size();
+	while (request != 0)
+	{
+		queued_.insert(queued_.begin() + end, request);
+		request = request->next;
+	}
+}
+
+
+// Writes queued requests, in order, for as long as they can go out. Only one
+// caller flushes at a time; a caller that finds another one at it leaves its
+// submission to that caller, which looks at the stack again before it stops.
+int PortScheduler::Flush(MM::Core* core, const MM::Device* caller)
+{
+	while (AtomicCompareExchange(&flushing_, 0, 1))
+	{
+		for (;;)
+		{
+			MMThreadGuard guard(writeLock_);
+			PortRequest* request = 0;
+			unsigned char frame[PortRequest::FrameLength];
+			MM::MMTime sentTime;
+			{
+				MMThreadGuard state(stateLock_);
+				Collect();
+				if ((long) queued_.size() > maxQueueDepth_)
+				{
+					maxQueueDepth_ = (long) queued_.size();
+				}
+				if (!queued_.empty() && CanWrite(*queued_.front()))
+				{
+					if (WithinBudget(*queued_.front(), transport_.Now(core).getUsec()))
+					{
+						// straight into flight, so a Cancel() always finds it
+						request = queued_.front();
+						queued_.pop_front();
+						sentTime = Launch(core, *request, frame);
+					}
+					else if (!queued_.front()->deferred)
+					{
+						queued_.front()->deferred = true;
+						deferredCount_++;
+					}
+				}
+			}
+			if (request == 0)
+			{
+				break;
+			}
+			// a write error fails the request it was for
+			Transmit(core, caller, *request, frame, sentTime);
+		}
+
+		AtomicStore(&flushing_, 0);
+		if (submitted_ == 0)
+		{
+			break;
+		}
+	}
+	return DEVICE_OK;
+}
+
+
+// Puts a request in flight and writes it; called with writeLock_ held.
+int PortScheduler::Write(MM::Core* core, const MM::Device* caller, PortRequest& request)
+{
+	unsigned char frame[PortRequest::FrameLength];
+	MM::MMTime sentTime;
+	{
+		MMThreadGuard guard(stateLock_);
+		sentTime = Launch(core, request, frame);
+	}
+	return Transmit(core, caller, request, frame, sentTime);
+}
+
+
+// Puts a request in flight and copies its frame out for Transmit(). The
+// request is in flight before the write so that even an immediate reply
+// finds it, and the frame is copied so that nothing touches the request
+// outside stateLock_ once another thread can complete or cancel it.
+// Called with writeLock_ and stateLock_ held.
+MM::MMTime PortScheduler::Launch(MM::Core* core, PortRequest& request, unsigned char* frame)
+{
+	if (messageIds_[request.frame[0]])
+	{
+		// byte #6 carries the message ID instead of the top data byte
+		nextMessageId_ = (nextMessageId_ % 254) + 1;
+		request.frame[5] = nextMessageId_;
+	}
+	memcpy(frame, request.frame, PortRequest::FrameLength);
+	MM::MMTime sentTime = transport_.Now(core);
+	request.sentTime = sentTime;
+	inFlight_.push_back(&request);
+
+	Charge(frame[0], sentTime.getUsec());
+	double waitUs = (sentTime - request.submitTime).getUsec();
+	waitCount_++;
+	waitTotalUs_ += waitUs;
+	if (waitUs > waitMaxUs_)
+	{
+		waitMaxUs_ = waitUs;
+	}
+	return sentTime;
+}
+
+
+// Writes the frame of a request put in flight by Launch(). The request is
+// only passed on to Fail(), which checks that it is still in flight.
+// Called with writeLock_ held.
+int PortScheduler::Transmit(MM::Core* core, const MM::Device* caller, PortRequest& request, const unsigned char* frame, MM::MMTime sentTime)
+{
+	int ret = transport_.Write(core, caller, port_.c_str(), frame, PortRequest::FrameLength);
+	if (ret != DEVICE_OK)
+	{
+		Fail(core, request, ret);
+		return ret;
+	}
+
+	Record(FlightRecorder::Sent, frame, sentTime.getUsec(), 0);
+	return DEVICE_OK;
+}
+
+
+// Completes a request with an error, unless it has been completed or
+// cancelled in the meantime.
+void PortScheduler::Fail(MM::Core* core, PortRequest& request, int result)
+{
+	MMThreadGuard guard(stateLock_);
+	list<PortRequest*>::iterator it = find(inFlight_.begin(), inFlight_.end(), &request);
+	if (it != inFlight_.end())
+	{
+		inFlight_.erase(it);
+		request.result = result;
+		request.doneTime = transport_.Now(core);
+		request.done = true;
+	}
+}
+
+
+// With message IDs every reply is unambiguous. Without them, a request has
+// to wait while one to the same device that is answered by the same command
+// number is in flight. Moves are the exception: a newer move supersedes the
+// older one on the device.
+bool PortScheduler::CanWrite(const PortRequest& request) const
+{
+	if (messageIds_[request.frame[0]])
+	{
+		return true;
+	}
+
+	for (list<PortRequest*>::const_iterator it = inFlight_.begin(); it != inFlight_.end(); it++)
+	{
+		const PortRequest* other = *it;
+		bool sameDevice = other->frame[0] == request.frame[0] || other->frame[0] == 0 || request.frame[0] == 0;
+		if (sameDevice && ExpectedReply(*other) == ExpectedReply(request)
+			&& !(IsMoveCommand(other->frame[1]) && IsMoveCommand(request.frame[1])))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Holds a submitter back while the queue is full, draining it meanwhile, so
+// a burst is paced by the line rather than piling up. Gives up with
+// DEVICE_BUFFER_OVERFLOW if the queue does not move.
+int PortScheduler::WaitForRoom(MM::Core* core, const MM::Device* caller)
+{
+	const double limitMs = 2000.0;
+	MM::MMTime start = transport_.Now(core);
+	for (;;)
+	{
+		{
+			MMThreadGuard guard(stateLock_);
+			Collect();
+			if (queueLimit_ == 0 || queued_.size() < queueLimit_)
+			{
+				return DEVICE_OK;
+			}
+		}
+
+		if ((transport_.Now(core) - start).getMsec() > limitMs)
+		{
+			return DEVICE_BUFFER_OVERFLOW;
+		}
+		bool waited;
+		int ret = Poll(core, caller, waited);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		if (!waited)
+		{
+			CDeviceUtils::SleepMs(1);
+		}
+	}
+}
+
+
+// A request may go out if the line has at most one frame left to send and
+// the device (every device, for a broadcast) has buffer room for it.
+// Called with stateLock_ held.
+bool PortScheduler::WithinBudget(const PortRequest& request, double nowUs) const
+{
+	if (lineFreeUs_ - nowUs > frameTimeUs_)
+	{
+		return false;
+	}
+	if (deviceIntervalUs_ <= 0)
+	{
+		return true;
+	}
+
+	double backlogUs = (deviceBuffer_ - 1) * deviceIntervalUs_;
+	unsigned char device = request.frame[0];
+	if (device != 0)
+	{
+		return deviceDueUs_[device] - nowUs <= backlogUs;
+	}
+	for (int d = 1; d < 256; d++)
+	{
+		if (deviceDueUs_[d] - nowUs > backlogUs)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Accounts for a frame written now. Called with stateLock_ held.
+void PortScheduler::Charge(unsigned char device, double nowUs)
+{
+	lineFreeUs_ = ((lineFreeUs_ > nowUs) ? lineFreeUs_ : nowUs) + frameTimeUs_;
+
+	// the device has the frame once it is off the line
+	if (device != 0)
+	{
+		double& due = deviceDueUs_[device];
+		due = ((due > lineFreeUs_) ? due : lineFreeUs_) + deviceIntervalUs_;
+	}
+	else
+	{
+		for (int d = 1; d < 256; d++)
+		{
+			double& due = deviceDueUs_[d];
+			due = ((due > lineFreeUs_) ? due : lineFreeUs_) + deviceIntervalUs_;
+		}
+	}
+}
+
+
+// Completes the moves still queued for a device that is being stopped.
+void PortScheduler::Preempt(MM::Core* core, unsigned char device)
+{
+	MMThreadGuard guard(stateLock_);
+	Collect();
+
+	deque<PortRequest*>::iterator it = queued_.begin();
+	while (it != queued_.end())
+	{
+		PortRequest* request = *it;
+		if ((device == 0 || request->frame[0] == device) && IsMoveCommand(request->frame[1]))
+		{
+			it = queued_.erase(it);
+			request->result = ERR_COMMAND_PREEMPTED;
+			request->doneTime = transport_.Now(core);
+			request->done = true;
+		}
+		else
+		{
+			it++;
+		}
+	}
+}
+
+
+// Reads whatever has arrived and completes the requests it answers. If
+// another caller is reading already, it does the matching for this one too.
+int PortScheduler::Poll(MM::Core* core, const MM::Device* caller)
+{
+	bool waited;
+	return Poll(core, caller, waited);
+}
+
+
+// As above; waited tells whether this caller read the port, and so already
+// spent the transport's read wait. A caller that lost the race to read
+// returns at once and must back off by itself.
+int PortScheduler::Poll(MM::Core* core, const MM::Device* caller, bool& waited)
+{
+	waited = false;
+	Flush(core, caller);
+
+	if (!AtomicCompareExchange(&reading_, 0, 1))
+	{
+		return DEVICE_OK;
+	}
+	waited = transport_.WaitsForInput();
+
+	unsigned char buf[64];
+	unsigned long read = 0;
+	int ret = transport_.Read(core, caller, port_.c_str(), buf, sizeof(buf), read);
+	if (ret == DEVICE_OK && read == 0)
+	{
+		MMThreadGuard guard(stateLock_);
+		if (!rxBuffer_.empty() && transport_.Now(core).getUsec() - lastRxUs_ > PartialFrameSilenceUs())
+		{
+			// devices send a frame without pauses, so the rest of it is lost
+			AtomicAdd(&resyncCount_, (long) rxBuffer_.size());
+			rxBuffer_.clear();
+			Log(core, caller, "PortScheduler::Poll dropped a partial frame after the line went quiet");
+		}
+	}
+	else if (ret == DEVICE_OK)
+	{
+		MMThreadGuard guard(stateLock_);
+		rxBuffer_.insert(rxBuffer_.end(), buf, buf + read);
+		lastRxUs_ = transport_.Now(core).getUsec();
+
+		while (rxBuffer_.size() >= PortRequest::FrameLength)
+		{
+			const unsigned char* candidate = &rxBuffer_[0];
+			if (IsPlausibleReply(candidate) && Dispatch(core, caller, candidate))
+			{
+				rxBuffer_.erase(rxBuffer_.begin(), rxBuffer_.begin() + PortRequest::FrameLength);
+			}
+			else
+			{
+				rxBuffer_.erase(rxBuffer_.begin());
+				AtomicIncrement(&resyncCount_);
+				Log(core, caller, "PortScheduler::Poll dropped a byte to realign frames");
+			}
+		}
+	}
+	AtomicStore(&reading_, 0);
+
+	DeliverReports(core, caller);
+
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	// replies may have unblocked queued requests
+	return Flush(core, caller);
+}
+
+
+// Polls until the request is done or the timeout expires. On timeout the
+// request is withdrawn, so a late reply is treated as stale.
+int PortScheduler::Wait(MM::Core* core, const MM::Device* caller, PortRequest& request, double timeoutMs)
+{
+	MM::MMTime start = transport_.Now(core);
+	MM::MMTime deadline = start + MM::MMTime(timeoutMs * 1000.0);
+	while (!request.done)
+	{
+		MM::MMTime now = transport_.Now(core);
+		if (now > deadline)
+		{
+			Cancel(request);
+			return request.done ? request.result : DEVICE_SERIAL_INVALID_RESPONSE;
+		}
+
+		bool waited;
+		int ret = Poll(core, caller, waited);
+		if (ret != DEVICE_OK)
+		{
+			Cancel(request);
+			return ret;
+		}
+
+		// replies to short commands arrive within a few frame times; only
+		// back off for the long waits. A caller whose read blocked on the
+		// port has waited already, but one that found another thread
+		// reading would otherwise spin.
+		bool spinning = transport_.WaitsForInput() || (now - start).getMsec() > 20;
+		if (!request.done && !waited && spinning)
+		{
+			CDeviceUtils::SleepMs(1);
+		}
+	}
+	return request.result;
+}
+
+
+// Withdraws a request wherever it is. Once this returns, the scheduler no
+// longer refers to it.
+void PortScheduler::Cancel(PortRequest& request)
+{
+	MMThreadGuard guard(stateLock_);
+	Collect();
+	list<PortRequest*>::iterator sent = find(inFlight_.begin(), inFlight_.end(), &request);
+	if (sent != inFlight_.end())
+	{
+		inFlight_.erase(sent);
+		Withdraw(request);
+	}
+	deque<PortRequest*>::iterator it = find(queued_.begin(), queued_.end(), &request);
+	if (it != queued_.end())
+	{
+		queued_.erase(it);
+	}
+}
+
+
+// Drains the port until a read comes back empty. Skipped while another
+// device on the port has requests outstanding, since their replies would be
+// drained too.
+int PortScheduler::Clear(MM::Core* core, const MM::Device* caller)
+{
+	if (!AtomicCompareExchange(&reading_, 0, 1))
+	{
+		return DEVICE_OK;
+	}
+
+	int ret = DEVICE_OK;
+	bool idle;
+	{
+		MMThreadGuard guard(stateLock_);
+		Collect();
+		idle = inFlight_.empty() && queued_.empty();
+		if (idle)
+		{
+			rxBuffer_.clear();
+		}
+	}
+
+	if (idle)
+	{
+		const int bufSize = 255;
+		unsigned char clear[bufSize];
+		unsigned long read = bufSize;
+		while (read > 0)
+		{
+			ret = transport_.Read(core, caller, port_.c_str(), clear, bufSize, read);
+			if (ret != DEVICE_OK) 
+			{
+				break;
+			}
+		}
+	}
+
+	AtomicStore(&reading_, 0);
+	return ret;
+}
+
+
+// Completes the oldest request the reply answers. A device drops a move when
+// a newer move or a stop arrives and only answers the last one, so a move
+// reply also completes every older move in flight to the same device.
+// Returns false if the frame answers nothing, which means it is misaligned.
+// Called with stateLock_ held.
+bool PortScheduler::Dispatch(MM::Core* core, const MM::Device* caller, const unsigned char* candidate)
+{
+	list<PortRequest*>::iterator match = inFlight_.begin();
+	while (match != inFlight_.end() && !Matches(**match, candidate))
+	{
+		match++;
+	}
+
+	// devices send tracking replies with message ID 0
+	bool tracking = (candidate[1] == 8 || candidate[1] == 10) && (!messageIds_[candidate[0]] || candidate[5] == 0);
+	deque<PortRequest>::iterator stale = withdrawn_.begin();
+	if (match == inFlight_.end() && !tracking)
+	{
+		while (stale != withdrawn_.end() && !Matches(*stale, candidate))
+		{
+			stale++;
+		}
+		if (stale == withdrawn_.end() && !AnswersBroadcast(candidate))
+		{
+			return false;
+		}
+	}
+
+	double latencyUs = (match != inFlight_.end()) ? (transport_.Now(core) - (*match)->sentTime).getUsec() : 0;
+	Record(FlightRecorder::Received, candidate, transport_.Now(core).getUsec(), latencyUs);
+
+	if (match == inFlight_.end() && tracking)
+	{
+		// move tracking or manual move tracking; handed to the device's
+		// listener once the locks are released
+		PositionReport report;
+		memcpy(report.reply, candidate, PortRequest::FrameLength);
+		if (messageIds_[candidate[0]])
+		{
+			report.reply[5] = (report.reply[4] & 0x80) ? 255 : 0;
+		}
+		report.time = transport_.Now(core);
+		reports_.push_back(report);
+		return true;
+	}
+
+	if (match == inFlight_.end())
+	{
+		// the late reply to a request that timed out or was withdrawn, or
+		// another device's reply to a broadcast
+		ostringstream os;
+		os << "PortScheduler::Dispatch skipping reply from device " << (int) candidate[0]
+			<< " command " << (int) candidate[1];
+		Log(core, caller, os.str().c_str());
+		if (stale != withdrawn_.end() && stale->frame[0] != 0)
+		{
+			withdrawn_.erase(stale);
+		}
+		return true;
+	}
+
+	if (IsMoveCommand(candidate[1]))
+	{
+		list<PortRequest*>::iterator it = inFlight_.begin();
+		while (it != match)
+		{
+			PortRequest* superseded = *it++;
+			if (ReplyDevice(*superseded) == candidate[0] && IsMoveCommand(superseded->frame[1]))
+			{
+				Finish(core, *superseded, candidate);
+			}
+		}
+	}
+
+	if ((*match)->frame[0] == 0)
+	{
+		// the other devices answer a broadcast too
+		Withdraw(**match);
+	}
+	Finish(core, **match, candidate);
+	return true;
+}
+
+
+// Whether the reply is one a device other than the awaited one sends to a
+// broadcast in flight. Called with stateLock_ held.
+bool PortScheduler::AnswersBroadcast(const unsigned char* candidate) const
+{
+	for (list<PortRequest*>::const_iterator it = inFlight_.begin(); it != inFlight_.end(); it++)
+	{
+		if ((*it)->frame[0] == 0)
+		{
+			PortRequest any = **it;
+			any.replyFrom = 0;
+			if (Matches(any, candidate))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+// Keeps a copy of a request whose replies are no longer awaited, so that
+// they are still recognised and skipped whole. Every device answers a
+// broadcast, so its copy matches any of them until it ages out.
+// Called with stateLock_ held.
+void PortScheduler::Withdraw(const PortRequest& request)
+{
+	withdrawn_.push_back(request);
+	if (request.frame[0] == 0)
+	{
+		withdrawn_.back().replyFrom = 0;
+	}
+	if (withdrawn_.size() > WithdrawnLimit)
+	{
+		withdrawn_.pop_front();
+	}
+}
+
+
+// Hands the tracking replies collected by Dispatch to their listeners. Runs
+// without stateLock_, so a listener may call back into the scheduler.
+void PortScheduler::DeliverReports(MM::Core* core, const MM::Device* caller)
+{
+	vector<PositionReport> reports;
+	{
+		MMThreadGuard guard(stateLock_);
+		if (reports_.empty())
+		{
+			return;
+		}
+		reports.swap(reports_);
+	}
+
+	MMThreadGuard guard(listenerLock_);
+	for (size_t i = 0; i < reports.size(); i++)
+	{
+		PositionListener* listener = listeners_[reports[i].reply[0]];
+		if (listener != 0)
+		{
+			listener->OnPositionReport(reports[i].reply, reports[i].time);
+		}
+		else
+		{
+			ostringstream os;
+			os << "PortScheduler::DeliverReports no listener for device " << (int) reports[i].reply[0];
+			Log(core, caller, os.str().c_str());
+		}
+	}
+}
+
+
+// The request belongs to its caller again as soon as done is set, so that
+// comes last.
+void PortScheduler::Finish(MM::Core* core, PortRequest& request, const unsigned char* candidate)
+{
+	memcpy(request.reply, candidate, PortRequest::FrameLength);
+	if (messageIds_[candidate[0]])
+	{
+		// strip the message ID: sign-extend the 24-bit data back to 32 bits
+		request.reply[5] = (request.reply[4] & 0x80) ? 255 : 0;
+	}
+
+	inFlight_.remove(&request);
+	request.doneTime = transport_.Now(core);
+	request.result = DEVICE_OK;
+	request.done = true;
+}
+
+
+// A reply answers a request if it comes from the addressed device (for a
+// broadcast, the device named in replyFrom or any device), carries the command number the request is
+// answered with or the error code 255, and echoes the message ID when IDs
+// are enabled.
+bool PortScheduler::Matches(const PortRequest& request, const unsigned char* candidate) const
+{
+	unsigned char device = ReplyDevice(request);
+	if (device != 0 && candidate[0] != device)
+	{
+		return false;
+	}
+
+	if (messageIds_[candidate[0]])
+	{
+		return candidate[5] == request.frame[5];
+	}
+
+	return candidate[1] == ExpectedReply(request) || candidate[1] == 255;
+}
+
+
+// "Return Setting" is answered with the number of the setting returned;
+// everything else with its own command number.
+unsigned char PortScheduler::ExpectedReply(const PortRequest& request)
+{
+	return (request.frame[1] == 53) ? request.frame[2] : request.frame[1];
+}
+
+
+// The device a reply to the request comes from, or 0 for any device.
+unsigned char PortScheduler::ReplyDevice(const PortRequest& request)
+{
+	return (request.frame[0] != 0) ? request.frame[0] : request.replyFrom;
+}
+
+
+// Checks a frame against the values a device can actually send: a device
+// number in the valid range and a known reply command number.
+bool PortScheduler::IsPlausibleReply(const unsigned char* candidate)
+{
+	static const unsigned char replyCommands[] = {
+		0, 1, 2, 8, 9, 10, 11, 13, 14, 16, 17, 18, 20, 21, 22, 23, 35, 36, 37, 40, 41, 42, 43, 44,
+		45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 60, 63, 64, 65, 66, 78, 79, 80, 101, 102,
+		103, 104, 105, 106, 111, 112, 113, 114, 115, 116, 117, 123, 124, 125, 126, 127, 255
+	};
+
+	if (candidate[0] < 1 || candidate[0] > 99)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof(replyCommands); i++)
+	{
+		if (candidate[1] == replyCommands[i])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// How long the line may be quiet before a partial frame is given up: a
+// frame time, but no less than the 16 ms a USB serial adapter may hold
+// received bytes back for. Called with stateLock_ held.
+double PortScheduler::PartialFrameSilenceUs() const
+{
+	const double usbLatencyUs = 16000.0;
+	return (frameTimeUs_ > usbLatencyUs) ? frameTimeUs_ : usbLatencyUs;
+}
+
+
+// Home, move to stored position, move absolute/relative/at velocity, stop.
+bool PortScheduler::IsMoveCommand(unsigned char command)
+{
+	return command == 1 || command == 18 || command == 20 || command == 21 || command == 22 || command == 23;
+}
+
+
+// A replay can run without a core.
+void PortScheduler::Log(MM::Core* core, const MM::Device* caller, const char* message) const
+{
+	if (core != 0)
+	{
+		core->LogMessage(caller, message, true);
+	}
+}
@@ -0,0 +1,216 @@
+#ifndef _ZABER_PORT_SCHEDULER_H_
+#define _ZABER_PORT_SCHEDULER_H_
+
+#include <MMDevice.h>
+#include <DeviceThreads.h>
+#include "FlightRecorder.h"
+#include "SerialTransport.h"
+#include "LinuxSerialTransport.h"
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+// Receives the tracking replies a device sends on its own: move tracking
+// (command 8) and manual move tracking when the knob is turned (command 10).
+// Called after the scheduler has released its locks, from whichever thread
+// read the reply.
+class PositionListener
+{
+public:
+	virtual ~PositionListener() {}
+	virtual void OnPositionReport(const unsigned char* reply, MM::MMTime time) = 0;
+};
+
+// One request on the wire. The caller owns it and must keep it alive until
+// it is done or cancelled.
+struct PortRequest
+{
+	static const unsigned long FrameLength = 6;
+
+	PortRequest();
+
+	unsigned char frame[FrameLength];
+	unsigned char reply[FrameLength];
+	bool urgent; // written at once, ahead of queued requests
+	unsigned char replyFrom; // for a broadcast: the device whose reply completes it, 0 for any
+	bool deferred; // held back by the bandwidth budget at least once
+	volatile bool done;
+	int result;
+	MM::MMTime submitTime;
+	MM::MMTime sentTime;
+	MM::MMTime doneTime;
+	PortRequest* next; // link in the submission stack
+};
+
+
+// Writes binary frames to a port and matches the replies that come back to
+// the requests waiting for them, so several requests can be in flight at
+// once (a long move and a position query, for instance). There is one
+// scheduler per port, shared by all devices on it and safe to call from
+// any thread.
+//
+// Received bytes accumulate in a buffer that persists between reads. A frame
+// is only taken from the front of the buffer if it passes the plausibility
+// checks (device number, reply command) and answers something: a request in
+// flight, echoing its message ID where IDs are on, a broadcast any device
+// replies to, one withdrawn recently, or nothing as a tracking reply.
+// Otherwise one byte is dropped and the check repeats, so a lost or extra
+// byte costs a single realignment instead of shifting every later reply. A
+// partial frame left when the line goes quiet is dropped too.
+//
+// Writes are budgeted against the line and the devices: the line takes one
+// frame per frame time at the port's baud rate, and no more than one frame
+// is left waiting in the OS and adapter buffers behind the one being sent,
+// so that an urgent request is never stuck behind a burst. Each device
+// takes in a frame per command interval and buffers a few more. Requests
+// over budget wait in the queue, and a submitter finding the queue full
+// helps drain it before it adds to it, so bursts are paced instead of
+// overflowing a buffer and being dropped.
+//
+// A request is queued instead of written while a reply to it could not be
+// told apart from the reply to one already in flight. Urgent requests (stop)
+// skip the queue and are written at once; a stop also discards the moves
+// still queued for its device.
+//
+// No lock is held for a round trip. Submitting pushes onto a lock-free
+// stack; whichever caller gets to flush writes everything submitted so far,
+// holding the write lock for one frame at a time. Waiting callers take turns
+// reading the port, and whoever reads completes the requests of all of
+// them.
+class PortScheduler
+{
+public:
+	static PortScheduler* Acquire(const std::string& port);
+	static void Release(PortScheduler* scheduler);
+
+	int Submit(MM::Core* core, const MM::Device* caller, PortRequest& request);
+	int Send(MM::Core* core, const MM::Device* caller, const unsigned char* frame);
+	int Poll(MM::Core* core, const MM::Device* caller);
+	int Wait(MM::Core* core, const MM::Device* caller, PortRequest& request, double timeoutMs);
+	void Cancel(PortRequest& request);
+	int Clear(MM::Core* core, const MM::Device* caller);
+
+	void SetMessageIds(long device, bool enabled);
+	void AttachRecorder(FlightRecorder* recorder);
+	void DetachRecorder(FlightRecorder* recorder);
+	void AttachListener(long device, PositionListener* listener);
+	void DetachListener(long device, PositionListener* listener);
+	long ResyncCount() const { return resyncCount_; }
+
+	struct Stats
+	{
+		long queueDepth;
+		long maxQueueDepth;
+		long inFlight;
+		long deferred;      // requests held back by the budget
+		double meanWaitMs;  // from submission to write
+		double maxWaitMs;
+	};
+	void SetBaudRate(long baud);
+	void SetDeviceBudget(long bufferFrames, double commandIntervalMs);
+	void SetQueueLimit(long limit);
+	long QueueLimit();
+	long DeviceBuffer();
+	double DeviceIntervalMs();
+	void GetStats(Stats& stats);
+	void ResetStats();
+
+	int StartRecording(const std::string& path);
+	void StopRecording();
+	bool IsRecording() const { return transport_.IsRecording(); }
+	std::string RecordingPath();
+	int Replay(const std::string& path);
+	int UseNativePort(const std::string& path, long baud);
+	bool IsNative() const { return native_ != 0; }
+	bool IsReplaying() const { return replay_ != 0; }
+	long ReplayMismatches() const { return replay_ != 0 ? replay_->Mismatches() : 0; }
+
+private:
+	PortScheduler(const std::string& port);
+	~PortScheduler();
+
+	void Collect();
+	int Flush(MM::Core* core, const MM::Device* caller);
+	int Write(MM::Core* core, const MM::Device* caller, PortRequest& request);
+	MM::MMTime Launch(MM::Core* core, PortRequest& request, unsigned char* frame);
+	int Transmit(MM::Core* core, const MM::Device* caller, PortRequest& request, const unsigned char* frame, MM::MMTime sentTime);
+	void Record(FlightRecorder::Direction direction, const unsigned char* frame, double timeUs, double latencyUs);
+	void Fail(MM::Core* core, PortRequest& request, int result);
+	bool CanWrite(const PortRequest& request) const;
+	void Preempt(MM::Core* core, unsigned char device);
+	bool Dispatch(MM::Core* core, const MM::Device* caller, const unsigned char* candidate);
+	void DeliverReports(MM::Core* core, const MM::Device* caller);
+	void Finish(MM::Core* core, PortRequest& request, const unsigned char* candidate);
+	void Log(MM::Core* core, const MM::Device* caller, const char* message) const;
+	int Poll(MM::Core* core, const MM::Device* caller, bool& waited);
+	int WaitForRoom(MM::Core* core, const MM::Device* caller);
+	bool WithinBudget(const PortRequest& request, double nowUs) const;
+	void Charge(unsigned char device, double nowUs);
+	bool Matches(const PortRequest& request, const unsigned char* candidate) const;
+	static unsigned char ExpectedReply(const PortRequest& request);
+	static unsigned char ReplyDevice(const PortRequest& request);
+	static bool IsPlausibleReply(const unsigned char* candidate);
+	static bool IsMoveCommand(unsigned char command);
+	double PartialFrameSilenceUs() const;
+	void Withdraw(const PortRequest& request);
+	bool AnswersBroadcast(const unsigned char* candidate) const;
+
+	static const size_t WithdrawnLimit = 64;
+
+	std::string port_;
+	long users_; // guarded by the registry lock
+
+	// All serial I/O and timing goes through transport_, which records the
+	// session on request and talks to the core's port, to the tty directly
+	// through native_, or to replay_ when a recorded session stands in for
+	// the device.
+	CoreTransport coreTransport_;
+	LinuxSerialTransport* native_;
+	ReplayTransport* replay_;
+	RecordingTransport transport_;
+
+	PortRequest* volatile submitted_; // lock-free stack, newest first
+	volatile long flushing_;          // 1 while a caller writes submissions
+	volatile long reading_;           // 1 while a caller reads the port
+	MMThreadLock writeLock_;          // held for one frame; taken before stateLock_
+	MMThreadLock stateLock_;          // guards the members below, never held for serial I/O
+	MMThreadLock listenerLock_;       // held while a listener runs; never taken with stateLock_
+	MMThreadLock recorderLock_;       // guards recorders_; taken last
+
+	std::vector<unsigned char> rxBuffer_; // received bytes not yet matched to a reply
+	double lastRxUs_;                      // when bytes were last received
+	std::list<PortRequest*> inFlight_;     // oldest first
+	std::deque<PortRequest*> queued_;      // not yet written, oldest first
+	std::deque<PortRequest> withdrawn_;    // copies of requests cancelled in flight, oldest first
+	std::vector<FlightRecorder*> recorders_; // one per device on the port, each sees all traffic
+	bool messageIds_[256];                 // per device number
+	unsigned char nextMessageId_;
+	volatile long resyncCount_;
+
+	// Tracking replies wait here until the reader has released its locks.
+	struct PositionReport
+	{
+		unsigned char reply[PortRequest::FrameLength];
+		MM::MMTime time;
+	};
+	std::vector<PositionReport> reports_;
+	PositionListener* listeners_[256];     // per device number, guarded by listenerLock_
+
+	// Bandwidth budget, in microseconds of the transport clock.
+	double frameTimeUs_;
+	double lineFreeUs_;           // when the line has sent everything written
+	long deviceBuffer_;           // frames
+	double deviceIntervalUs_;     // 0 disables the per device budget
+	double deviceDueUs_[256];     // when each device has taken in everything sent to it
+	size_t queueLimit_;           // 0 = unlimited
+	std::string recordingPath_;   // empty while not recording
+
+	long maxQueueDepth_;
+	long deferredCount_;
+	long waitCount_;
+	double waitTotalUs_;
+	double waitMaxUs_;
+};
+
+#endif //_ZABER_PORT_SCHEDULER_H_
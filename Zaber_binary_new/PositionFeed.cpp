@@ -0,0 +1,208 @@
+#include "PositionFeed.h"
+#include "ZaberBinary.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+	const uint32_t FeedMagic = 0x534f505a; // "ZPOS"
+	const uint32_t FeedVersion = 2;
+
+	struct FeedHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slotSize;
+		uint32_t slotCount;
+		uint8_t reserved[48];
+	};
+
+	struct FeedSlot
+	{
+		volatile uint64_t sequence;
+		volatile uint64_t flags;
+		volatile int64_t steps;
+		volatile double positionUm;
+		volatile double timeUs;
+		volatile uint64_t owner;
+		uint8_t reserved[16];
+	};
+
+	const size_t FeedSize = sizeof(FeedHeader) + PositionFeed::SlotCount * sizeof(FeedSlot);
+	const uint64_t SlotValid = 1;
+
+	volatile uint32_t g_feedCount = 0;
+
+	// A new owner value, different for every feed opened in this process.
+	uint64_t NewOwner()
+	{
+		uint32_t number = __sync_add_and_fetch(&g_feedCount, 1);
+		return ((uint64_t) (uint32_t) getpid() << 32) | (number != 0 ? number : 1);
+	}
+
+	// Whether the process that claimed a slot has exited. Another feed in
+	// this process holds it until it closes.
+	bool OwnerIsGone(uint64_t owner)
+	{
+		pid_t pid = (pid_t) (owner >> 32);
+		return pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH;
+	}
+}
+#endif
+
+using namespace std;
+
+PositionFeed::PositionFeed() :
+	base_(0),
+	slot_(0),
+	owner_(0)
+{
+}
+
+
+PositionFeed::~PositionFeed()
+{
+	Close();
+}
+
+
+#ifdef __linux__
+
+// Maps the named segment, creating it if needed, and claims the device's
+// slot. The name is a POSIX shared memory name such as "/zaber-positions".
+int PositionFeed::Open(const string& name, long device)
+{
+	Close();
+
+	if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != string::npos ||
+		device < 0 || device >= SlotCount)
+	{
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return DEVICE_ERR;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ((size_t) st.st_size < FeedSize && ftruncate(fd, FeedSize) != 0))
+	{
+		close(fd);
+		return DEVICE_ERR;
+	}
+	void* base = mmap(0, FeedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return DEVICE_ERR;
+	}
+
+	// A new segment is all zeros. Writers that find it at the same time
+	// write the same header.
+	FeedHeader* header = static_cast<FeedHeader*>(base);
+	if (header->magic == 0)
+	{
+		header->version = FeedVersion;
+		header->slotSize = sizeof(FeedSlot);
+		header->slotCount = SlotCount;
+		__sync_synchronize();
+		header->magic = FeedMagic;
+	}
+	else if (header->magic != FeedMagic || header->version != FeedVersion ||
+		header->slotSize != sizeof(FeedSlot) || header->slotCount != SlotCount)
+	{
+		munmap(base, FeedSize);
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+
+	FeedSlot* slot = reinterpret_cast<FeedSlot*>(static_cast<char*>(base) + sizeof(FeedHeader) + device * sizeof(FeedSlot));
+	uint64_t owner = NewOwner();
+	uint64_t previous = __sync_val_compare_and_swap(&slot->owner, (uint64_t) 0, owner);
+	if (previous != 0 && (!OwnerIsGone(previous) || !__sync_bool_compare_and_swap(&slot->owner, previous, owner)))
+	{
+		munmap(base, FeedSize);
+		return ERR_FEED_SLOT_IN_USE;
+	}
+
+	base_ = base;
+	slot_ = slot;
+	owner_ = owner;
+
+	// left odd by a writer that died mid-update
+	if (slot->sequence & 1)
+	{
+		slot->sequence = slot->sequence + 1;
+	}
+	return DEVICE_OK;
+}
+
+
+void PositionFeed::Close()
+{
+	if (base_ == 0)
+	{
+		return;
+	}
+
+	FeedSlot* slot = static_cast<FeedSlot*>(slot_);
+	uint64_t sequence = slot->sequence;
+	slot->sequence = sequence + 1;
+	__sync_synchronize();
+	slot->flags = 0;
+	__sync_synchronize();
+	slot->sequence = sequence + 2;
+	__sync_bool_compare_and_swap(&slot->owner, (uint64_t) owner_, (uint64_t) 0);
+
+	munmap(base_, FeedSize);
+	base_ = 0;
+	slot_ = 0;
+	owner_ = 0;
+}
+
+
+// Not thread safe: the caller serializes the writes of one feed.
+void PositionFeed::Write(long steps, double positionUm, MM::MMTime time)
+{
+	if (slot_ == 0)
+	{
+		return;
+	}
+
+	FeedSlot* slot = static_cast<FeedSlot*>(slot_);
+	uint64_t sequence = slot->sequence;
+	slot->sequence = sequence + 1;
+	__sync_synchronize();
+	slot->steps = steps;
+	slot->positionUm = positionUm;
+	slot->timeUs = time.getUsec();
+	slot->flags = SlotValid;
+	__sync_synchronize();
+	slot->sequence = sequence + 2;
+}
+
+#else
+
+int PositionFeed::Open(const string& /*name*/, long /*device*/)
+{
+	return DEVICE_NOT_SUPPORTED;
+}
+
+
+void PositionFeed::Close()
+{
+}
+
+
+void PositionFeed::Write(long /*steps*/, double /*positionUm*/, MM::MMTime /*time*/)
+{
+}
+
+#endif
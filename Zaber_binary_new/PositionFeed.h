@@ -0,0 +1,54 @@
+#ifndef _ZABER_POSITION_FEED_H_
+#define _ZABER_POSITION_FEED_H_
+
+#include <MMDevice.h>
+#include <string>
+
+// Publishes the latest known position of each device into a POSIX shared
+// memory segment, so another process (a tracking loop, say) can read it
+// without going through the core or the serial port.
+//
+// Layout, little endian, all fields naturally aligned:
+//
+//   header, 64 bytes:  uint32 magic ('ZPOS', 0x534f505a), uint32 version (2),
+//                      uint32 slot size (64), uint32 slot count (256), padding
+//   256 slots of 64 bytes, one per device address:
+//                      uint64 sequence, uint64 flags (bit 0: valid),
+//                      int64 position [steps], double position [um],
+//                      double MM time of the position [us],
+//                      uint64 owner (writer's pid << 32 | a number unique in
+//                      that process, 0 while free), padding
+//
+// Each slot is a seqlock with a single writer. The sequence is odd while
+// the slot is being written; a reader copies the slot between two reads of
+// the sequence and retries if they differ or are odd. Open() claims the
+// slot by setting its owner with a compare-exchange and fails with
+// ERR_FEED_SLOT_IN_USE while another live writer holds it, so stages may
+// share a segment as long as their device addresses differ, even across
+// ports. A slot whose owner process is gone is taken over. The segment is
+// left in place on close with the slot marked invalid and free.
+//
+// On other platforms than Linux Open() fails with DEVICE_NOT_SUPPORTED.
+class PositionFeed
+{
+public:
+	static const long SlotCount = 256;
+
+	PositionFeed();
+	~PositionFeed();
+
+	int Open(const std::string& name, long device);
+	void Close();
+	bool IsOpen() const { return slot_ != 0; }
+	void Write(long steps, double positionUm, MM::MMTime time);
+
+private:
+	PositionFeed(const PositionFeed&);
+	PositionFeed& operator=(const PositionFeed&);
+
+	void* base_;
+	void* slot_; // this device's slot in base_
+	unsigned long long owner_; // what this feed wrote to the slot's owner
+};
+
+#endif //_ZABER_POSITION_FEED_H_
@@ -0,0 +1,256 @@
+#include "PositionSampler.h"
+#include "ZaberAtomic.h"
+#include <DeviceBase.h>
+#include <algorithm>
+
+using namespace std;
+
+SampleRing::SampleRing() :
+	head_(0),
+	tail_(0)
+{
+}
+
+
+// Producer side. Returns false if the oldest sample was overwritten.
+bool SampleRing::Push(const Sample& sample)
+{
+	long head = head_;
+	bool kept = true;
+	long tail = AtomicLoad(&tail_);
+	while (head - tail >= Capacity)
+	{
+		// the slot is only reused once tail_ has moved past it, which makes
+		// a consumer reading it fail its compare-exchange
+		if (AtomicCompareExchange(&tail_, tail, tail + 1))
+		{
+			kept = false;
+		}
+		tail = AtomicLoad(&tail_);
+	}
+	samples_[head & (Capacity - 1)] = sample;
+	AtomicStore(&head_, head + 1); // publishes the sample
+	return kept;
+}
+
+
+// Consumer side. A copy is only good if tail_ has not moved meanwhile; if
+// the producer took the slot back, the next oldest sample is read instead.
+bool SampleRing::Pop(Sample& sample)
+{
+	for (;;)
+	{
+		long tail = AtomicLoad(&tail_);
+		if (tail == AtomicLoad(&head_))
+		{
+			return false;
+		}
+		sample = samples_[tail & (Capacity - 1)];
+		if (AtomicCompareExchange(&tail_, tail, tail + 1)) // hands the slot back
+		{
+			return true;
+		}
+	}
+}
+
+
+// Only while neither side is running.
+void SampleRing::Reset()
+{
+	AtomicStore(&head_, 0);
+	AtomicStore(&tail_, 0);
+}
+
+
+PositionSampler::PositionSampler(SampleSource* source) :
+	source_(source),
+	core_(0),
+	running_(0),
+	intervalUs_(0),
+	samples_(0),
+	dropped_(0),
+	errors_(0)
+{
+}
+
+
+PositionSampler::~PositionSampler()
+{
+	Stop();
+}
+
+
+// Starts sampling, or changes the interval of a running sampler.
+int PositionSampler::Start(double intervalMs)
+{
+	if (core_ == 0 || intervalMs <= 0)
+	{
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+
+	AtomicStore(&intervalUs_, (long) (intervalMs * 1000.0));
+	if (!AtomicCompareExchange(&running_, 0, 1))
+	{
+		return DEVICE_OK;
+	}
+
+	{
+		MMThreadGuard guard(consumerLock_);
+		history_.clear();
+		ring_.Reset();
+	}
+	if (activate() != 0)
+	{
+		AtomicStore(&running_, 0);
+		return DEVICE_ERR;
+	}
+	return DEVICE_OK;
+}
+
+
+void PositionSampler::Stop()
+{
+	if (AtomicCompareExchange(&running_, 1, 0))
+	{
+		wait();
+	}
+}
+
+
+bool PositionSampler::IsRunning() const
+{
+	return AtomicLoad(const_cast<volatile long*>(&running_)) != 0;
+}
+
+
+// Samples on a fixed schedule; a slow read delays the next sample rather
+// than bunching them up.
+int PositionSampler::svc()
+{
+	double nextUs = core_->GetCurrentMMTime().getUsec();
+	while (AtomicLoad(&running_) != 0)
+	{
+		SampleRing::Sample sample;
+		MM::MMTime time;
+		if (source_->ReadSample(sample.steps, time) == DEVICE_OK)
+		{
+			sample.timeUs = time.getUsec();
+			AtomicIncrement(&samples_);
+			if (!ring_.Push(sample))
+			{
+				AtomicIncrement(&dropped_);
+			}
+		}
+		else
+		{
+			AtomicIncrement(&errors_);
+		}
+
+		double nowUs = core_->GetCurrentMMTime().getUsec();
+		nextUs += AtomicLoad(&intervalUs_);
+		if (nextUs < nowUs)
+		{
+			nextUs = nowUs;
+		}
+		while (AtomicLoad(&running_) != 0 && nowUs < nextUs)
+		{
+			long waitMs = (long) ((nextUs - nowUs) / 1000.0);
+			CDeviceUtils::SleepMs(waitMs < 1 ? 1 : (waitMs > 50 ? 50 : waitMs));
+			nowUs = core_->GetCurrentMMTime().getUsec();
+		}
+	}
+	return 0;
+}
+
+
+// Moves the samples that have arrived into the history, keeping the latest
+// HistoryLength. Called with consumerLock_ held.
+void PositionSampler::Drain()
+{
+	SampleRing::Sample sample;
+	while (ring_.Pop(sample))
+	{
+		history_.push_back(sample);
+	}
+	while ((long) history_.size() > HistoryLength)
+	{
+		history_.pop_front();
+	}
+}
+
+
+// The time expected between samples: the sampling interval, or the mean
+// spacing in the history if reads take longer than that. Called with
+// consumerLock_ held.
+double PositionSampler::SpacingUs()
+{
+	double spacingUs = (double) AtomicLoad(&intervalUs_);
+	if (history_.size() >= 2)
+	{
+		double meanUs = (history_.back().timeUs - history_.front().timeUs) / (history_.size() - 1);
+		spacingUs = (meanUs > spacingUs) ? meanUs : spacingUs;
+	}
+	return spacingUs;
+}
+
+
+namespace
+{
+	bool SampleBefore(const SampleRing::Sample& sample, double timeUs)
+	{
+		return sample.timeUs < timeUs;
+	}
+}
+
+
+// The position at the given time, interpolated linearly between the
+// samples either side of it, in steps. Past the newest sample it is
+// extrapolated from the last two, for up to two sampling intervals; beyond
+// that, or before the oldest sample, the position is unknown. So is a
+// position between samples more than two intervals apart, as around reads
+// that failed: the axis may have gone anywhere in between.
+int PositionSampler::PositionAt(MM::MMTime time, double& steps)
+{
+	MMThreadGuard guard(consumerLock_);
+	Drain();
+
+	double timeUs = time.getUsec();
+	if (history_.empty() || timeUs < history_.front().timeUs)
+	{
+		return DEVICE_UNKNOWN_POSITION;
+	}
+
+	double maxGapUs = 2.0 * SpacingUs();
+	deque<SampleRing::Sample>::const_iterator after =
+		lower_bound(history_.begin(), history_.end(), timeUs, SampleBefore);
+	if (after == history_.end())
+	{
+		const SampleRing::Sample& last = history_.back();
+		if (timeUs - last.timeUs > maxGapUs)
+		{
+			return DEVICE_UNKNOWN_POSITION;
+		}
+		if (history_.size() < 2)
+		{
+			steps = (double) last.steps;
+			return DEVICE_OK;
+		}
+		after = history_.end() - 1;
+	}
+	else if (after->timeUs == timeUs || after == history_.begin())
+	{
+		steps = (double) after->steps;
+		return DEVICE_OK;
+	}
+
+	const SampleRing::Sample& b = *after;
+	const SampleRing::Sample& a = *(after - 1);
+	double span = b.timeUs - a.timeUs;
+	if (span > maxGapUs)
+	{
+		return DEVICE_UNKNOWN_POSITION;
+	}
+	double f = (span > 0) ? (timeUs - a.timeUs) / span : 1.0;
+	steps = a.steps + f * (b.steps - a.steps);
+	return DEVICE_OK;
+}
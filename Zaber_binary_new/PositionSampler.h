@@ -0,0 +1,91 @@
+#ifndef _ZABER_POSITION_SAMPLER_H_
+#define _ZABER_POSITION_SAMPLER_H_
+
+#include <MMDevice.h>
+#include <DeviceThreads.h>
+#include <deque>
+
+// Reads one position for a PositionSampler, with the MM time the device
+// took it at.
+class SampleSource
+{
+public:
+	virtual ~SampleSource() {}
+	virtual int ReadSample(long& steps, MM::MMTime& time) = 0;
+};
+
+
+// Timestamped positions, passed from one producer thread to one consumer
+// without a lock: only the producer writes head_. A full ring overwrites the
+// oldest sample, so the producer then moves tail_ on itself; both sides
+// advance tail_ with a compare-exchange, and the consumer only keeps a
+// sample whose slot it claimed that way.
+class SampleRing
+{
+public:
+	static const long Capacity = 4096; // power of 2
+
+	struct Sample
+	{
+		double timeUs;
+		long steps;
+	};
+
+	SampleRing();
+
+	bool Push(const Sample& sample);
+	bool Pop(Sample& sample);
+	void Reset();
+
+private:
+	volatile long head_; // next slot to write
+	volatile long tail_; // next slot to read
+	Sample samples_[Capacity];
+};
+
+
+// Reads the position at a fixed interval on its own thread and keeps the
+// recent samples, so the position at any recent MM time (that of a camera
+// frame, say) can be looked up without a serial round trip.
+//
+// The sampler thread is the ring's producer. Lookups are the consumer: they
+// move whatever has arrived into the history and interpolate there. They
+// may come from any thread, but are serialized among themselves, so the
+// sampler never waits for them.
+class PositionSampler : public MMDeviceThreadBase
+{
+public:
+	static const long HistoryLength = SampleRing::Capacity;
+
+	PositionSampler(SampleSource* source);
+	~PositionSampler();
+
+	void SetClock(MM::Core* core) { core_ = core; }
+	int Start(double intervalMs);
+	void Stop();
+	bool IsRunning() const;
+	int PositionAt(MM::MMTime time, double& steps);
+	long SampleCount() const { return samples_; }
+	long DroppedCount() const { return dropped_; }
+	long ErrorCount() const { return errors_; }
+
+	int svc();
+
+private:
+	void Drain();
+	double SpacingUs();
+
+	SampleSource* source_;
+	MM::Core* core_;
+	SampleRing ring_;
+	volatile long running_;
+	volatile long intervalUs_;
+	volatile long samples_;
+	volatile long dropped_; // overwritten before a lookup took them
+	volatile long errors_;
+
+	MMThreadLock consumerLock_; // guards history_
+	std::deque<SampleRing::Sample> history_; // oldest first
+};
+
+#endif //_ZABER_POSITION_SAMPLER_H_
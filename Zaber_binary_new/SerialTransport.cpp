@@ -0,0 +1,330 @@
+#ifdef WIN32
+#define snprintf _snprintf 
+#pragma warning(disable: 4355)
+#endif
+
+#include "SerialTransport.h"
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+	const unsigned char g_SessionVersion = 1;
+
+	// Reads an unsigned LEB128 varint; false at the end of the file.
+	bool ReadVarint(FILE* file, unsigned long long& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			int c = fgetc(file);
+			if (c == EOF)
+			{
+				return false;
+			}
+			value |= (unsigned long long) (c & 0x7F) << shift;
+			if ((c & 0x80) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CoreTransport
+///////////////////////////////////////////////////////////////////////////////
+
+int CoreTransport::Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len)
+{
+	return core->WriteToSerial(caller, port, buf, len);
+}
+
+
+int CoreTransport::Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read)
+{
+	return core->ReadFromSerial(caller, port, buf, bufLen, read);
+}
+
+
+MM::MMTime CoreTransport::Now(MM::Core* core)
+{
+	return core->GetCurrentMMTime();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// RecordingTransport
+///////////////////////////////////////////////////////////////////////////////
+
+RecordingTransport::RecordingTransport(SerialTransport* inner) :
+	inner_(inner),
+	file_(0),
+	stamped_(false)
+{
+}
+
+
+RecordingTransport::~RecordingTransport()
+{
+	Stop();
+}
+
+
+// Starts a new session file, replacing one being recorded.
+int RecordingTransport::Start(const string& path, const string& port)
+{
+	MMThreadGuard guard(lock_);
+	if (file_ != 0)
+	{
+		fclose(file_);
+		file_ = 0;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == 0)
+	{
+		return DEVICE_ERR;
+	}
+
+	unsigned char portLength = (unsigned char) (port.size() < 255 ? port.size() : 255);
+	fwrite("ZBSR", 1, 4, file);
+	fwrite(&g_SessionVersion, 1, 1, file);
+	fwrite(&portLength, 1, 1, file);
+	fwrite(port.c_str(), 1, portLength, file);
+
+	stamped_ = false;
+	file_ = file;
+	return DEVICE_OK;
+}
+
+
+void RecordingTransport::Stop()
+{
+	MMThreadGuard guard(lock_);
+	if (file_ != 0)
+	{
+		fclose(file_);
+		file_ = 0;
+	}
+}
+
+
+// The write is stamped before it goes out, like PortRequest::sentTime.
+int RecordingTransport::Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len)
+{
+	MM::MMTime time = inner_->Now(core);
+	int ret = inner_->Write(core, caller, port, buf, len);
+	if (ret == DEVICE_OK && file_ != 0)
+	{
+		Append(SessionWrite, time, buf, len);
+	}
+	return ret;
+}
+
+
+int RecordingTransport::Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read)
+{
+	int ret = inner_->Read(core, caller, port, buf, bufLen, read);
+	if (ret == DEVICE_OK && read > 0 && file_ != 0)
+	{
+		Append(SessionRead, inner_->Now(core), buf, read);
+	}
+	return ret;
+}
+
+
+MM::MMTime RecordingTransport::Now(MM::Core* core)
+{
+	return inner_->Now(core);
+}
+
+
+void RecordingTransport::Append(unsigned char kind, const MM::MMTime& time, const unsigned char* buf, unsigned long len)
+{
+	MMThreadGuard guard(lock_);
+	if (file_ == 0)
+	{
+		return;
+	}
+
+	if (!stamped_)
+	{
+		last_ = time;
+		stamped_ = true;
+	}
+	// writes and reads from different threads can be stamped out of order
+	double deltaUs = (time - last_).getUsec();
+	if (deltaUs < 0)
+	{
+		deltaUs = 0;
+	}
+	else
+	{
+		last_ = time;
+	}
+
+	fputc(kind, file_);
+	AppendVarint((unsigned long long) deltaUs);
+	AppendVarint(len);
+	fwrite(buf, 1, len, file_);
+}
+
+
+// Called with lock_ held.
+void RecordingTransport::AppendVarint(unsigned long long value)
+{
+	do
+	{
+		unsigned char byte = (unsigned char) (value & 0x7F);
+		value >>= 7;
+		if (value != 0)
+		{
+			byte |= 0x80;
+		}
+		fputc(byte, file_);
+	} while (value != 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ReplayTransport
+///////////////////////////////////////////////////////////////////////////////
+
+ReplayTransport::ReplayTransport() :
+	next_(0),
+	offset_(0),
+	clockUs_(0.0),
+	originUs_(0.0),
+	anchored_(false),
+	mismatches_(0)
+{
+}
+
+
+int ReplayTransport::Load(const string& path)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == 0)
+	{
+		return DEVICE_ERR;
+	}
+
+	char magic[4];
+	unsigned char version = 0, portLength = 0;
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "ZBSR", 4) != 0
+		|| fread(&version, 1, 1, file) != 1 || version != g_SessionVersion
+		|| fread(&portLength, 1, 1, file) != 1)
+	{
+		fclose(file);
+		return DEVICE_ERR;
+	}
+	vector<char> port(portLength + 1, 0);
+	if (fread(&port[0], 1, portLength, file) != portLength)
+	{
+		fclose(file);
+		return DEVICE_ERR;
+	}
+
+	MMThreadGuard guard(lock_);
+	port_ = &port[0];
+	records_.clear();
+	double timeUs = 0.0;
+	int kind;
+	while ((kind = fgetc(file)) != EOF)
+	{
+		unsigned long long deltaUs, length;
+		if ((kind != SessionWrite && kind != SessionRead)
+			|| !ReadVarint(file, deltaUs) || !ReadVarint(file, length) || length == 0)
+		{
+			fclose(file);
+			return DEVICE_ERR;
+		}
+
+		Record record;
+		record.kind = (unsigned char) kind;
+		timeUs += (double) deltaUs;
+		record.timeUs = timeUs;
+		record.data.resize((size_t) length);
+		if (fread(&record.data[0], 1, (size_t) length, file) != length)
+		{
+			fclose(file);
+			return DEVICE_ERR;
+		}
+		records_.push_back(record);
+	}
+	fclose(file);
+
+	next_ = 0;
+	offset_ = 0;
+	clockUs_ = 0.0;
+	mismatches_ = 0;
+	return DEVICE_OK;
+}
+
+
+int ReplayTransport::Write(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, const unsigned char* buf, unsigned long len)
+{
+	MMThreadGuard guard(lock_);
+	if (next_ >= records_.size() || records_[next_].kind != SessionWrite)
+	{
+		// the original session had no write here
+		mismatches_++;
+		return DEVICE_OK;
+	}
+
+	const Record& record = records_[next_++];
+	if (record.data.size() != len || memcmp(&record.data[0], buf, len) != 0)
+	{
+		mismatches_++;
+	}
+	if (record.timeUs > clockUs_)
+	{
+		clockUs_ = record.timeUs;
+	}
+	return DEVICE_OK;
+}
+
+
+int ReplayTransport::Read(MM::Core* /*core*/, const MM::Device* /*caller*/, const char* /*port*/, unsigned char* buf, unsigned long bufLen, unsigned long& read)
+{
+	MMThreadGuard guard(lock_);
+	read = 0;
+	if (next_ >= records_.size() || records_[next_].kind != SessionRead)
+	{
+		clockUs_ += 1000.0;
+		return DEVICE_OK;
+	}
+
+	const Record& record = records_[next_];
+	size_t available = record.data.size() - offset_;
+	read = (unsigned long) (available < bufLen ? available : bufLen);
+	memcpy(buf, &record.data[offset_], read);
+	offset_ += read;
+	if (offset_ == record.data.size())
+	{
+		next_++;
+		offset_ = 0;
+	}
+	if (record.timeUs > clockUs_)
+	{
+		clockUs_ = record.timeUs;
+	}
+	return DEVICE_OK;
+}
+
+
+// A replay without a core runs on the session clock alone.
+MM::MMTime ReplayTransport::Now(MM::Core* core)
+{
+	MMThreadGuard guard(lock_);
+	if (!anchored_ && core != 0)
+	{
+		originUs_ = core->GetCurrentMMTime().getUsec() - clockUs_;
+		anchored_ = true;
+	}
+	return MM::MMTime(originUs_ + clockUs_);
+}
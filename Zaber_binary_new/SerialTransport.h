@@ -0,0 +1,129 @@
+#ifndef _ZABER_SERIAL_TRANSPORT_H_
+#define _ZABER_SERIAL_TRANSPORT_H_
+
+#include <MMDevice.h>
+#include <DeviceThreads.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// The byte-level boundary between a port scheduler and the serial port, and
+// the clock the scheduler times requests with. Normally the core's serial
+// port; a recorded session can stand in for it.
+class SerialTransport
+{
+public:
+	virtual ~SerialTransport() {}
+
+	virtual int Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len) = 0;
+	virtual int Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read) = 0;
+	virtual MM::MMTime Now(MM::Core* core) = 0;
+
+	// True if Read() blocks briefly for input, so callers need not sleep
+	// between reads.
+	virtual bool WaitsForInput() const { return false; }
+};
+
+
+// The serial port device loaded in the core.
+class CoreTransport: public SerialTransport
+{
+public:
+	int Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len);
+	int Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read);
+	MM::MMTime Now(MM::Core* core);
+};
+
+
+// Session files hold every write and every non-empty read, in the order
+// they happened:
+//
+//   header: "ZBSR", version byte, port name length byte, port name
+//   record: kind byte (1 = write, 2 = read), microseconds since the previous
+//           record, byte count, bytes
+//
+// The time and the count are unsigned LEB128 varints, so a typical 6-byte
+// frame takes 9 or 10 bytes.
+enum SessionRecordKind
+{
+	SessionWrite = 1,
+	SessionRead = 2
+};
+
+
+// Passes everything through to another transport, appending it to a
+// session file while recording.
+class RecordingTransport: public SerialTransport
+{
+public:
+	RecordingTransport(SerialTransport* inner);
+	~RecordingTransport();
+
+	int Start(const std::string& path, const std::string& port);
+	void Stop();
+	bool IsRecording() const { return file_ != 0; }
+	void SetInner(SerialTransport* inner) { inner_ = inner; }
+	bool WaitsForInput() const { return inner_->WaitsForInput(); }
+
+	int Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len);
+	int Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read);
+	MM::MMTime Now(MM::Core* core);
+
+private:
+	void Append(unsigned char kind, const MM::MMTime& time, const unsigned char* buf, unsigned long len);
+	void AppendVarint(unsigned long long value);
+
+	SerialTransport* volatile inner_;
+	FILE* volatile file_;
+	bool stamped_;     // last_ holds the time of a record
+	MM::MMTime last_;
+	MMThreadLock lock_; // guards the file
+};
+
+
+// Plays a session file back in place of the port. Reads return the
+// recorded bytes in order, and the clock is the recorded one, advanced by
+// the records consumed, so a replay runs the same way every time and as
+// fast as the caller goes. The clock starts at the core's time when it is
+// first read, so that it can be compared with the core clock the devices
+// time things with. Writes are checked against the recording;
+// whatever the caller sends differently from the original session is
+// counted as a mismatch.
+//
+// A read with nothing due (the next record is a write the caller has not
+// made yet) returns no bytes and advances the clock by one millisecond.
+class ReplayTransport: public SerialTransport
+{
+public:
+	ReplayTransport();
+
+	int Load(const std::string& path);
+	const std::string& Port() const { return port_; }
+	long Mismatches() const { return mismatches_; }
+	bool Finished() const { return next_ >= records_.size(); }
+	bool WaitsForInput() const { return true; } // time is virtual, sleeping gains nothing
+
+	int Write(MM::Core* core, const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long len);
+	int Read(MM::Core* core, const MM::Device* caller, const char* port, unsigned char* buf, unsigned long bufLen, unsigned long& read);
+	MM::MMTime Now(MM::Core* core);
+
+private:
+	struct Record
+	{
+		unsigned char kind;
+		double timeUs; // since the start of the session
+		std::vector<unsigned char> data;
+	};
+
+	std::string port_;
+	std::vector<Record> records_;
+	size_t next_;
+	size_t offset_;   // bytes of records_[next_] already read
+	double clockUs_;  // since the start of the session
+	double originUs_; // core time of the start of the session
+	bool anchored_;   // originUs_ is set
+	volatile long mismatches_;
+	MMThreadLock lock_;
+};
+
+#endif //_ZABER_SERIAL_TRANSPORT_H_
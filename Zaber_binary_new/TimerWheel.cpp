@@ -0,0 +1,201 @@
+#include "TimerWheel.h"
+#include "ZaberAtomic.h"
+#include <DeviceBase.h>
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+
+TimerWheel::TimerWheel(TimerListener* listener) :
+	listener_(listener),
+	core_(0),
+	tickUs_(1000.0),
+	running_(0),
+	leadUs_(0),
+	lastTick_(0),
+	pending_(0)
+{
+}
+
+
+TimerWheel::~TimerWheel()
+{
+	Stop();
+}
+
+
+// Files a timer; one that is due already fires at once.
+int TimerWheel::Schedule(MM::MMTime due, long payload)
+{
+	if (core_ == 0)
+	{
+		return DEVICE_NOT_CONNECTED;
+	}
+
+	Timer timer;
+	timer.dueUs = due.getUsec();
+	timer.payload = payload;
+
+	MMThreadGuard guard(lock_);
+	if (AtomicCompareExchange(&running_, 0, 1))
+	{
+		lastTick_ = floor(NowUs() / tickUs_) - 1;
+		if (activate() != 0)
+		{
+			AtomicStore(&running_, 0);
+			return DEVICE_ERR;
+		}
+	}
+
+	double tick = floor(timer.dueUs / tickUs_);
+	if (tick <= lastTick_)
+	{
+		imminent_.push_back(timer);
+	}
+	else
+	{
+		slots_[(long) fmod(tick, (double) SlotCount)].push_back(timer);
+	}
+	pending_++;
+	return DEVICE_OK;
+}
+
+
+// Drops all timers. Once this returns, no listener call is in progress and
+// none follows until the next Schedule().
+void TimerWheel::Clear()
+{
+	MMThreadGuard fireGuard(fireLock_);
+	MMThreadGuard guard(lock_);
+	for (int s = 0; s < SlotCount; s++)
+	{
+		slots_[s].clear();
+	}
+	imminent_.clear();
+	pending_ = 0;
+}
+
+
+void TimerWheel::Stop()
+{
+	if (AtomicCompareExchange(&running_, 1, 0))
+	{
+		wait();
+	}
+	Clear();
+}
+
+
+void TimerWheel::SetLeadUs(double leadUs)
+{
+	AtomicStore(&leadUs_, (long) leadUs);
+}
+
+
+double TimerWheel::LeadUs() const
+{
+	return (double) AtomicLoad(const_cast<volatile long*>(&leadUs_));
+}
+
+
+long TimerWheel::Pending()
+{
+	MMThreadGuard guard(lock_);
+	return pending_;
+}
+
+
+int TimerWheel::svc()
+{
+	while (AtomicLoad(&running_) != 0)
+	{
+		double leadUs = LeadUs();
+		double nowUs = NowUs();
+		bool spin = false;
+		vector<Timer> due;
+		{
+			// a sleep can overrun by a tick, so spinning starts two ticks
+			// ahead
+			MMThreadGuard guard(lock_);
+			Advance(nowUs + leadUs + 2 * tickUs_);
+
+			vector<Timer>::iterator it = imminent_.begin();
+			while (it != imminent_.end())
+			{
+				if (it->dueUs - leadUs <= nowUs)
+				{
+					due.push_back(*it);
+					it = imminent_.erase(it);
+					pending_--;
+				}
+				else
+				{
+					it++;
+				}
+			}
+			spin = !imminent_.empty();
+		}
+
+		if (!due.empty())
+		{
+			sort(due.begin(), due.end(), EarlierDue);
+			MMThreadGuard fireGuard(fireLock_);
+			for (size_t i = 0; i < due.size(); i++)
+			{
+				listener_->OnTimer(due[i].payload, MM::MMTime(due[i].dueUs));
+			}
+		}
+		else
+		{
+			CDeviceUtils::SleepMs(spin ? 0 : 1);
+		}
+	}
+	return 0;
+}
+
+
+bool TimerWheel::EarlierDue(const Timer& a, const Timer& b)
+{
+	return a.dueUs < b.dueUs;
+}
+
+
+double TimerWheel::NowUs() const
+{
+	return core_->GetCurrentMMTime().getUsec();
+}
+
+
+// Empties the slots of every tick up to the one containing horizonUs into
+// imminent_. A slot also holds timers a whole turn of the wheel or more
+// later, which stay where they are. Called with lock_ held.
+void TimerWheel::Advance(double horizonUs)
+{
+	double horizonTick = floor(horizonUs / tickUs_);
+	if (horizonTick <= lastTick_)
+	{
+		return;
+	}
+
+	double endUs = (horizonTick + 1) * tickUs_;
+	double ticks = horizonTick - lastTick_;
+	for (double k = 1; k <= ticks && k <= SlotCount; k++)
+	{
+		vector<Timer>& slot = slots_[(long) fmod(lastTick_ + k, (double) SlotCount)];
+		vector<Timer>::iterator it = slot.begin();
+		while (it != slot.end())
+		{
+			if (it->dueUs < endUs)
+			{
+				imminent_.push_back(*it);
+				it = slot.erase(it);
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+	lastTick_ = horizonTick;
+}
@@ -0,0 +1,67 @@
+#ifndef _ZABER_TIMER_WHEEL_H_
+#define _ZABER_TIMER_WHEEL_H_
+
+#include <MMDevice.h>
+#include <DeviceThreads.h>
+#include <vector>
+
+// Receives the timers of a TimerWheel, on the wheel's thread.
+class TimerListener
+{
+public:
+	virtual ~TimerListener() {}
+	virtual void OnTimer(long payload, MM::MMTime due) = 0;
+};
+
+
+// Hashed timer wheel on the core clock. Timers are filed by due time into
+// slots of one tick each. The wheel's thread sleeps a tick at a time, takes
+// the timers of the coming ticks out of their slots, and spins on those so
+// each fires close to its due time rather than on the next tick.
+//
+// Timers fire the lead time early, to make up for the time the listener
+// takes to act on them. The thread starts with the first timer and runs
+// until Stop().
+class TimerWheel : public MMDeviceThreadBase
+{
+public:
+	static const int SlotCount = 256;
+
+	TimerWheel(TimerListener* listener);
+	~TimerWheel();
+
+	void SetClock(MM::Core* core) { core_ = core; }
+	int Schedule(MM::MMTime due, long payload);
+	void Clear();
+	void Stop();
+	void SetLeadUs(double leadUs);
+	double LeadUs() const;
+	long Pending();
+
+	int svc();
+
+private:
+	struct Timer
+	{
+		double dueUs;
+		long payload;
+	};
+
+	double NowUs() const;
+	static bool EarlierDue(const Timer& a, const Timer& b);
+	void Advance(double horizonUs);
+
+	TimerListener* listener_;
+	MM::Core* core_;
+	double tickUs_;
+	volatile long running_;
+	volatile long leadUs_;
+	MMThreadLock fireLock_; // held while a listener runs, so Clear() waits for it
+	MMThreadLock lock_;     // guards the members below; taken after fireLock_
+	std::vector<Timer> slots_[SlotCount];
+	std::vector<Timer> imminent_; // taken out of their slot, due within a tick
+	double lastTick_;             // last tick whose slot has been emptied
+	long pending_;
+};
+
+#endif //_ZABER_TIMER_WHEEL_H_
@@ -0,0 +1,93 @@
+#ifndef _ZABER_ATOMIC_H_
+#define _ZABER_ATOMIC_H_
+
+// Minimal atomic operations on a long or a pointer for the lock-free
+// buffers in this adapter. The Visual Studio 2010 toolset has no <atomic>, so these map to
+// the Interlocked functions on Windows and to the GCC builtins elsewhere.
+// All operations are full barriers.
+
+#ifdef WIN32
+#include <windows.h>
+
+inline long AtomicIncrement(volatile long* value)
+{
+	return InterlockedIncrement(value);
+}
+
+inline long AtomicAdd(volatile long* value, long delta)
+{
+	return InterlockedExchangeAdd(value, delta) + delta;
+}
+
+inline bool AtomicCompareExchange(volatile long* value, long expected, long desired)
+{
+	return InterlockedCompareExchange(value, desired, expected) == expected;
+}
+
+inline long AtomicLoad(volatile long* value)
+{
+	return InterlockedCompareExchange(value, 0, 0);
+}
+
+inline void AtomicStore(volatile long* value, long desired)
+{
+	InterlockedExchange(value, desired);
+}
+
+inline bool AtomicCompareExchangePointer(void* volatile* value, void* expected, void* desired)
+{
+	return InterlockedCompareExchangePointer(value, desired, expected) == expected;
+}
+
+inline void* AtomicExchangePointer(void* volatile* value, void* desired)
+{
+	return InterlockedExchangePointer(value, desired);
+}
+
+#else
+
+inline long AtomicIncrement(volatile long* value)
+{
+	return __sync_add_and_fetch(value, 1);
+}
+
+inline long AtomicAdd(volatile long* value, long delta)
+{
+	return __sync_add_and_fetch(value, delta);
+}
+
+inline bool AtomicCompareExchange(volatile long* value, long expected, long desired)
+{
+	return __sync_bool_compare_and_swap(value, expected, desired);
+}
+
+inline long AtomicLoad(volatile long* value)
+{
+	return __sync_add_and_fetch(value, 0);
+}
+
+inline void AtomicStore(volatile long* value, long desired)
+{
+	__sync_synchronize();
+	*value = desired;
+	__sync_synchronize();
+}
+
+inline bool AtomicCompareExchangePointer(void* volatile* value, void* expected, void* desired)
+{
+	return __sync_bool_compare_and_swap(value, expected, desired);
+}
+
+inline void* AtomicExchangePointer(void* volatile* value, void* desired)
+{
+	void* current;
+	do
+	{
+		current = *value;
+	} while (!__sync_bool_compare_and_swap(value, current, desired));
+	return current;
+}
+
+#endif
+
+#endif //_ZABER_ATOMIC_H_
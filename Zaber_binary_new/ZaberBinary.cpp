@@ -0,0 +1,701 @@
+#ifdef WIN32
+#define snprintf _snprintf 
+#pragma warning(disable: 4355)
+#endif
+
+#include "ZaberBinary.h"
+#include "ZaberBinaryStage.h"
+#include "ZaberBinaryFilterWheel.h"
+#include <math.h>
+
+using namespace std;
+
+const char* g_Msg_PORT_CHANGE_FORBIDDEN = "The port cannot be changed once the device is initialized.";
+const char* g_Msg_DRIVER_DISABLED = "The driver has disabled itself due to overheating.";
+const char* g_Msg_BUSY_TIMEOUT = "Timed out while waiting for device to finish executing a command.";
+const char* g_Msg_AXIS_COUNT = "Dual-axis controller required.";
+const char* g_Msg_COMMAND_REJECTED = "The device rejected the command.";
+const char* g_Msg_NO_REFERENCE_POS = "The device has not had a reference position established.";
+const char* g_Msg_SETTING_FAILED = "The property could not be set. Is the value in the valid range?";
+const char* g_Msg_INVALID_DEVICE_NUM = "Device numbers must be in the range of 1 to 99.";
+const char* g_Msg_COMMAND_PREEMPTED = "The move was cancelled by a stop before it was sent.";
+const char* g_Msg_POSITION_OUT_OF_RANGE = "The target position is outside the travel limits of the axis.";
+const char* g_Msg_FEED_SLOT_IN_USE = "Another device with this device number is already writing to the position feed.";
+
+const unsigned long stage_byte_len_ = 6;
+const double g_MoveReplyMarginMs = 1000.0;
+const long dataMin24_ = -0x800000; // data range left when byte 6 holds a message ID
+const long dataMax24_ = 0x7FFFFF;
+
+//////////////////////////////////////////////////////////////////////////////////
+// Exported MMDevice API
+//////////////////////////////////////////////////////////////////////////////////
+MODULE_API void InitializeModuleData()
+{
+	RegisterDevice(g_StageName, MM::StageDevice, g_StageDescription);
+	RegisterDevice(g_FilterWheelName, MM::StateDevice, g_FilterWheelDescription);
+}                                                            
+
+
+MODULE_API MM::Device* CreateDevice(const char* deviceName)                  
+{
+	if (strcmp(deviceName, g_StageName) == 0)
+	{	
+		return new ZaberBinaryStage();
+	}
+	else if (strcmp(deviceName, g_FilterWheelName) == 0)
+	{	
+		return new ZaberBinaryFilterWheel();
+	}
+	else
+	{	
+		return 0;
+	}
+}
+
+
+MODULE_API void DeleteDevice(MM::Device* pDevice)
+{
+	delete pDevice;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ZaberBinaryBase (convenience parent class)
+///////////////////////////////////////////////////////////////////////////////
+
+ZaberBinaryBase::ZaberBinaryBase(MM::Device *device) :
+	initialized_(false),
+	port_("Undefined"),
+	device_(device),
+	core_(0),
+	cmdPrefix_("/"),
+	scheduler_(0),
+	messageIds_(false),
+	useMessageIds_(false),
+	originalMode_(0),
+	nativeBaud_(9600)
+{
+}
+
+
+ZaberBinaryBase::~ZaberBinaryBase()
+{
+	ClosePort();
+}
+
+
+// Attaches to the scheduler of the port, shared with the other devices on
+// it, and empties the port.
+int ZaberBinaryBase::OpenPort()
+{
+	scheduler_ = PortScheduler::Acquire(port_);
+	scheduler_->AttachRecorder(&recorder_);
+
+	// the write budget follows the line speed
+	long baud = nativeBaud_;
+	char value[MM::MaxStrLength];
+	if (nativePortPath_.empty() && core_->GetDeviceProperty(port_.c_str(), "BaudRate", value) == DEVICE_OK)
+	{
+		baud = atol(value);
+	}
+	scheduler_->SetBaudRate(baud);
+
+	if (!sessionReplayPath_.empty() && !scheduler_->IsReplaying())
+	{
+		int ret = scheduler_->Replay(sessionReplayPath_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+	else if (!nativePortPath_.empty() && !scheduler_->IsNative() && !scheduler_->IsReplaying())
+	{
+		int ret = scheduler_->UseNativePort(nativePortPath_, nativeBaud_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+	return ClearPort();
+}
+
+
+void ZaberBinaryBase::ClosePort()
+{
+	if (scheduler_ != 0)
+	{
+		scheduler_->DetachRecorder(&recorder_);
+		PortScheduler::Release(scheduler_);
+		scheduler_ = 0;
+	}
+}
+
+
+// Switches the device into message ID mode (bit 6 of the device mode).
+int ZaberBinaryBase::EnableMessageIds(long device, long axis)
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::EnableMessageIds\n", true);
+
+	int ret = GetSetting(device, axis, "mode", originalMode_);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	if ((originalMode_ & 64) == 0)
+	{
+		ret = SetSetting(device, axis, "mode", originalMode_ | 64);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
+	useMessageIds_ = true;
+	scheduler_->SetMessageIds(device, true);
+
+	long min, max;
+	if (GetLimits(device, axis, min, max) == DEVICE_OK && (min < dataMin24_ || max > dataMax24_))
+	{
+		ostringstream os;
+		os << "ZaberBinaryBase::EnableMessageIds travel [" << min << ", " << max << "] exceeds the 24-bit data range; targets are limited to [" << dataMin24_ << ", " << dataMax24_ << "]";
+		core_->LogMessage(device_, os.str().c_str(), false);
+	}
+	return DEVICE_OK;
+}
+
+
+// The device mode is stored in non-volatile memory; leave it as found.
+void ZaberBinaryBase::DisableMessageIds(long device, long axis)
+{
+	if (!useMessageIds_)
+	{
+		return;
+	}
+
+	if ((originalMode_ & 64) == 0)
+	{
+		SetSetting(device, axis, "mode", originalMode_);
+	}
+	useMessageIds_ = false;
+	scheduler_->SetMessageIds(device, false);
+}
+
+
+// Maps a command frame to its latency class, or -1 for commands not tracked.
+int ZaberBinaryBase::CommandLatencyClass(const unsigned char* command)
+{
+	switch (command[1])
+	{
+	case 1: return LatHome;
+	case 20: return LatMoveAbs;
+	case 21: return LatMoveRel;
+	case 22: return LatMoveVel;
+	case 23: return LatStop;
+	case 53: return (command[2] == 45) ? LatGetPos : LatGetSetting;
+	case 37: case 42: case 43: case 44: case 45: case 106: return LatSetSetting;
+	default: return -1;
+	}
+}
+
+// COMMUNICATION "clear buffer" utility function:
+// Drains the port until a read comes back empty, and drops any partial frame
+// held by the scheduler.
+int ZaberBinaryBase::ClearPort() const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::ClearPort\n", true);
+	return scheduler_->Clear(core_, device_);
+}
+
+
+// COMMUNICATION "send" utility function:
+int ZaberBinaryBase::SendCommand(const std::vector<unsigned char> command) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::SendCommand\n", true);
+
+	if(command.size() != stage_byte_len_) {
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+	const unsigned char* baseCommand = &command[0];
+	for (size_t i = 0; i < command.size(); i++) {
+		ostringstream co;
+		co << static_cast<unsigned int>(baseCommand[i]) << std::flush;
+		core_->LogMessage(device_, co.str().c_str(), true);
+	}
+	return scheduler_->Send(core_, device_, baseCommand);
+}
+
+
+// COMMUNICATION "send & receive" utility function:
+// Replies are matched to requests by the port scheduler, which also skips
+// stale replies and realigns frames after a lost or extra byte.
+int ZaberBinaryBase::QueryCommand(const vector<unsigned char> command, unsigned char* reply, long sleepyTimeMs, bool urgent) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::QueryCommand\n", true);
+
+	PortRequest request;
+	request.urgent = urgent;
+	int ret = SubmitCommand(command, request);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	// get drowsy if requested (moving) - this limits the damage caused by long timeouts
+	if (sleepyTimeMs > 0) {
+		CDeviceUtils::SleepMs(sleepyTimeMs);
+	}
+
+	ret = scheduler_->Wait(core_, device_, request, 10000.0);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	return FinishCommand(request, reply);
+}
+
+
+// Writes a command without waiting for its reply; the request stays in
+// flight until the scheduler matches a reply to it.
+int ZaberBinaryBase::SubmitCommand(const vector<unsigned char>& command, PortRequest& request) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::SubmitCommand\n", true);
+
+	if (command.size() != stage_byte_len_) {
+		return DEVICE_INVALID_INPUT_PARAM;
+	}
+	for (unsigned long i = 0; i < stage_byte_len_; i++)
+	{
+		request.frame[i] = command[i];
+	}
+
+	return scheduler_->Submit(core_, device_, request);
+}
+
+
+// Hands out the reply of a completed request and records its latency.
+int ZaberBinaryBase::FinishCommand(const PortRequest& request, unsigned char* reply) const
+{
+	if (request.result != DEVICE_OK)
+	{
+		return request.result;
+	}
+
+	for (unsigned long i = 0; i < stage_byte_len_; i++)
+	{
+		reply[i] = request.reply[i];
+	}
+
+	double latencyUs = (request.doneTime - request.sentTime).getUsec();
+	int latencyClass = CommandLatencyClass(request.frame);
+	if (latencyClass >= 0)
+	{
+		commandLatency_[latencyClass].Record(latencyUs);
+	}
+
+	// byte #2 is 255 if an error occurred; the data is the device's error code
+	if (reply[1] == 255) {
+		long code = ReplyData(reply);
+		ostringstream os;
+		os << "ZaberBinaryBase::FinishCommand device error code " << code
+			<< " for command " << (int) request.frame[1];
+		core_->LogMessage(device_, os.str().c_str(), false);
+		return DeviceErrorResult(code);
+	}
+
+	return DEVICE_OK;
+}
+
+
+// Maps a device error code onto the adapter's error codes, so that it
+// cannot be mistaken for one of the core's.
+int ZaberBinaryBase::DeviceErrorResult(long code)
+{
+	switch (code)
+	{
+	case 20: // absolute move target out of range
+	case 21: // relative move target out of range
+		return ERR_POSITION_OUT_OF_RANGE;
+	case 22: // velocity out of range
+	case 37: // resolution
+	case 42: // speed
+	case 43: // acceleration
+	case 44: // limit.max
+	case 45: // position
+	case 106: // limit.min
+		return ERR_SETTING_FAILED;
+	case 64: // unknown command
+		return DEVICE_UNSUPPORTED_COMMAND;
+	default:
+		return ERR_COMMAND_REJECTED;
+	}
+}
+
+
+int ZaberBinaryBase::GetSetting(long device, long axis, string setting, long& data) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::GetSetting\n", true);
+
+	/*
+	Byte_1 = device (0 or 1; shouldn't matter)
+	Byte_2 = 53 (Return Setting command)
+	Byte_3 - Byte_6: if setting is resolution, 37 (note that this is microstep resolution)
+					 if setting is position, 45
+					 if setting is maxspeed, 42 (this is the target speed not the max speed, but close enough)
+					 if setting is accel, 43
+					 if setting is limit.min, 106
+					 if setting is limit.max, 44
+	*/
+	unordered_map<string, unsigned char> commandDict;
+	commandDict["resolution"] = 37;
+	commandDict["pos"] = 45;
+	commandDict["maxspeed"] = 42;
+	commandDict["accel"] = 43;
+	commandDict["limit.min"] = 106;
+	commandDict["limit.max"] = 44;
+	commandDict["mode"] = 40;
+
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	// maybe device is 0??
+	cmd[0] = device;
+	cmd[1] = 53;
+	cmd[2] = commandDict[setting];
+
+	unsigned char resp[stage_byte_len_] = {0};
+	int ret = QueryCommand(cmd, resp);
+
+	if (ret != DEVICE_OK) 
+	{
+		// consider alert-ing or printing the error
+		return ret;
+	}
+
+	// extract data
+	// NOTE: byte to long conversion happens here!!!
+
+	core_->LogMessage(device_, "Heard response, before byte conversion ", true);
+	data = ReplyData(resp);
+
+	ostringstream co;
+	co << "Data after byte to long conversion " << data << std::flush;
+	core_->LogMessage(device_, co.str().c_str(), true);
+
+	return DEVICE_OK;
+}
+
+
+// Bytes #3-6 of a reply hold a signed 32-bit value, least significant byte first.
+long ZaberBinaryBase::ReplyData(const unsigned char* reply)
+{
+	return DecodeData(&reply[2]);
+}
+
+
+// Packs the low 32 bits of data into four bytes, least significant first;
+// negative values come out in two's complement.
+void ZaberBinaryBase::EncodeData(long data, unsigned char* bytes)
+{
+	unsigned long value = (unsigned long) data;
+	bytes[0] = (unsigned char) (value & 0xFF);
+	bytes[1] = (unsigned char) ((value >> 8) & 0xFF);
+	bytes[2] = (unsigned char) ((value >> 16) & 0xFF);
+	bytes[3] = (unsigned char) ((value >> 24) & 0xFF);
+}
+
+
+// Inverse of EncodeData. The sign is extended explicitly since long is 32
+// bits with Visual Studio but 64 bits on other platforms.
+long ZaberBinaryBase::DecodeData(const unsigned char* bytes)
+{
+	unsigned long value = (unsigned long) bytes[0] | ((unsigned long) bytes[1] << 8)
+		| ((unsigned long) bytes[2] << 16) | ((unsigned long) bytes[3] << 24);
+	value &= 0xFFFFFFFFUL;
+	return (long) ((value & 0x80000000UL) ? (long long) value - 0x100000000LL : (long long) value);
+}
+
+
+int ZaberBinaryBase::SetSetting(long device, long axis, string setting, long data) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::SetSetting\n", true);
+
+	/*
+	Byte_1 = device (0 or 1; shouldn't matter)
+	Byte_2 = if setting is resolution, 37 (note that this is microstep resolution)
+			 if setting is position, 45
+			 if setting is maxspeed, 42 (this is the target speed not the max speed, but close enough)
+			 if setting is accel, 43
+	Byte_3 - Byte_6 = data (base 256 backwards)
+	*/
+
+	unordered_map<string, unsigned char> commandDict;
+	commandDict["resolution"] = 37;
+	commandDict["pos"] = 45;
+	commandDict["maxspeed"] = 42;
+	commandDict["accel"] = 43;
+	commandDict["limit.min"] = 106;
+	commandDict["limit.max"] = 44;
+	commandDict["mode"] = 40;
+
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	// maybe device is 0??
+	cmd[0] = device;
+	cmd[1] = commandDict[setting];
+	if (!FitsDataField(data))
+	{
+		return ERR_SETTING_FAILED;
+	}
+	EncodeData(data, &cmd[2]);
+
+	unsigned char resp[stage_byte_len_] = {0};
+	int ret = QueryCommand(cmd, resp);
+	if (ret != DEVICE_OK)
+	{
+		return ERR_SETTING_FAILED;
+	}
+
+	// keep the cached travel limits current
+	if (setting == "limit.min" || setting == "limit.max")
+	{
+		MMThreadGuard guard(limitsLock_);
+		map<long, pair<long, long> >::iterator it = limits_.find((device << 8) | axis);
+		if (it != limits_.end())
+		{
+			(setting == "limit.min" ? it->second.first : it->second.second) = data;
+		}
+	}
+
+	return DEVICE_OK;
+}
+
+
+// Busy unless the device status is idle (0) or parked (65).
+bool ZaberBinaryBase::IsBusy(long device) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::IsBusy\n", true);
+
+	long status;
+	int ret = GetStatus(device, status);
+	if (ret != DEVICE_OK)
+	{
+		ostringstream os;
+		os << "SendSerialCommand failed in ZaberBinaryBase::IsBusy, error code: " << ret;
+		core_->LogMessage(device_, os.str().c_str(), false);
+		return false;
+	}
+	return status != 0 && status != 65;
+}
+
+
+// "Return Status" (54): 0 idle, 1 homing, 10 manual move, 20 moving to an
+// absolute position, 23 stopping, 65 parked, among others.
+int ZaberBinaryBase::GetStatus(long device, long& status) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::GetStatus\n", true);
+
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	cmd[0] = (unsigned char) device;
+	cmd[1] = 54;
+
+	unsigned char resp[stage_byte_len_] = {0};
+	int ret = QueryCommand(cmd, resp);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	status = ReplyData(resp);
+	return DEVICE_OK;
+}
+
+
+int ZaberBinaryBase::Stop(long device, long* replyData) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::Stop\n", true);
+
+	/*
+	Byte_1 = device (0 or 1; shouldn't matter)
+	Byte_2 = 23
+	Byte_3-Byte_6 = ignored
+	n.b. ASCII stop returns 0, whereas binary stop returns the final position
+	*/
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	// maybe device is 0??
+	cmd[0] = device;
+	cmd[1] = 23;
+
+	// written ahead of anything queued; its reply also answers the move it
+	// interrupts
+	unsigned char resp[stage_byte_len_] = {0};
+	int ret = QueryCommand(cmd, resp, 0, true);
+	if (ret == DEVICE_OK && replyData != 0)
+	{
+		*replyData = ReplyData(resp);
+	}
+	return ret;
+}
+
+
+// Read from the device the first time only.
+int ZaberBinaryBase::GetLimits(long device, long axis, long& min, long& max) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::GetLimits\n", true);
+
+	long key = (device << 8) | axis;
+	{
+		MMThreadGuard guard(limitsLock_);
+		map<long, pair<long, long> >::const_iterator it = limits_.find(key);
+		if (it != limits_.end())
+		{
+			min = it->second.first;
+			max = it->second.second;
+			return DEVICE_OK;
+		}
+	}
+
+	int ret = GetSetting(device, axis, "limit.min", min);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = GetSetting(device, axis, "limit.max", max);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	// another thread may have stored them meanwhile, and perhaps updated
+	// them since; its entry is kept
+	MMThreadGuard guard(limitsLock_);
+	limits_.insert(make_pair(key, make_pair(min, max)));
+	return DEVICE_OK;
+}
+
+
+// Checks a target against the travel limits of the axis before it is sent,
+// so an unreachable target fails without a round trip. With clamp set, the
+// target is moved to the nearest limit instead.
+int ZaberBinaryBase::LimitTarget(long device, long axis, long& steps, bool clamp) const
+{
+	long min, max;
+	int ret = GetLimits(device, axis, min, max);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	// with message IDs only 24 bits of data reach the device
+	if (useMessageIds_)
+	{
+		if (min < dataMin24_) min = dataMin24_;
+		if (max > dataMax24_) max = dataMax24_;
+	}
+
+	if (steps >= min && steps <= max)
+	{
+		return DEVICE_OK;
+	}
+	if (!clamp)
+	{
+		return ERR_POSITION_OUT_OF_RANGE;
+	}
+
+	ostringstream os;
+	os << "ZaberBinaryBase::LimitTarget clamped " << steps << " to [" << min << ", " << max << "]";
+	core_->LogMessage(device_, os.str().c_str(), true);
+	steps = (steps < min) ? min : max;
+	return DEVICE_OK;
+}
+
+
+// True when data survives the frame unchanged; message IDs take the top byte.
+bool ZaberBinaryBase::FitsDataField(long data) const
+{
+	return !useMessageIds_ || (data >= dataMin24_ && data <= dataMax24_);
+}
+
+
+int ZaberBinaryBase::SendMoveCommand(long device, long axis, std::string type, long data, long* replyData) const
+{
+	core_->LogMessage(device_, "ZaberBinaryBase::SendMoveCommand\n", true);
+
+	
+	/*
+	long travel;
+	if (type == "abs") {
+		int ret = GetSetting(deviceAddress_, axis, "pos", travel);
+		travel = data - travel;
+	} else if (type == "rel") {
+		travel = data;
+	} else {
+		travel = 0;
+	}
+
+	if (travel < 0){
+		travel = -travel;
+	}
+	// Long travels make you sleepy
+	double sleepyTimeFloat = 0;
+	long speedData = -1;
+	double speed = 0;
+	if (travel > 100) {
+		int ret = GetSetting(deviceAddress_, axis, "maxspeed", speedData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		// convert to um/ms
+		speed = (speedData/convFactor_)*stepSizeUm_/(double) 1000;
+		
+		sleepyTimeFloat = (double) travel / 6.4 / 10.0 / speed - (double) 250;
+		if (sleepyTimeFloat < 0)
+			sleepyTimeFloat = 0;
+	}
+	long sleepyTimeMs = sleepyTimeFloat;
+	ostringstream os;
+	os << "Calculated speed (um/ms): " << speed << " Sleepy time float: " << sleepyTimeFloat << " Sleeping for: " << sleepyTimeMs << " ms" << " Travel (steps): " << travel << " Speed (?? units): " << speedData;
+	core_->LogMessage(device_, os.str().c_str(), true);
+	os.clear();
+	os.str("");
+	*/
+
+	if (!FitsDataField(data))
+	{
+		return ERR_POSITION_OUT_OF_RANGE;
+	}
+
+	vector<unsigned char> cmd;
+	BuildMoveCommand(device, type, data, cmd);
+
+	unsigned char resp[stage_byte_len_] = {0};
+	long sleepyTimeMs = 0;
+	int ret = QueryCommand(cmd, resp, sleepyTimeMs);
+	if (ret == DEVICE_OK && replyData != 0)
+	{
+		// move replies carry the position the axis stopped at
+		*replyData = ReplyData(resp);
+	}
+	return ret;
+}
+
+
+void ZaberBinaryBase::BuildMoveCommand(long device, std::string type, long data, std::vector<unsigned char>& cmd) const
+{
+	/*
+	Byte_1 = device (0 or 1; shouldn't matter)
+	Byte_2 = if type is 'abs', 20
+			 if type is 'rel', 21
+			 if type is 'vel', 22
+	Byte_3 - Byte_6 = data (base 256 backwards)
+	*/
+	unordered_map<string, unsigned char> commandDict;
+	commandDict["abs"] = 20;
+	commandDict["rel"] = 21;
+	commandDict["vel"] = 22;
+	ostringstream os;
+	cmd.assign(stage_byte_len_, 0);
+	// maybe device is 0??
+	cmd[0] = device;
+	cmd[1] = commandDict[type];
+
+	os << "Trying to move by: " << data;
+	core_->LogMessage(device_, os.str().c_str(), true);
+	EncodeData(data, &cmd[2]);
+}
@@ -0,0 +1,115 @@
+#ifndef _ZABER_BINARY_H_
+#define _ZABER_BINARY_H_
+
+#include <MMDevice.h>
+#include <DeviceBase.h>
+#include <ModuleInterface.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include "FlightRecorder.h"
+#include "LatencyHistogram.h"
+#include "PortScheduler.h"
+#include "../ZaberCommon/MotionModel.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Various constants: error codes, error messages
+//////////////////////////////////////////////////////////////////////////////
+
+#define ERR_PORT_CHANGE_FORBIDDEN    10002
+#define ERR_DRIVER_DISABLED          10004
+#define ERR_BUSY_TIMEOUT             10008
+#define ERR_AXIS_COUNT               10016
+#define ERR_COMMAND_REJECTED         10032
+#define	ERR_NO_REFERENCE_POS         10064
+#define	ERR_SETTING_FAILED           10128
+#define	ERR_INVALID_DEVICE_NUM       10256
+#define	ERR_POSITION_OUT_OF_RANGE    14096
+#define	ERR_COMMAND_PREEMPTED        18192 // a queued move discarded by a stop
+#define	ERR_FEED_SLOT_IN_USE         26384
+
+extern const char* g_Msg_PORT_CHANGE_FORBIDDEN;
+extern const char* g_Msg_DRIVER_DISABLED;
+extern const char* g_Msg_BUSY_TIMEOUT;
+extern const char* g_Msg_AXIS_COUNT;
+extern const char* g_Msg_COMMAND_REJECTED;
+extern const char* g_Msg_NO_REFERENCE_POS;
+extern const char* g_Msg_SETTING_FAILED;
+extern const char* g_Msg_INVALID_DEVICE_NUM;
+extern const char* g_Msg_COMMAND_PREEMPTED;
+extern const char* g_Msg_POSITION_OUT_OF_RANGE;
+extern const char* g_Msg_FEED_SLOT_IN_USE;
+
+// Binary frames are 6 bytes: device number, command number, 4 data bytes
+extern const unsigned long stage_byte_len_;
+
+// Allowance on top of the predicted move time before a move reply is lost
+extern const double g_MoveReplyMarginMs;
+
+// Binary protocol helpers shared by the devices in this module. Devices on
+// the same port share one PortScheduler.
+class ZaberBinaryBase
+{
+public:
+	ZaberBinaryBase(MM::Device *device);
+	virtual ~ZaberBinaryBase();
+
+protected:
+	int OpenPort();
+	void ClosePort();
+	int EnableMessageIds(long device, long axis);
+	void DisableMessageIds(long device, long axis);
+	int ClearPort() const;
+	int SendCommand(const std::vector<unsigned char> command) const;
+	int QueryCommand(const std::vector<unsigned char> command, unsigned char* reply, long sleepyTimeMs=0, bool urgent=false) const;
+	int SubmitCommand(const std::vector<unsigned char>& command, PortRequest& request) const;
+	int FinishCommand(const PortRequest& request, unsigned char* reply) const;
+	int GetSetting(long device, long axis, std::string setting, long& data) const;
+	int SetSetting(long device, long axis, std::string setting, long data) const;
+	bool IsBusy(long device) const;
+	int GetStatus(long device, long& status) const;
+	int Stop(long device, long* replyData=0) const;
+	int GetLimits(long device, long axis, long& min, long& max) const;
+	int LimitTarget(long device, long axis, long& steps, bool clamp) const;
+	bool FitsDataField(long data) const;
+	int SendMoveCommand(long device, long axis, std::string type, long data, long* replyData=0) const;
+	void BuildMoveCommand(long device, std::string type, long data, std::vector<unsigned char>& cmd) const;
+	static long ReplyData(const unsigned char* reply);
+	static void EncodeData(long data, unsigned char* bytes);
+	static long DecodeData(const unsigned char* bytes);
+
+	// Latency statistics are kept per command class on the wire.
+	enum LatencyCommand
+	{
+		LatGetPos, LatGetSetting, LatSetSetting, LatMoveAbs, LatMoveRel, LatMoveVel,
+		LatStop, LatHome, LatCommandCount
+	};
+	static int CommandLatencyClass(const unsigned char* command);
+	static int DeviceErrorResult(long code);
+
+	bool initialized_;
+	std::string port_;
+	MM::Device *device_;
+	MM::Core *core_;
+	std::string cmdPrefix_;
+	PortScheduler* scheduler_;
+	mutable FlightRecorder recorder_;
+	mutable LatencyHistogram commandLatency_[LatCommandCount];
+	bool messageIds_;    // requested through the pre-init property
+	bool useMessageIds_; // device mode switched, frames carry IDs
+	long originalMode_;
+	std::string sessionReplayPath_; // plays a recorded session in place of the port
+	std::string nativePortPath_;    // tty used directly instead of the port, Linux only
+	long nativeBaud_;
+
+private:
+	// Travel limits in steps, by device << 8 | axis. Read once and updated
+	// when set through SetSetting, from any thread that moves or sets up the
+	// axis; the lock is never held for serial I/O.
+	mutable std::map<long, std::pair<long, long> > limits_;
+	mutable MMThreadLock limitsLock_;
+};
+
+#endif //_ZABER_BINARY_H_
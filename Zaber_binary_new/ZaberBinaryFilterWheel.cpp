@@ -0,0 +1,446 @@
+#ifdef WIN32
+#define snprintf _snprintf 
+#pragma warning(disable: 4355)
+#endif
+
+#include "ZaberBinaryFilterWheel.h"
+
+using namespace std;
+
+const char* g_FilterWheelName = "FilterWheel";
+const char* g_FilterWheelDescription = "Zaber Filter Wheel";
+
+// Stored positions are numbered 0 to 15 on the device.
+const long g_MaxStoredPositions = 16;
+
+ZaberBinaryFilterWheel::ZaberBinaryFilterWheel() :
+	ZaberBinaryBase(this),
+	deviceAddress_(1),
+	numPositions_(6),
+	convFactor_(1.6384), // not very informative name
+	revolution_(0),
+	state_(0),
+	moveInFlight_(false)
+{
+	this->LogMessage("FilterWheel::FilterWheel\n", true);
+
+	InitializeDefaultErrorMessages();
+	SetErrorText(ERR_PORT_CHANGE_FORBIDDEN, g_Msg_PORT_CHANGE_FORBIDDEN);
+	SetErrorText(ERR_DRIVER_DISABLED, g_Msg_DRIVER_DISABLED);
+	SetErrorText(ERR_BUSY_TIMEOUT, g_Msg_BUSY_TIMEOUT);
+	SetErrorText(ERR_COMMAND_REJECTED, g_Msg_COMMAND_REJECTED);
+	SetErrorText(ERR_SETTING_FAILED, g_Msg_SETTING_FAILED);
+	SetErrorText(ERR_COMMAND_PREEMPTED, g_Msg_COMMAND_PREEMPTED);
+
+	// Pre-initialization properties
+	CreateProperty(MM::g_Keyword_Name, g_FilterWheelName, MM::String, true);
+
+	CreateProperty(MM::g_Keyword_Description, "Zaber filter wheel driver adapter", MM::String, true);
+
+	CPropertyAction* pAct = new CPropertyAction (this, &ZaberBinaryFilterWheel::OnPort);
+	CreateProperty(MM::g_Keyword_Port, "COM1", MM::String, false, pAct, true);
+
+	pAct = new CPropertyAction (this, &ZaberBinaryFilterWheel::OnDeviceAddress);
+	CreateIntegerProperty("Controller Device Number", deviceAddress_, false, pAct, true);
+	SetPropertyLimits("Controller Device Number", 1, 99);
+
+	pAct = new CPropertyAction (this, &ZaberBinaryFilterWheel::OnNumPositions);
+	CreateIntegerProperty("Number of Positions", numPositions_, false, pAct, true);
+	SetPropertyLimits("Number of Positions", 1, g_MaxStoredPositions);
+}
+
+ZaberBinaryFilterWheel::~ZaberBinaryFilterWheel()
+{
+	this->LogMessage("FilterWheel::~FilterWheel\n", true);
+	Shutdown();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// State & Device API methods
+///////////////////////////////////////////////////////////////////////////////
+
+void ZaberBinaryFilterWheel::GetName(char* name) const
+{
+	CDeviceUtils::CopyLimitedString(name, g_FilterWheelName);
+}
+
+int ZaberBinaryFilterWheel::Initialize()
+{
+	if (initialized_) return DEVICE_OK;
+
+	core_ = GetCoreCallback();
+
+	this->LogMessage("FilterWheel::Initialize\n", true);
+
+	int ret = OpenPort();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	// Speed and acceleration for the motion model, in steps/s and steps/s^2.
+	long speedData, accelData;
+	ret = GetSetting(deviceAddress_, 0, "maxspeed", speedData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = GetSetting(deviceAddress_, 0, "accel", accelData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	motion_.SetLimits(speedData/convFactor_, accelData*10000/convFactor_);
+
+	// On a rotary device the maximum position is one full turn.
+	ret = GetSetting(deviceAddress_, 0, "limit.max", revolution_);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	storedPositions_.resize(numPositions_);
+	for (long i = 0; i < numPositions_; i++)
+	{
+		ret = GetStoredPosition(i, storedPositions_[i]);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
+
+	// The current state is the stored position nearest to the wheel.
+	long steps;
+	ret = GetCurrentSteps(steps);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	long nearest = -1;
+	for (long i = 0; i < numPositions_; i++)
+	{
+		long d = labs(steps - storedPositions_[i]);
+		if (revolution_ > 0)
+		{
+			d %= revolution_;
+			d = min(d, revolution_ - d);
+		}
+		if (nearest < 0 || d < nearest)
+		{
+			nearest = d;
+			state_ = i;
+		}
+	}
+
+	CPropertyAction* pAct = new CPropertyAction (this, &ZaberBinaryFilterWheel::OnState);
+	ret = CreateIntegerProperty(MM::g_Keyword_State, state_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits(MM::g_Keyword_State, 0, numPositions_ - 1);
+
+	pAct = new CPropertyAction (this, &CStateBase::OnLabel);
+	ret = CreateStringProperty(MM::g_Keyword_Label, "", false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	for (long i = 0; i < numPositions_; i++)
+	{
+		ostringstream label;
+		label << "Filter " << i + 1;
+		SetPositionLabel(i, label.str().c_str());
+	}
+
+	ret = UpdateStatus();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	initialized_ = true;
+	return DEVICE_OK;
+}
+
+int ZaberBinaryFilterWheel::Shutdown()
+{
+	this->LogMessage("FilterWheel::Shutdown\n", true);
+	if (initialized_)
+	{
+		DropMove();
+		initialized_ = false;
+	}
+	ClosePort();
+	return DEVICE_OK;
+}
+
+// A state change is done as soon as the device answers the move, and an
+// error reply ends it at once. A reply that has not come by the predicted
+// arrival plus a margin is taken as lost; then the device is asked.
+bool ZaberBinaryFilterWheel::Busy()
+{
+	this->LogMessage("FilterWheel::Busy\n", true);
+
+	{
+		MMThreadGuard guard(moveLock_);
+		if (!moveInFlight_)
+		{
+			return false;
+		}
+
+		int ret = PumpMove();
+		if (ret != DEVICE_OK)
+		{
+			ostringstream os;
+			os << "PumpMove failed in ZaberBinaryFilterWheel::Busy, error code: " << ret;
+			this->LogMessage(os.str().c_str(), false);
+		}
+		if (!moveInFlight_)
+		{
+			return false;
+		}
+		if (GetCurrentMMTime() <= moveDeadline_)
+		{
+			return true;
+		}
+
+		this->LogMessage("FilterWheel::Busy no reply to the move, asking the device\n", false);
+		scheduler_->Cancel(moveRequest_);
+		moveInFlight_ = false;
+		motion_.Invalidate();
+	}
+	return IsBusy(deviceAddress_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+// Handle changes and updates to property values.
+///////////////////////////////////////////////////////////////////////////////
+
+int ZaberBinaryFilterWheel::OnPort (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ostringstream os;
+	os << "FilterWheel::OnPort(" << pProp << ", " << eAct << ")\n";
+	this->LogMessage(os.str().c_str(), false);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(port_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (initialized_)
+		{
+			// revert
+			pProp->Set(port_.c_str());
+			return ERR_PORT_CHANGE_FORBIDDEN;
+		}
+
+		pProp->Get(port_);
+	}
+
+	return DEVICE_OK;
+}
+
+int ZaberBinaryFilterWheel::OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("FilterWheel::OnDeviceAddress\n", true);
+
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(deviceAddress_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(deviceAddress_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryFilterWheel::OnNumPositions (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("FilterWheel::OnNumPositions\n", true);
+
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(numPositions_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(numPositions_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryFilterWheel::OnState (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("FilterWheel::OnState\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(state_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long state;
+		pProp->Get(state);
+		if (state < 0 || state >= numPositions_)
+		{
+			pProp->Set(state_);
+			return DEVICE_UNKNOWN_POSITION;
+		}
+
+		int ret = MoveToState(state);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		state_ = state;
+	}
+	return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Private methods
+///////////////////////////////////////////////////////////////////////////////
+
+// Command 17 "Return Stored Position" answers with the position in steps.
+int ZaberBinaryFilterWheel::GetStoredPosition(long index, long& steps) const
+{
+	core_->LogMessage(device_, "ZaberBinaryFilterWheel::GetStoredPosition\n", true);
+
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	cmd[0] = (unsigned char) deviceAddress_;
+	cmd[1] = 17;
+	cmd[2] = (unsigned char) index;
+
+	unsigned char resp[stage_byte_len_] = {0};
+	int ret = QueryCommand(cmd, resp);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	steps = ReplyData(resp);
+	return DEVICE_OK;
+}
+
+// Where the wheel is: from the motion model while it is known, otherwise
+// read from the device.
+int ZaberBinaryFilterWheel::GetCurrentSteps(long& steps)
+{
+	MM::MMTime now = GetCurrentMMTime();
+	if (motion_.IsKnown() && motion_.Estimate(now, 1e300, steps))
+	{
+		return DEVICE_OK;
+	}
+
+	int ret = GetSetting(deviceAddress_, 0, "pos", steps);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	motion_.Sync(steps, now);
+	return DEVICE_OK;
+}
+
+// Turns to the stored position of the state by the shorter way round. A
+// move still in flight is stopped first: the model only estimates where the
+// wheel has got to, while the stop reply tells exactly, so the turn from
+// there ends on the filter.
+int ZaberBinaryFilterWheel::MoveToState(long state)
+{
+	core_->LogMessage(device_, "ZaberBinaryFilterWheel::MoveToState\n", true);
+
+	MMThreadGuard guard(moveLock_);
+	long current;
+	int ret;
+	if (moveInFlight_)
+	{
+		scheduler_->Cancel(moveRequest_);
+		moveInFlight_ = false;
+		ret = ZaberBinaryBase::Stop(deviceAddress_, &current);
+		if (ret != DEVICE_OK)
+		{
+			motion_.Invalidate();
+			return ret;
+		}
+		motion_.Sync(current, GetCurrentMMTime());
+	}
+	else
+	{
+		ret = GetCurrentSteps(current);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+
+	long delta = storedPositions_[state] - current;
+	if (revolution_ > 0)
+	{
+		delta %= revolution_;
+		if (delta > revolution_ / 2)
+		{
+			delta -= revolution_;
+		}
+		else if (delta < -revolution_ / 2)
+		{
+			delta += revolution_;
+		}
+	}
+	if (delta == 0)
+	{
+		return DEVICE_OK;
+	}
+
+	vector<unsigned char> cmd;
+	BuildMoveCommand(deviceAddress_, "rel", delta, cmd);
+	MM::MMTime now = GetCurrentMMTime();
+	ret = SubmitCommand(cmd, moveRequest_);
+	if (ret != DEVICE_OK)
+	{
+		motion_.Invalidate();
+		return ret;
+	}
+	moveInFlight_ = true;
+	motion_.StartRelativeMove(delta, now);
+	moveDeadline_ = now + MM::MMTime((motion_.MoveDurationMs(delta) + g_MoveReplyMarginMs) * 1000.0);
+	return DEVICE_OK;
+}
+
+// Collects the reply of the move in flight, which carries the position the
+// wheel stopped at. Called with moveLock_ held.
+int ZaberBinaryFilterWheel::PumpMove()
+{
+	int ret = scheduler_->Poll(core_, device_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	if (!moveRequest_.done)
+	{
+		return DEVICE_OK;
+	}
+
+	moveInFlight_ = false;
+	unsigned char resp[stage_byte_len_];
+	ret = FinishCommand(moveRequest_, resp);
+	if (ret != DEVICE_OK)
+	{
+		motion_.Invalidate();
+		return ret;
+	}
+	motion_.Complete(ReplyData(resp), moveRequest_.doneTime);
+	return DEVICE_OK;
+}
+
+void ZaberBinaryFilterWheel::DropMove()
+{
+	MMThreadGuard guard(moveLock_);
+	if (moveInFlight_ && scheduler_ != 0)
+	{
+		scheduler_->Cancel(moveRequest_);
+	}
+	moveInFlight_ = false;
+}
@@ -0,0 +1,56 @@
+#ifndef _ZABER_BINARY_FILTER_WHEEL_H_
+#define _ZABER_BINARY_FILTER_WHEEL_H_
+
+#include "ZaberBinary.h"
+#include <vector>
+
+extern const char* g_FilterWheelName;
+extern const char* g_FilterWheelDescription;
+
+// Filter wheel on a rotary device. Each state is one of the positions stored
+// on the device; the wheel turns to it the shorter way round.
+class ZaberBinaryFilterWheel: public CStateDeviceBase<ZaberBinaryFilterWheel>, public ZaberBinaryBase
+{
+public:
+	ZaberBinaryFilterWheel();
+	~ZaberBinaryFilterWheel();
+
+	// Device API
+	// ----------
+	int Initialize();
+	int Shutdown();
+	void GetName(char* name) const;
+	bool Busy();
+	unsigned long GetNumberOfPositions() const {return numPositions_;}
+
+	// action interface
+	// ----------------
+	int OnPort          (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnNumPositions  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnState         (MM::PropertyBase* pProp, MM::ActionType eAct);
+
+protected:
+	int GetStoredPosition(long index, long& steps) const;
+	int GetCurrentSteps(long& steps);
+	int MoveToState(long state);
+	int PumpMove();
+	void DropMove();
+
+private:
+	long deviceAddress_;
+	long numPositions_;
+	double convFactor_;
+	long revolution_;                  // steps per full turn
+	std::vector<long> storedPositions_; // steps, indexed by state
+	long state_;
+	MotionModel motion_;
+
+	// The move is written without waiting; Busy() collects the reply.
+	PortRequest moveRequest_;
+	bool moveInFlight_;
+	MM::MMTime moveDeadline_; // the reply is taken as lost after this
+	MMThreadLock moveLock_;
+};
+
+#endif //_ZABER_BINARY_FILTER_WHEEL_H_
@@ -4,63 +4,80 @@
 #endif
 
 #include "ZaberBinaryStage.h"
+#include "ZaberAtomic.h"
 
 using namespace std;
 
-const char* g_Msg_PORT_CHANGE_FORBIDDEN = "The port cannot be changed once the device is initialized.";
-const char* g_Msg_DRIVER_DISABLED = "The driver has disabled itself due to overheating.";
-const char* g_Msg_BUSY_TIMEOUT = "Timed out while waiting for device to finish executing a command.";
-const char* g_Msg_AXIS_COUNT = "Dual-axis controller required.";
-const char* g_Msg_COMMAND_REJECTED = "The device rejected the command.";
-const char* g_Msg_NO_REFERENCE_POS = "The device has not had a reference position established.";
-const char* g_Msg_SETTING_FAILED = "The property could not be set. Is the value in the valid range?";
-const char* g_Msg_INVALID_DEVICE_NUM = "Device numbers must be in the range of 1 to 99.";
-
 const char* g_StageName = "Stage";
 const char* g_StageDescription = "Zaber Stage";
 
-const unsigned long stage_byte_len_ = 6;
-
-//////////////////////////////////////////////////////////////////////////////////
-// Exported MMDevice API
-//////////////////////////////////////////////////////////////////////////////////
-MODULE_API void InitializeModuleData()
-{
-	RegisterDevice(g_StageName, MM::StageDevice, g_StageDescription);
-}                                                            
-
-
-MODULE_API MM::Device* CreateDevice(const char* deviceName)                  
-{
-	if (strcmp(deviceName, g_StageName) == 0)
-	{	
-		return new ZaberBinaryStage();
-	}
-	else
-	{	
-		return 0;
-	}
-}
-
-
-MODULE_API void DeleteDevice(MM::Device* pDevice)
-{
-	delete pDevice;
-}
+// Property names for the latency statistics, in enum order.
+const char* g_CommandLatencyNames[] = {
+	"get pos", "get setting", "set setting", "move abs", "move rel", "move vel", "stop", "home"
+};
+const char* g_ApiLatencyNames[] = {
+	"GetPositionUm", "GetPositionSteps", "SetPositionUm", "SetRelativePositionUm",
+	"SetPositionSteps", "SetRelativePositionSteps", "Move", "Stop", "Home", "GetLimits", "Busy"
+};
+const char* g_LatencyStatNames[] = { "p50", "p99", "max" };
+const long g_LatencyStatCount = 3;
+
+// Read-only serial queue statistics, in the order OnQueueStat expects.
+const char* g_QueueStatNames[] = {
+	"Serial Queue Depth", "Serial Queue Max Depth", "Serial Requests In Flight",
+	"Serial Writes Deferred", "Serial Queue Wait Mean [ms]", "Serial Queue Wait Max [ms]"
+};
+const long g_QueueStatCount = 6;
+
+// Read-only timed move statistics, in the order OnTimedMoveStat expects.
+const char* g_TimedMoveStatNames[] = {
+	"Timed Moves Pending", "Timed Move Lead [ms]", "Timed Move Jitter p50 [ms]",
+	"Timed Move Jitter p99 [ms]", "Timed Move Jitter Max [ms]", "Timed Move Jitter Mean [ms]"
+};
+const long g_TimedMoveStatCount = 6;
 
 ZaberBinaryStage::ZaberBinaryStage() :
+	ZaberBinaryBase(this),
 	deviceAddress_(1),
 	axisNumber_(1),
 	homingTimeoutMs_(20000),
 	stepSizeUm_(0.15625),
 	convFactor_(1.6384), // not very informative name
-	cmdPrefix_("/"),
 	resolution_(64),
 	motorSteps_(200),
 	linearMotion_(2.0),
-	initialized_(false),
-	port_("Undefined"),
-	core_(0)
+	resyncIntervalMs_(0.0),
+	maxSpeedSteps_(0.0),
+	accelSteps_(0.0),
+	clampToLimits_(false),
+	moveInFlight_(false),
+	movePending_(false),
+	pendingAbsolute_(false),
+	pendingTarget_(0),
+	commandedKnown_(false),
+	commandedTarget_(0),
+	coalesceIntervalMs_(20.0),
+	movePump_(this),
+	pumpTimer_(&movePump_),
+	pumpScheduled_(false),
+	homing_(false),
+	homeError_(DEVICE_OK),
+	homeAll_(false),
+	publishPositions_(true),
+	published_(false),
+	publishedSteps_(0),
+	manualMoved_(0),
+	moveTimer_(this),
+	timedMoveUm_(0.0),
+	timedSample_(false),
+	timedLeadUs_(0.0),
+	timedJitterSumUs_(0.0),
+	timedJitterCount_(0),
+	jog_(this),
+	jogIntervalMs_(50.0),
+	jogSmoothingMs_(100.0),
+	sampler_(this),
+	samplingIntervalMs_(0.0)
 {
 	this->LogMessage("Stage::Stage\n", true);
 
@@ -70,9 +87,9 @@ ZaberBinaryStage::ZaberBinaryStage() :
 	SetErrorText(ERR_BUSY_TIMEOUT, g_Msg_BUSY_TIMEOUT);
 	SetErrorText(ERR_COMMAND_REJECTED, g_Msg_COMMAND_REJECTED);
 	SetErrorText(ERR_SETTING_FAILED, g_Msg_SETTING_FAILED);
-
-	// Used-to-be baseclass device_
-	this->device_ = this;
+	SetErrorText(ERR_COMMAND_PREEMPTED, g_Msg_COMMAND_PREEMPTED);
+	SetErrorText(ERR_POSITION_OUT_OF_RANGE, g_Msg_POSITION_OUT_OF_RANGE);
+	SetErrorText(ERR_FEED_SLOT_IN_USE, g_Msg_FEED_SLOT_IN_USE);
 
 	// Pre-initialization properties
 	CreateProperty(MM::g_Keyword_Name, g_StageName, MM::String, true);
@@ -95,6 +112,33 @@ ZaberBinaryStage::ZaberBinaryStage() :
 
 	pAct = new CPropertyAction(this, &ZaberBinaryStage::OnLinearMotion);
 	CreateFloatProperty("Linear Motion Per Motor Rev [mm]", linearMotion_, false, pAct, true);
+
+	// Message IDs let replies be matched to requests exactly, at the cost of
+	// limiting data values to 24 bits.
+	pAct = new CPropertyAction(this, &ZaberBinaryStage::OnMessageIds);
+	CreateProperty("Message IDs", "No", MM::String, false, pAct, true);
+	AddAllowedValue("Message IDs", "No");
+	AddAllowedValue("Message IDs", "Yes");
+
+	// Replaces the serial port with a session recorded through "Serial
+	// Session Recording", so the stage can be run without hardware.
+	pAct = new CPropertyAction(this, &ZaberBinaryStage::OnSessionReplay);
+	CreateProperty("Serial Session Replay File", "", MM::String, false, pAct, true);
+
+#ifdef __linux__
+	// Opens this tty directly, bypassing the serial port device, for lower
+	// and steadier latency. Empty uses the port above.
+	pAct = new CPropertyAction(this, &ZaberBinaryStage::OnNativePort);
+	CreateProperty("Native Serial Device", "", MM::String, false, pAct, true);
+
+	pAct = new CPropertyAction(this, &ZaberBinaryStage::OnNativeBaud);
+	CreateIntegerProperty("Native Serial Baud Rate", nativeBaud_, false, pAct, true);
+	AddAllowedValue("Native Serial Baud Rate", "9600");
+	AddAllowedValue("Native Serial Baud Rate", "19200");
+	AddAllowedValue("Native Serial Baud Rate", "38400");
+	AddAllowedValue("Native Serial Baud Rate", "57600");
+	AddAllowedValue("Native Serial Baud Rate", "115200");
+#endif
 }
 
 ZaberBinaryStage::~ZaberBinaryStage()
@@ -120,12 +164,45 @@ int ZaberBinaryStage::Initialize()
 	
 	this->LogMessage("Stage::Initialize\n", true);
 
-	int ret = ClearPort();
+	int ret = OpenPort();
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
 
+	if (messageIds_)
+	{
+		ret = EnableMessageIds(deviceAddress_, axisNumber_);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
+
+	// move tracking and knob movements of this device
+	scheduler_->AttachListener(deviceAddress_, this);
+	moveTimer_.SetClock(core_);
+	pumpTimer_.SetClock(core_);
+	jog_.SetClock(core_);
+	sampler_.SetClock(core_);
+
+	ret = SetUpDevice();
+	if (ret != DEVICE_OK)
+	{
+		// Shutdown() only restores an initialized device, and the mode
+		// switched for message IDs is kept in non-volatile memory.
+		scheduler_->DetachListener(deviceAddress_, this);
+		DisableMessageIds(deviceAddress_, axisNumber_);
+		return ret;
+	}
+
+	initialized_ = true;
+	return DEVICE_OK;
+}
+
+// Reads what the stage needs from the device and creates the properties.
+int ZaberBinaryStage::SetUpDevice()
+{
 	// Disable alert messages.
 	//ret = SetSetting(deviceAddress_, 0, "comm.alert", 0);
 	//if (ret != DEVICE_OK) 
@@ -134,17 +211,82 @@ int ZaberBinaryStage::Initialize()
 	//}
 
 	// Calculate step size.
-	ret = GetSetting(deviceAddress_, axisNumber_, "resolution", resolution_);
+	int ret = GetSetting(deviceAddress_, axisNumber_, "resolution", resolution_);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
 	stepSizeUm_ = ((double)linearMotion_/(double)motorSteps_)*(1/(double)resolution_)*1000;
 
+	// Speed and acceleration for the motion model, in steps/s and steps/s^2.
+	long speedData, accelData;
+	ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = GetSetting(deviceAddress_, axisNumber_, "accel", accelData);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	{
+		MMThreadGuard guard(moveLock_);
+		maxSpeedSteps_ = speedData/convFactor_;
+		accelSteps_ = accelData*10000/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+
+	// Travel limits, cached for checking targets before they are sent.
+	long limitMin, limitMax;
+	ret = ZaberBinaryBase::GetLimits(deviceAddress_, axisNumber_, limitMin, limitMax);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	ret = CreateMotionProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = CreateJogProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = CreateSamplingProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = CreateTimedMoveProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = CreateDiagnosticProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	ret = CreatePortProperties();
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	return UpdateStatus();
+}
+
+// Speed and acceleration, and how moves are checked, merged, timed and
+// reported.
+int ZaberBinaryStage::CreateMotionProperties()
+{
 	CPropertyAction* pAct;
 	// Initialize Speed (in mm/s)
 	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnSpeed);
-	ret = CreateFloatProperty("Speed [mm/s]", 0.0, false, pAct);
+	int ret = CreateFloatProperty("Speed [mm/s]", 0.0, false, pAct);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
@@ -158,749 +300,1813 @@ int ZaberBinaryStage::Initialize()
 		return ret;
 	}
 
-	ret = UpdateStatus();
+	// Positions are estimated from the move profile and only read from the
+	// device at this interval and when a move ends.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnResyncInterval);
+	ret = CreateFloatProperty("Position Resync Interval [ms]", resyncIntervalMs_, false, pAct);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
+	SetPropertyLimits("Position Resync Interval [ms]", 0, 10000);
 
-	if (ret == DEVICE_OK)
+	// Passes every position read from the device (move and stop replies,
+	// resync readings, knob tracking) on to the core as it arrives.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnPublishPositions);
+	ret = CreateProperty("Publish Position Changes", "Yes", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Publish Position Changes", "No");
+	AddAllowedValue("Publish Position Changes", "Yes");
+
+#ifdef __linux__
+	// Also writes those positions, and the sampled ones, to this POSIX
+	// shared memory segment (e.g. "/zaber-positions") for other processes.
+	// Empty turns it off. See PositionFeed.h for the layout.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnPositionFeed);
+	ret = CreateProperty("Position Feed Shared Memory", "", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
 	{
-		initialized_ = true;
+		return ret;
 	}
+#endif
 
-	return ret;
-}
+	// Moves outside the travel limits are refused before anything is sent,
+	// or clamped to the nearest limit.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnOutOfRangeMoves);
+	ret = CreateProperty("Out Of Range Moves", "Reject", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Out Of Range Moves", "Reject");
+	AddAllowedValue("Out Of Range Moves", "Clamp");
 
-int ZaberBinaryStage::Shutdown()
-{
-	this->LogMessage("Stage::Shutdown\n", true);
-	if (initialized_)
+	// Moves requested faster than this are merged; only the latest target is
+	// sent.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnCoalesceInterval);
+	ret = CreateFloatProperty("Move Coalescing Interval [ms]", coalesceIntervalMs_, false, pAct);
+	if (ret != DEVICE_OK) 
 	{
-		initialized_ = false;
+		return ret;
+	}
+	SetPropertyLimits("Move Coalescing Interval [ms]", 0, 1000);
+
+	// Home() returns at once; Busy() stays true until the device reports the
+	// home complete, or this long has passed.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnHomingTimeout);
+	ret = CreateIntegerProperty("Homing Timeout [ms]", homingTimeoutMs_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Homing Timeout [ms]", 1000, 600000);
+
+	// Homes all devices on the port in parallel with a single command.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnHomeAll);
+	ret = CreateProperty("Home All Devices", "No", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
 	}
+	AddAllowedValue("Home All Devices", "No");
+	AddAllowedValue("Home All Devices", "Yes");
+
 	return DEVICE_OK;
 }
 
-bool ZaberBinaryStage::Busy()
+// Velocity moves from Move().
+int ZaberBinaryStage::CreateJogProperties()
 {
-	this->LogMessage("Stage::Busy\n", true);
-	return IsBusy(deviceAddress_);
-}
+	CPropertyAction* pAct;
 
-int ZaberBinaryStage::GetPositionUm(double& pos)
-{
-	this->LogMessage("Stage::GetPositionUm\n", true);
-	
-	long steps;
-	int ret =  GetSetting(deviceAddress_, axisNumber_, "pos", steps);
+	// Move(velocity) may be called at any rate; the velocity sent follows
+	// it at most once per update interval, smoothed with this time constant.
+	// Move(0) stops at once.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnJogInterval);
+	int ret = CreateFloatProperty("Jog Update Interval [ms]", jogIntervalMs_, false, pAct);
 	if (ret != DEVICE_OK) 
 	{
 		return ret;
 	}
-	pos = steps * stepSizeUm_;
+	SetPropertyLimits("Jog Update Interval [ms]", 5, 1000);
+
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnJogSmoothing);
+	ret = CreateFloatProperty("Jog Smoothing [ms]", jogSmoothingMs_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Jog Smoothing [ms]", 0, 2000);
+
+	CPropertyActionEx* pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnJogStat, 0);
+	ret = CreateIntegerProperty("Jog Setpoints Received", 0, true, pActEx);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnJogStat, 1);
+	ret = CreateIntegerProperty("Jog Commands Sent", 0, true, pActEx);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::GetPositionSteps(long& steps)
+// Background position sampling.
+int ZaberBinaryStage::CreateSamplingProperties()
 {
-	this->LogMessage("Stage::GetPositionSteps\n", true);
-	return GetSetting(deviceAddress_, axisNumber_, "pos", steps);
-}
+	CPropertyAction* pAct;
+	CPropertyActionEx* pActEx;
 
-int ZaberBinaryStage::SetPositionUm(double pos)
-{
-	this->LogMessage("Stage::SetPositionUm\n", true);
-	long steps = nint(pos/stepSizeUm_);
-	return SetPositionSteps(steps);
-}
+	// With a sampling interval set, the position is read in the background
+	// and kept with its time. Setting "Sampled Position Time [ms]" to an MM
+	// time makes "Sampled Position [um]" the position interpolated there.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnSamplingInterval);
+	int ret = CreateFloatProperty("Position Sampling Interval [ms]", samplingIntervalMs_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Position Sampling Interval [ms]", 0, 1000);
 
-int ZaberBinaryStage::SetRelativePositionUm(double d)
-{
-	this->LogMessage("Stage::SetRelativePositionUm\n", true);
-	long steps = nint(d/stepSizeUm_);
-	return SetRelativePositionSteps(steps);
-}
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnSampledPositionTime);
+	ret = CreateFloatProperty("Sampled Position Time [ms]", 0.0, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-int ZaberBinaryStage::SetPositionSteps(long steps)
-{
-	this->LogMessage("Stage::SetPositionSteps\n", true);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "abs", steps);
-}
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnSampledPosition);
+	ret = CreateFloatProperty("Sampled Position [um]", 0.0, true, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-int ZaberBinaryStage::SetRelativePositionSteps(long steps)
-{
-	this->LogMessage("Stage::SetRelativePositionSteps\n", true);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "rel", steps);
-}
+	pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnSamplerStat, 0);
+	ret = CreateIntegerProperty("Position Samples Taken", 0, true, pActEx);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnSamplerStat, 1);
+	ret = CreateIntegerProperty("Position Samples Dropped", 0, true, pActEx);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnSamplerStat, 2);
+	ret = CreateIntegerProperty("Position Sample Errors", 0, true, pActEx);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-int ZaberBinaryStage::Move(double velocity)
-{
-	this->LogMessage("Stage::Move\n", true);
-	// convert velocity from mm/s to Zaber data value
-	long velData = nint(velocity*convFactor_*1000/stepSizeUm_);
-	return SendMoveCommand(deviceAddress_, axisNumber_, "vel", velData);
+	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::Stop()
+// Moves written to the port at a given time.
+int ZaberBinaryStage::CreateTimedMoveProperties()
 {
-	this->LogMessage("Stage::Stop\n", true);
-	return ZaberBinaryStage::Stop(deviceAddress_);
-}
+	CPropertyAction* pAct;
 
-int ZaberBinaryStage::Home()
-{
-	this->LogMessage("Stage::Home\n", true);
+	// Setting the time (MM time in ms, as from GetCurrentMMTime) schedules a
+	// move to the timed move position, written to the port at that time.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnTimedMovePosition);
+	int ret = CreateFloatProperty("Timed Move Position [um]", timedMoveUm_, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = 1;
-	cmd[1] = 1;
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnTimedMoveTime);
+	ret = CreateFloatProperty("Timed Move Time [ms]", 0.0, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
 
-	unsigned char resp[stage_byte_len_] = {0};
-	return QueryCommand(cmd, resp);
-}
+	for (long stat = 0; stat < g_TimedMoveStatCount; stat++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnTimedMoveStat, stat);
+		ret = (stat < 1) ? CreateIntegerProperty(g_TimedMoveStatNames[stat], 0, true, pActEx)
+			: CreateFloatProperty(g_TimedMoveStatNames[stat], 0.0, true, pActEx);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
 
-int ZaberBinaryStage::SetAdapterOriginUm(double /*d*/)
-{
-	this->LogMessage("Stage::SetAdapterOriginUm\n", true);
-	return DEVICE_UNSUPPORTED_COMMAND;
+	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::SetOrigin()
+// This device's flight recorder and latency statistics.
+int ZaberBinaryStage::CreateDiagnosticProperties()
 {
-	this->LogMessage("Stage::SetOrigin\n", true);
-	return DEVICE_UNSUPPORTED_COMMAND;
+	CPropertyAction* pAct;
+
+	// Records every frame on the wire with timestamps; setting the dump file
+	// writes the recorded frames to it.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnFlightRecorder);
+	int ret = CreateProperty("Flight Recorder", "Off", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Flight Recorder", "Off");
+	AddAllowedValue("Flight Recorder", "On");
+
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnFlightRecorderDump);
+	ret = CreateProperty("Flight Recorder Dump File", "", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	// Read-only latency statistics: first the command classes, then the
+	// API methods, each with p50, p99 and max.
+	const long histogramCount = LatCommandCount + ApiCount;
+	for (long h = 0; h < histogramCount; h++)
+	{
+		for (long stat = 0; stat < g_LatencyStatCount; stat++)
+		{
+			ostringstream name;
+			name << "Latency " << (h < LatCommandCount ? g_CommandLatencyNames[h] : g_ApiLatencyNames[h - LatCommandCount])
+				<< " " << g_LatencyStatNames[stat] << " [ms]";
+			CPropertyActionEx* pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnLatency, h*g_LatencyStatCount + stat);
+			ret = CreateFloatProperty(name.str().c_str(), 0.0, true, pActEx);
+			if (ret != DEVICE_OK) 
+			{
+				return ret;
+			}
+		}
+	}
+
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnLatencyReset);
+	ret = CreateProperty("Reset Latency Statistics", "No", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	AddAllowedValue("Reset Latency Statistics", "No");
+	AddAllowedValue("Reset Latency Statistics", "Yes");
+
+	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::GetLimits(double& lower, double& upper) //EJ: confusing!
+// Settings and statistics of the port, shared by every device on it. They
+// live in the port's scheduler, so all devices show the values in force and
+// setting one on any device changes it for all.
+int ZaberBinaryStage::CreatePortProperties()
 {
-	this->LogMessage("Stage::GetLimits\n", true);
+	CPropertyAction* pAct;
 
-	long min, max;
-	int ret = ZaberBinaryStage::GetLimits(deviceAddress_, axisNumber_, min, max);
-	if (ret != DEVICE_OK)
+	// Records all bytes written to and read from the port, with their
+	// timing, to a session file for replay; an empty name stops recording.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnSessionRecording);
+	int ret = CreateProperty("Serial Session Recording File", "", MM::String, false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	if (scheduler_->IsReplaying())
+	{
+		// Writes that differ from the recorded session.
+		pAct = new CPropertyAction (this, &ZaberBinaryStage::OnReplayMismatches);
+		ret = CreateIntegerProperty("Serial Session Replay Mismatches", 0, true, pAct);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
+
+	// Number of bytes dropped to realign reply frames.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnResyncCount);
+	ret = CreateIntegerProperty("Frame Resyncs", 0, true, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+
+	// Writes are paced to the baud rate of the port and to what the devices
+	// can buffer; submitters wait while this many requests are queued.
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnQueueLimit);
+	ret = CreateIntegerProperty("Serial Queue Limit", scheduler_->QueueLimit(), false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Serial Queue Limit", 0, 1000);
+
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnDeviceBuffer);
+	ret = CreateIntegerProperty("Device Input Buffer [frames]", scheduler_->DeviceBuffer(), false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Device Input Buffer [frames]", 1, 64);
+
+	pAct = new CPropertyAction (this, &ZaberBinaryStage::OnDeviceInterval);
+	ret = CreateFloatProperty("Device Command Interval [ms]", scheduler_->DeviceIntervalMs(), false, pAct);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	SetPropertyLimits("Device Command Interval [ms]", 0, 100);
+
+	for (long stat = 0; stat < g_QueueStatCount; stat++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx (this, &ZaberBinaryStage::OnQueueStat, stat);
+		ret = (stat < 4) ? CreateIntegerProperty(g_QueueStatNames[stat], 0, true, pActEx)
+			: CreateFloatProperty(g_QueueStatNames[stat], 0.0, true, pActEx);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+	}
+
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::Shutdown()
+{
+	this->LogMessage("Stage::Shutdown\n", true);
+	moveTimer_.Stop();
+	pumpTimer_.Stop();
+	jog_.Stop();
+	sampler_.Stop();
+	{
+		MMThreadGuard guard(publishLock_);
+		feed_.Close();
+	}
+	if (initialized_)
+	{
+		DropMoves();
+		DropHome();
+		DisableMessageIds(deviceAddress_, axisNumber_);
+		initialized_ = false;
+	}
+	if (scheduler_ != 0)
+	{
+		scheduler_->DetachListener(deviceAddress_, this);
+	}
+	ClosePort();
+	return DEVICE_OK;
+}
+
+bool ZaberBinaryStage::Busy()
+{
+	ScopedLatency latency(core_, apiLatency_[ApiBusy]);
+	this->LogMessage("Stage::Busy\n", true);
+
+	{
+		MMThreadGuard guard(moveLock_);
+		int ret = PumpMoves();
+		if (ret != DEVICE_OK)
+		{
+			ostringstream os;
+			os << "PumpMoves failed in ZaberBinaryStage::Busy, error code: " << ret;
+			this->LogMessage(os.str().c_str(), false);
+		}
+		if (moveInFlight_ || movePending_)
+		{
+			return true;
+		}
+
+		ret = PumpHome();
+		if (ret != DEVICE_OK)
+		{
+			ostringstream os;
+			os << "Homing failed in ZaberBinaryStage::Busy, error code: " << ret;
+			this->LogMessage(os.str().c_str(), false);
+			homeError_ = ret;
+		}
+		if (homing_)
+		{
+			return true;
+		}
+	}
+	return IsBusy(deviceAddress_);
+}
+
+int ZaberBinaryStage::GetPositionUm(double& pos)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiGetPositionUm]);
+	this->LogMessage("Stage::GetPositionUm\n", true);
+	
+	long steps;
+	int ret = GetPositionSteps(steps);
+	if (ret != DEVICE_OK) 
+	{
+		return ret;
+	}
+	pos = steps * stepSizeUm_;
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::GetPositionSteps(long& steps)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiGetPositionSteps]);
+	this->LogMessage("Stage::GetPositionSteps\n", true);
+
+	MM::MMTime now;
+	{
+		MMThreadGuard guard(moveLock_);
+		if (homeError_ != DEVICE_OK)
+		{
+			// once; the position the axis stopped at is read from then on
+			int ret = homeError_;
+			homeError_ = DEVICE_OK;
+			return ret;
+		}
+		if (AtomicCompareExchange(&manualMoved_, 1, 0))
+		{
+			motion_.Invalidate();
+			commandedKnown_ = false;
+		}
+		int ret = PumpMoves();
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+
+		now = GetCurrentMMTime();
+		if (motion_.Estimate(now, resyncIntervalMs_, steps))
+		{
+			return DEVICE_OK;
+		}
+	}
+
+	// the lock is not held across the query, so other threads can keep
+	// moving the axis meanwhile
+	int ret = GetSetting(deviceAddress_, axisNumber_, "pos", steps);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	{
+		MMThreadGuard guard(moveLock_);
+		motion_.Sync(steps, now);
+	}
+	PublishPosition(steps);
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::SetPositionUm(double pos)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiSetPositionUm]);
+	this->LogMessage("Stage::SetPositionUm\n", true);
+	long steps = nint(pos/stepSizeUm_);
+	return SetPositionSteps(steps);
+}
+
+int ZaberBinaryStage::SetRelativePositionUm(double d)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiSetRelativePositionUm]);
+	this->LogMessage("Stage::SetRelativePositionUm\n", true);
+	long steps = nint(d/stepSizeUm_);
+	return SetRelativePositionSteps(steps);
+}
+
+int ZaberBinaryStage::SetPositionSteps(long steps)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiSetPositionSteps]);
+	this->LogMessage("Stage::SetPositionSteps\n", true);
+
+	int ret = LimitTarget(deviceAddress_, axisNumber_, steps, clampToLimits_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+
+	jog_.Cancel();
+
+	// latest target wins
+	MMThreadGuard guard(moveLock_);
+	pendingAbsolute_ = true;
+	pendingTarget_ = steps;
+	movePending_ = true;
+	return PumpMoves();
+}
+
+int ZaberBinaryStage::SetRelativePositionSteps(long steps)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiSetRelativePositionSteps]);
+	this->LogMessage("Stage::SetRelativePositionSteps\n", true);
+
+	jog_.Cancel();
+
+	// Deltas add up. Once the target of the last move is known, a delta is
+	// taken from there rather than from wherever the axis is when the
+	// device receives it; only then can the target be checked here.
+	MMThreadGuard guard(moveLock_);
+	bool absolute = movePending_ ? pendingAbsolute_ : commandedKnown_;
+	long target = movePending_ ? pendingTarget_ + steps : (commandedKnown_ ? commandedTarget_ + steps : steps);
+	if (absolute)
+	{
+		int ret = LimitTarget(deviceAddress_, axisNumber_, target, clampToLimits_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+	}
+
+	pendingAbsolute_ = absolute;
+	pendingTarget_ = target;
+	movePending_ = true;
+	return PumpMoves();
+}
+
+int ZaberBinaryStage::Move(double velocity)
+{
+	ScopedLatency latency(core_, apiLatency_[ApiMove]);
+	this->LogMessage("Stage::Move\n", true);
+	CancelScheduledMoves();
+	DropMoves();
+	DropHome();
+	// convert velocity from mm/s to Zaber data value
+	long velData = nint(velocity*convFactor_*1000/stepSizeUm_);
+	return jog_.SetVelocity(velData);
+}
+
+int ZaberBinaryStage::Stop()
+{
+	ScopedLatency latency(core_, apiLatency_[ApiStop]);
+	this->LogMessage("Stage::Stop\n", true);
+	CancelScheduledMoves();
+	DropMoves();
+	DropHome();
+
+	// The stop goes out before the jog is cancelled, which waits for a jog
+	// command being sent. That command may arrive after the stop, so a jog
+	// that was on is stopped again once none can follow.
+	long finalPos;
+	int ret = ZaberBinaryBase::Stop(deviceAddress_, &finalPos);
+	if (jog_.Cancel() && ret == DEVICE_OK)
+	{
+		ret = ZaberBinaryBase::Stop(deviceAddress_, &finalPos);
+	}
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	PublishPosition(finalPos);
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::Home()
+{
+	ScopedLatency latency(core_, apiLatency_[ApiHome]);
+	this->LogMessage("Stage::Home\n", true);
+	CancelScheduledMoves();
+	jog_.Cancel();
+	DropMoves();
+	DropHome();
+	{
+		MMThreadGuard guard(moveLock_);
+		homeError_ = DEVICE_OK;
+	}
+
+	if (homeAll_)
+	{
+		// Another stage on the port may have started the homing of the
+		// whole chain already; Busy() then follows the device status.
+		long status;
+		int ret = GetStatus(deviceAddress_, status);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		if (status == 1)
+		{
+			return DEVICE_OK;
+		}
+	}
+
+	// A full-travel home can take longer than any reply timeout, so the
+	// request is left in flight and its reply collected by Busy().
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	cmd[0] = (unsigned char) (homeAll_ ? 0 : deviceAddress_);
+	cmd[1] = 1;
+	homeRequest_.replyFrom = (unsigned char) deviceAddress_;
+
+	MMThreadGuard guard(moveLock_);
+	int ret = SubmitCommand(cmd, homeRequest_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	homing_ = true;
+	homeStart_ = GetCurrentMMTime();
+	return DEVICE_OK;
+}
+
+// Writes a move to the given position at the given MM time. Several timed
+// moves may be waiting at once; one already due goes out at once.
+int ZaberBinaryStage::ScheduleMoveSteps(long steps, MM::MMTime at)
+{
+	this->LogMessage("Stage::ScheduleMoveSteps\n", true);
+	int ret = LimitTarget(deviceAddress_, axisNumber_, steps, clampToLimits_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	return moveTimer_.Schedule(at, steps);
+}
+
+// Drops the timed moves still waiting. Stop, Move and Home do this too.
+void ZaberBinaryStage::CancelScheduledMoves()
+{
+	this->LogMessage("Stage::CancelScheduledMoves\n", true);
+	moveTimer_.Clear();
+}
+
+// The position at an MM time within the sampled history, interpolated
+// between the samples either side of it. Needs position sampling on.
+int ZaberBinaryStage::GetPositionUmAt(MM::MMTime time, double& pos)
+{
+	this->LogMessage("Stage::GetPositionUmAt\n", true);
+
+	if (!sampler_.IsRunning())
+	{
+		return DEVICE_UNKNOWN_POSITION;
+	}
+	double steps;
+	int ret = sampler_.PositionAt(time, steps);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	pos = steps * stepSizeUm_;
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::SetAdapterOriginUm(double /*d*/)
+{
+	this->LogMessage("Stage::SetAdapterOriginUm\n", true);
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int ZaberBinaryStage::SetOrigin()
+{
+	this->LogMessage("Stage::SetOrigin\n", true);
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int ZaberBinaryStage::GetLimits(double& lower, double& upper) //EJ: confusing!
+{
+	ScopedLatency latency(core_, apiLatency_[ApiGetLimits]);
+	this->LogMessage("Stage::GetLimits\n", true);
+
+	long min, max;
+	int ret = ZaberBinaryBase::GetLimits(deviceAddress_, axisNumber_, min, max);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	lower = (double)min;
+	upper = (double)max;
+	return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+// Handle changes and updates to property values.
+///////////////////////////////////////////////////////////////////////////////
+
+int ZaberBinaryStage::OnPort (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ostringstream os;
+	os << "Stage::OnPort(" << pProp << ", " << eAct << ")\n";
+	this->LogMessage(os.str().c_str(), false);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(port_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		if (initialized_)
+		{
+			// revert
+			pProp->Set(port_.c_str());
+			return ERR_PORT_CHANGE_FORBIDDEN;
+		}
+
+		pProp->Get(port_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnDeviceAddress\n", true);
+
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(deviceAddress_);
+
+		ostringstream cmdPrefix;
+		cmdPrefix << "/" << deviceAddress_ << " ";
+		cmdPrefix_ = cmdPrefix.str();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(deviceAddress_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnAxisNumber (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnAxisNumber\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(axisNumber_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(axisNumber_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnSpeed (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSpeed\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		long speedData;
+		int ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		// convert to mm/s
+		double speed = (speedData/convFactor_)*stepSizeUm_/1000;
+		pProp->Set(speed);
+
+		MMThreadGuard guard(moveLock_);
+		maxSpeedSteps_ = speedData/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double speed;
+		pProp->Get(speed);
+
+		// convert to data
+		long speedData = nint(speed*convFactor_*1000/stepSizeUm_);
+		if (speedData == 0 && speed != 0) speedData = 1; // Avoid clipping to 0.
+
+		int ret = SetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		MMThreadGuard guard(moveLock_);
+		maxSpeedSteps_ = speedData/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnAccel\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		long accelData;
+		int ret = GetSetting(deviceAddress_, axisNumber_, "accel", accelData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		// convert to m/s
+		double accel = (accelData*10/convFactor_)*stepSizeUm_/1000;
+		pProp->Set(accel);
+
+		MMThreadGuard guard(moveLock_);
+		accelSteps_ = accelData*10000/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		double accel;
+		pProp->Get(accel);
+
+		// convert to data
+		long accelData = nint(accel*convFactor_*100/(stepSizeUm_));
+		if (accelData == 0 && accel != 0) accelData = 1; // Only set accel to 0 if user intended it.
+
+		int ret = SetSetting(deviceAddress_, axisNumber_, "accel", accelData);
+		if (ret != DEVICE_OK) 
+		{
+			return ret;
+		}
+
+		MMThreadGuard guard(moveLock_);
+		accelSteps_ = accelData*10000/convFactor_;
+		motion_.SetLimits(maxSpeedSteps_, accelSteps_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnMotorSteps(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnMotorSteps\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(motorSteps_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(motorSteps_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnLinearMotion(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnLinearMotion\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(linearMotion_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(linearMotion_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnResyncInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnResyncInterval\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(resyncIntervalMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(resyncIntervalMs_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnFlightRecorder(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnFlightRecorder\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(recorder_.IsEnabled() ? "On" : "Off");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		recorder_.SetEnabled(value == "On");
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnFlightRecorderDump(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnFlightRecorderDump\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(recorderDumpPath_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(recorderDumpPath_);
+		if (!recorderDumpPath_.empty())
+		{
+			return recorder_.Dump(recorderDumpPath_);
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnHomingTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnHomingTimeout\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long) homingTimeoutMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long timeoutMs;
+		pProp->Get(timeoutMs);
+		homingTimeoutMs_ = (int) timeoutMs;
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnHomeAll(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnHomeAll\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(homeAll_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		homeAll_ = (value == "Yes");
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnSessionReplay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSessionReplay\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sessionReplayPath_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(sessionReplayPath_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnNativePort(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnNativePort\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(nativePortPath_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(nativePortPath_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnNativeBaud(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnNativeBaud\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(nativeBaud_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(nativeBaud_);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnSessionRecording(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSessionRecording\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_->RecordingPath().c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string path;
+		pProp->Get(path);
+		if (path.empty())
+		{
+			scheduler_->StopRecording();
+			return DEVICE_OK;
+		}
+		return scheduler_->StartRecording(path);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnReplayMismatches(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_->ReplayMismatches());
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnPublishPositions(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnPublishPositions\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(publishPositions_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		publishPositions_ = (value == "Yes");
+
+		MMThreadGuard guard(publishLock_);
+		published_ = false;
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnPositionFeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnPositionFeed\n", true);
+
+	MMThreadGuard guard(publishLock_);
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(feedName_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string name;
+		pProp->Get(name);
+		if (name == feedName_)
+		{
+			return DEVICE_OK;
+		}
+
+		feed_.Close();
+		feedName_ = "";
+		if (name.empty())
+		{
+			return DEVICE_OK;
+		}
+		int ret = feed_.Open(name, deviceAddress_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		feedName_ = name;
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnLatency(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		long h = index / g_LatencyStatCount;
+		const LatencyHistogram& histogram = (h < LatCommandCount) ? commandLatency_[h] : apiLatency_[h - LatCommandCount];
+
+		double us;
+		switch (index % g_LatencyStatCount)
+		{
+		case 0: us = histogram.PercentileUs(50); break;
+		case 1: us = histogram.PercentileUs(99); break;
+		default: us = histogram.MaxUs(); break;
+		}
+		pProp->Set(us / 1000.0);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnLatencyReset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnLatencyReset\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set("No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		if (value == "Yes")
+		{
+			for (int i = 0; i < LatCommandCount; i++)
+			{
+				commandLatency_[i].Reset();
+			}
+			for (int i = 0; i < ApiCount; i++)
+			{
+				apiLatency_[i].Reset();
+			}
+			scheduler_->ResetStats();
+
+			MMThreadGuard guard(moveLock_);
+			timedJitter_.Reset();
+			timedJitterSumUs_ = 0.0;
+			timedJitterCount_ = 0;
+		}
+		pProp->Set("No");
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnMessageIds(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnMessageIds\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(messageIds_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		messageIds_ = (value == "Yes");
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnQueueLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnQueueLimit\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_->QueueLimit());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long limit;
+		pProp->Get(limit);
+		scheduler_->SetQueueLimit(limit);
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnDeviceBuffer(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnDeviceBuffer\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_->DeviceBuffer());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		long frames;
+		pProp->Get(frames);
+		scheduler_->SetDeviceBudget(frames, scheduler_->DeviceIntervalMs());
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnDeviceInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnDeviceInterval\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_->DeviceIntervalMs());
+	}
+	else if (eAct == MM::AfterSet)
 	{
-		return ret;
+		double intervalMs;
+		pProp->Get(intervalMs);
+		scheduler_->SetDeviceBudget(scheduler_->DeviceBuffer(), intervalMs);
 	}
-	lower = (double)min;
-	upper = (double)max;
 	return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-// Handle changes and updates to property values.
-///////////////////////////////////////////////////////////////////////////////
+int ZaberBinaryStage::OnQueueStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		PortScheduler::Stats stats;
+		scheduler_->GetStats(stats);
+		switch (index)
+		{
+		case 0: pProp->Set(stats.queueDepth); break;
+		case 1: pProp->Set(stats.maxQueueDepth); break;
+		case 2: pProp->Set(stats.inFlight); break;
+		case 3: pProp->Set(stats.deferred); break;
+		case 4: pProp->Set(stats.meanWaitMs); break;
+		default: pProp->Set(stats.maxWaitMs); break;
+		}
+	}
+	return DEVICE_OK;
+}
 
-int ZaberBinaryStage::OnPort (MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnOutOfRangeMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	ostringstream os;
-	os << "Stage::OnPort(" << pProp << ", " << eAct << ")\n";
-	this->LogMessage(os.str().c_str(), false);
+	this->LogMessage("Stage::OnOutOfRangeMoves\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(port_.c_str());
+		pProp->Set(clampToLimits_ ? "Clamp" : "Reject");
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		if (initialized_)
-		{
-			// revert
-			pProp->Set(port_.c_str());
-			return ERR_PORT_CHANGE_FORBIDDEN;
-		}
-
-		pProp->Get(port_);
+		string value;
+		pProp->Get(value);
+		clampToLimits_ = (value == "Clamp");
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnDeviceAddress (MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnJogInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	this->LogMessage("Stage::OnDeviceAddress\n", true);
+	this->LogMessage("Stage::OnJogInterval\n", true);
 
-	if (eAct == MM::AfterSet)
+	if (eAct == MM::BeforeGet)
 	{
-		pProp->Get(deviceAddress_);
-
-		ostringstream cmdPrefix;
-		cmdPrefix << "/" << deviceAddress_ << " ";
-		cmdPrefix_ = cmdPrefix.str();
+		pProp->Set(jogIntervalMs_);
 	}
-	else if (eAct == MM::BeforeGet)
+	else if (eAct == MM::AfterSet)
 	{
-		pProp->Set(deviceAddress_);
+		pProp->Get(jogIntervalMs_);
+		jog_.SetUpdateInterval(jogIntervalMs_);
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnAxisNumber (MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnJogSmoothing(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	this->LogMessage("Stage::OnAxisNumber\n", true);
+	this->LogMessage("Stage::OnJogSmoothing\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(axisNumber_);
+		pProp->Set(jogSmoothingMs_);
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		pProp->Get(axisNumber_);
+		pProp->Get(jogSmoothingMs_);
+		jog_.SetSmoothing(jogSmoothingMs_);
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnSpeed (MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnJogStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
 {
-	this->LogMessage("Stage::OnSpeed\n", true);
-
 	if (eAct == MM::BeforeGet)
 	{
-		long speedData;
-		int ret = GetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
-		if (ret != DEVICE_OK) 
-		{
-			return ret;
-		}
+		pProp->Set(index == 0 ? jog_.SetpointCount() : jog_.CommandCount());
+	}
+	return DEVICE_OK;
+}
 
-		// convert to mm/s
-		double speed = (speedData/convFactor_)*stepSizeUm_/1000;
-		pProp->Set(speed);
+int ZaberBinaryStage::OnSamplingInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSamplingInterval\n", true);
+
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(samplingIntervalMs_);
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		double speed;
-		pProp->Get(speed);
-
-		// convert to data
-		long speedData = nint(speed*convFactor_*1000/stepSizeUm_);
-		if (speedData == 0 && speed != 0) speedData = 1; // Avoid clipping to 0.
-
-		int ret = SetSetting(deviceAddress_, axisNumber_, "maxspeed", speedData);
-		if (ret != DEVICE_OK) 
+		pProp->Get(samplingIntervalMs_);
+		if (samplingIntervalMs_ <= 0)
 		{
-			return ret;
+			sampler_.Stop();
+			return DEVICE_OK;
 		}
+		return sampler_.Start(samplingIntervalMs_);
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnAccel (MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnSampledPositionTime(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	this->LogMessage("Stage::OnAccel\n", true);
+	this->LogMessage("Stage::OnSampledPositionTime\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
-		long accelData;
-		int ret = GetSetting(deviceAddress_, axisNumber_, "accel", accelData);
-		if (ret != DEVICE_OK) 
-		{
-			return ret;
-		}
-
-		// convert to m/s
-		double accel = (accelData*10/convFactor_)*stepSizeUm_/1000;
-		pProp->Set(accel);
+		pProp->Set(sampledAt_.getMsec());
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		double accel;
-		pProp->Get(accel);
+		double ms;
+		pProp->Get(ms);
+		sampledAt_ = MM::MMTime(ms * 1000.0);
+	}
+	return DEVICE_OK;
+}
 
-		// convert to data
-		long accelData = nint(accel*convFactor_*100/(stepSizeUm_));
-		if (accelData == 0 && accel != 0) accelData = 1; // Only set accel to 0 if user intended it.
+int ZaberBinaryStage::OnSampledPosition(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnSampledPosition\n", true);
 
-		int ret = SetSetting(deviceAddress_, axisNumber_, "accel", accelData);
-		if (ret != DEVICE_OK) 
+	if (eAct == MM::BeforeGet)
+	{
+		double pos;
+		int ret = GetPositionUmAt(sampledAt_, pos);
+		if (ret != DEVICE_OK)
 		{
 			return ret;
 		}
+		pProp->Set(pos);
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnMotorSteps(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnSamplerStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
 {
-	this->LogMessage("Stage::OnMotorSteps\n", true);
+	if (eAct == MM::BeforeGet)
+	{
+		switch (index)
+		{
+		case 0: pProp->Set(sampler_.SampleCount()); break;
+		case 1: pProp->Set(sampler_.DroppedCount()); break;
+		default: pProp->Set(sampler_.ErrorCount()); break;
+		}
+	}
+	return DEVICE_OK;
+}
+
+int ZaberBinaryStage::OnTimedMovePosition(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	this->LogMessage("Stage::OnTimedMovePosition\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(motorSteps_);
+		pProp->Set(timedMoveUm_);
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		pProp->Get(motorSteps_);
+		pProp->Get(timedMoveUm_);
 	}
 	return DEVICE_OK;
 }
 
-int ZaberBinaryStage::OnLinearMotion(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZaberBinaryStage::OnTimedMoveTime(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	this->LogMessage("Stage::OnLinearMotion\n", true);
+	this->LogMessage("Stage::OnTimedMoveTime\n", true);
 
 	if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(linearMotion_);
+		pProp->Set(timedMoveAt_.getMsec());
 	}
 	else if (eAct == MM::AfterSet)
 	{
-		pProp->Get(linearMotion_);
+		double ms;
+		pProp->Get(ms);
+		timedMoveAt_ = MM::MMTime(ms * 1000.0);
+		return ScheduleMoveSteps(nint(timedMoveUm_/stepSizeUm_), timedMoveAt_);
 	}
 	return DEVICE_OK;
 }
 
-// COMMUNICATION "clear buffer" utility function:
-int ZaberBinaryStage::ClearPort() const
+int ZaberBinaryStage::OnTimedMoveStat(MM::PropertyBase* pProp, MM::ActionType eAct, long index)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::ClearPort\n", true);
-
-	const int bufSize = stage_byte_len_;
-	unsigned char clear[bufSize];
-	unsigned long read = bufSize;
-	int ret;
-	long long rett;
-
-	while ((int) read == bufSize)
+	if (eAct == MM::BeforeGet)
 	{
-		ret = core_->ReadFromSerial(device_, port_.c_str(), clear, bufSize, read);
-		rett = (long long)ret;
-		core_->LogMessage(device_, "ZaberBinaryStage::ClearPort", true);
-		core_->LogMessage(device_, to_string(rett).c_str(), true);
-		rett = (long long)read;
-		core_->LogMessage(device_, to_string(rett).c_str(), true);
-
-		if (ret != DEVICE_OK) 
+		MMThreadGuard guard(moveLock_);
+		switch (index)
 		{
-			return ret;
-			
+		case 0: pProp->Set(moveTimer_.Pending()); break;
+		case 1: pProp->Set(timedLeadUs_ / 1000.0); break;
+		case 2: pProp->Set(timedJitter_.PercentileUs(50) / 1000.0); break;
+		case 3: pProp->Set(timedJitter_.PercentileUs(99) / 1000.0); break;
+		case 4: pProp->Set(timedJitter_.MaxUs() / 1000.0); break;
+		default: pProp->Set(timedJitterCount_ > 0 ? timedJitterSumUs_ / timedJitterCount_ / 1000.0 : 0.0); break;
 		}
 	}
-
-	return DEVICE_OK;      
+	return DEVICE_OK;
 }
 
+int ZaberBinaryStage::OnResyncCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduler_ != 0 ? scheduler_->ResyncCount() : 0L);
+	}
+	return DEVICE_OK;
+}
 
-// COMMUNICATION "send" utility function:
-int ZaberBinaryStage::SendCommand(const std::vector<const unsigned char> command) const //Args of SendCommand need to change
+int ZaberBinaryStage::OnCoalesceInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::SendCommand\n", true);
+	this->LogMessage("Stage::OnCoalesceInterval\n", true);
 
-	//Proposed recasting of vector
-	if(command.size() != stage_byte_len_) {
-		// Consider throwing an exception (based on convention in this jungle)
-		return 1;
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(coalesceIntervalMs_);
 	}
-	unsigned char baseCommand[stage_byte_len_];
-	for (int i = 0; i < command.size(); baseCommand[i++] = command[i]);
-	for (int i = 0; i < command.size(); i++) {
-		ostringstream co;
-		co << static_cast<unsigned int>(baseCommand[i]) << std::flush;
-		core_->LogMessage(device_, co.str().c_str(), true);
+	else if (eAct == MM::AfterSet)
+	{
+		pProp->Get(coalesceIntervalMs_);
 	}
-	return core_->WriteToSerial(device_, port_.c_str(), baseCommand, stage_byte_len_);
+	return DEVICE_OK;
 }
 
-
-// COMMUNICATION "send & receive" utility function:
-int ZaberBinaryStage::QueryCommand(const vector<const unsigned char> command, unsigned char* reply, long sleepyTimeMs) const //Args of QueryCommand need to change
+// Drives the move coalescing. Collects the reply of the move in flight and
+// sends the pending target, unless the last move went out less than the
+// coalescing interval ago; then pumpTimer_ sends it when the interval is
+// over, by which time more requests may have been merged into it.
+// A device drops a move interrupted by a newer one without replying, so the
+// request for the old move is simply withdrawn. A relative move is not
+// interrupted, though: further deltas wait for its reply, which gives the
+// position they add to. A reply that has not come by the predicted end of
+// the move plus a margin is taken as lost, and Busy() and the position fall
+// back to asking the device. Called with moveLock_ held.
+int ZaberBinaryStage::PumpMoves(bool immediate)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::QueryCommand\n", true);
+	MM::MMTime now = GetCurrentMMTime();
+	if (moveInFlight_)
+	{
+		int ret = scheduler_->Poll(core_, device_);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		if (moveRequest_.done)
+		{
+			RecordTimedMove(true);
+			moveInFlight_ = false;
+			unsigned char resp[stage_byte_len_];
+			ret = FinishCommand(moveRequest_, resp);
+			if (ret != DEVICE_OK)
+			{
+				motion_.Invalidate();
+				commandedKnown_ = false;
+				movePending_ = false;
+				return ret;
+			}
+
+			// the reply carries the position the axis stopped at
+			long finalPos = ReplyData(resp);
+			motion_.Complete(finalPos, moveRequest_.doneTime);
+			commandedTarget_ = finalPos;
+			commandedKnown_ = true;
+			PublishPosition(finalPos);
+
+			if (movePending_ && !pendingAbsolute_)
+			{
+				pendingAbsolute_ = true;
+				pendingTarget_ += finalPos;
+				ret = LimitTarget(deviceAddress_, axisNumber_, pendingTarget_, clampToLimits_);
+				if (ret != DEVICE_OK)
+				{
+					movePending_ = false;
+					return ret;
+				}
+			}
+		}
+		else if (now > moveDeadline_)
+		{
+			this->LogMessage("Stage::PumpMoves no reply to the move in flight, giving up on it\n", false);
+			RecordTimedMove(true);
+			scheduler_->Cancel(moveRequest_);
+			moveInFlight_ = false;
+			motion_.Invalidate();
+			commandedKnown_ = false;
+		}
+	}
 
-	ostringstream replyforprinting;
-	replyforprinting << "Initialization of reply";
+	if (!movePending_)
+	{
+		return DEVICE_OK;
+	}
 
-	int ret = SendCommand(command);
-	if (ret != DEVICE_OK) 
+	if (moveInFlight_ && !pendingAbsolute_)
 	{
-		return ret;
+		SchedulePump(now + MM::MMTime(coalesceIntervalMs_ * 1000.0));
+		return DEVICE_OK;
+	}
+	if (moveInFlight_ && !immediate && (now - lastDispatch_).getMsec() < coalesceIntervalMs_)
+	{
+		SchedulePump(lastDispatch_ + MM::MMTime(coalesceIntervalMs_ * 1000.0));
+		return DEVICE_OK;
+	}
+	if (moveInFlight_)
+	{
+		RecordTimedMove(true);
+		scheduler_->Cancel(moveRequest_);
+		moveInFlight_ = false;
 	}
 
-	// get drowsy if requested (moving) - this limits the damage caused by long timeouts
-	if (sleepyTimeMs > 0) {
-		Sleep(sleepyTimeMs);
+	if (homing_)
+	{
+		// the move interrupts the home, which then gets no reply
+		scheduler_->Cancel(homeRequest_);
+		homing_ = false;
 	}
 
-	unsigned long respLength;
-	int err;
-	unsigned long byteIndex = 0;
-	std::vector<char> buf(10);
-	ostringstream co;
-	MM::MMTime deadline = core_->GetCurrentMMTime() + MM::MMTime(50000000.0); // us
-	//ret = core_->ReadFromSerial(device_, port_.c_str(), replyCStyle, stage_byte_len_, respLength);
-	MM::MMTime shorterDeadline;
-	long sleepTime_ = 500;
+	if (!FitsDataField(pendingTarget_))
+	{
+		movePending_ = false;
+		return ERR_POSITION_OUT_OF_RANGE;
+	}
 
-	//while (byteIndex < stage_byte_len_ && core_->GetCurrentMMTime() < deadline) //final timeout deadline to receive the full response before throwing DEVICE_SERIAL_INVALID_RESPONSE error
-	//{
-	shorterDeadline = core_->GetCurrentMMTime() + MM::MMTime(10000000.0);
-	while (byteIndex < stage_byte_len_ && core_->GetCurrentMMTime() < shorterDeadline)
-	{
-		unsigned char* bufPtr = reinterpret_cast<unsigned char*>(&buf[0]);
-		err = core_->ReadFromSerial(device_, port_.c_str(), bufPtr, static_cast<unsigned long>(buf.size()), respLength);
-	  
-		//core_->LogMessage(device_, "ZaberBinaryStage::QueryCommand (while loop)\n", true);
-		//co << "byteIndex:" << byteIndex << ", respLength: " << respLength << ", Response: ";
-		//for(int i=0; i<static_cast<int>(buf.size()); co << static_cast<unsigned int>(buf[i++]));
-		//core_->LogMessage(device_, co.str().c_str(), true);
-		//co.clear();
-		//co.str("");
-
-		if(respLength) {
-		//copy buf into reply, protecting the memory for reply
-		unsigned long iMax = respLength;
-		//co << "iMax: " << iMax;
-		//core_->LogMessage(device_, co.str().c_str(), true);
-		//co.clear();
-		//co.str("");
-		if((byteIndex + iMax) > stage_byte_len_) {
-			iMax = stage_byte_len_ - byteIndex;
-			//core_->LogMessage(device_, "ZaberBinaryStage::QueryCommand (while loop): too long answer?\n", true);
-		}
-		//static_cast<unsigned char>
-		for(unsigned long i=0; i < iMax; reply[byteIndex + i++] = (unsigned char) buf[i]);
-		}
-
-		byteIndex += respLength;
-		if (err != DEVICE_OK)
-			return err;
-	}
-		
-		//Sleep(sleepTime_); //If a response is not received in the first timeout period, put this process to sleep for sleepTime (ms) before listening again
-		
-	//}
-	
-	core_->LogMessage(device_, "ZaberBinaryStage::QueryCommand (after while loop)\n", true);
-	co << "Reply field 3:" << reply[2];
-	core_->LogMessage(device_, co.str().c_str(), true);
-	co.clear();
-    co.str("");
+	vector<unsigned char> cmd;
+	BuildMoveCommand(deviceAddress_, pendingAbsolute_ ? "abs" : "rel", pendingTarget_, cmd);
+	movePending_ = false;
 
-	if (ret != DEVICE_OK) 
+	int ret = SubmitCommand(cmd, moveRequest_);
+	if (ret != DEVICE_OK)
 	{
+		motion_.Invalidate();
+		commandedKnown_ = false;
 		return ret;
 	}
-	core_->LogMessage(device_, "ZaberBinaryStage::QueryCommand (after while)\n", true);
+	moveInFlight_ = true;
+	lastDispatch_ = now;
 
-	if (byteIndex != stage_byte_len_)
+	double expectedMs;
+	if (pendingAbsolute_)
 	{
-		return  DEVICE_SERIAL_INVALID_RESPONSE;
+		motion_.StartMove(pendingTarget_, now);
+		commandedTarget_ = pendingTarget_;
+		commandedKnown_ = true;
+		expectedMs = motion_.RemainingMs(now);
 	}
-
-	// byte #2 is 255 if an error occurred
-	if (reply[1] == 255) {
-		// bytes #3-6 are the error code, but there are < 256 errors so byte #3 is enough
-		// hopefully none of those is the same as DEVICE_SERIAL_INVALID_RESPONSE, or else
-		// ...
-		// ...
-		// boom!
-		return reply[2];
-		// boom!
-		// ...
-		// boom boom!
+	else
+	{
+		motion_.StartRelativeMove(pendingTarget_, now);
+		commandedKnown_ = false;
+		expectedMs = motion_.MoveDurationMs(pendingTarget_);
 	}
 
+	// without a known start or speed there is no prediction to go by
+	if (expectedMs <= 0 && (!motion_.IsKnown() || maxSpeedSteps_ <= 0))
+	{
+		expectedMs = homingTimeoutMs_;
+	}
+	moveDeadline_ = now + MM::MMTime((expectedMs + g_MoveReplyMarginMs) * 1000.0);
 	return DEVICE_OK;
 }
 
 
-int ZaberBinaryStage::GetSetting(long device, long axis, string setting, long& data) const
-{
-	core_->LogMessage(device_, "ZaberBinaryStage::GetSetting\n", true);
-
-	/*
-	Byte_1 = device (0 or 1; shouldn't matter)
-	Byte_2 = 53 (Return Setting command)
-	Byte_3 - Byte_6: if setting is resolution, 37 (note that this is microstep resolution)
-					 if setting is position, 45
-					 if setting is maxspeed, 42 (this is the target speed not the max speed, but close enough)
-					 if setting is accel, 43
-					 if setting is limit.min, 106
-					 if setting is limit.max, 44
-	*/
-	unordered_map<string, unsigned char> commandDict;
-	commandDict["resolution"] = 37;
-	commandDict["pos"] = 45;
-	commandDict["maxspeed"] = 42;
-	commandDict["accel"] = 43;
-	commandDict["limit.min"] = 106;
-	commandDict["limit.max"] = 44;
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = device;
-	cmd[1] = 53;
-	cmd[2] = commandDict[setting];
-
-	unsigned char resp[stage_byte_len_] = {0};
-	int ret = QueryCommand(cmd, resp);
-
-	if (ret != DEVICE_OK) 
+// Has pumpTimer_ call PumpMoves() at the given time, unless a call is due
+// already. Called with moveLock_ held.
+void ZaberBinaryStage::SchedulePump(MM::MMTime at)
+{
+	if (pumpScheduled_)
 	{
-		// consider alert-ing or printing the error
-		return ret;
+		return;
 	}
+	// at least a tick on, so a waiting relative delta does not spin
+	MM::MMTime earliest = GetCurrentMMTime() + MM::MMTime(1000.0);
+	pumpScheduled_ = (pumpTimer_.Schedule(at < earliest ? earliest : at, 0) == DEVICE_OK);
+}
 
-	// extract data
-	// NOTE: byte to long conversion happens here!!!
 
-	data = 0;
-	core_->LogMessage(device_, "Heard response, before byte conversion ", true);
-	
+// On pumpTimer_'s thread.
+void MovePump::OnTimer(long /*payload*/, MM::MMTime /*due*/)
+{
+	MMThreadGuard guard(stage_->moveLock_);
+	stage_->pumpScheduled_ = false;
+	int ret = stage_->PumpMoves();
+	if (ret != DEVICE_OK)
+	{
+		ostringstream os;
+		os << "PumpMoves failed in MovePump::OnTimer, error code: " << ret;
+		stage_->LogMessage(os.str().c_str(), false);
+	}
+}
 
-	long long dataLong = 0;
 
-	dataLong += (long) resp[2];
-	dataLong += ((long) resp[3])*256;
-	dataLong += ((long) resp[4])*256*256;
-	if (resp[5] <= 127) {
-		dataLong += ((long) resp[5])*256*256*256;
-	}
-	else {
-		//handling negative data
-		//Note: in Visual Studio 2010, we cannot do (long) resp[5]*256*256*256 if resp[5] > 127, because it will get downcast to 32 bits
-		dataLong += ((long) resp[5] - 256)*256*256*256;
+// Collects the reply to a home in progress. The reply carries the position
+// the device homed to. Homing that has not finished within the homing
+// timeout is stopped, on every device if they all homed together.
+// Called with moveLock_ held.
+int ZaberBinaryStage::PumpHome()
+{
+	if (!homing_)
+	{
+		return DEVICE_OK;
 	}
 
-	data = dataLong;
-	ostringstream co;
-	co << "dataLong after byte to long conversion " << dataLong << std::flush;
-	core_->LogMessage(device_, co.str().c_str(), true);
-	co.clear();
-    co.str("");
-	co << "Data after byte to long conversion " << static_cast<unsigned int>(data) << std::flush;
-	core_->LogMessage(device_, co.str().c_str(), true);
+	int ret = scheduler_->Poll(core_, device_);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	if (homeRequest_.done)
+	{
+		homing_ = false;
+		unsigned char resp[stage_byte_len_];
+		ret = FinishCommand(homeRequest_, resp);
+		if (ret != DEVICE_OK)
+		{
+			return ret;
+		}
+		motion_.Complete(ReplyData(resp), homeRequest_.doneTime);
+		PublishPosition(ReplyData(resp));
+		return DEVICE_OK;
+	}
 
+	if ((GetCurrentMMTime() - homeStart_).getMsec() > homingTimeoutMs_)
+	{
+		scheduler_->Cancel(homeRequest_);
+		homing_ = false;
+		motion_.Invalidate();
+		ret = ZaberBinaryBase::Stop(homeAll_ ? 0 : deviceAddress_);
+		if (ret != DEVICE_OK)
+		{
+			ostringstream os;
+			os << "Stopping the home failed in ZaberBinaryStage::PumpHome, error code: " << ret;
+			this->LogMessage(os.str().c_str(), false);
+		}
+		return ERR_BUSY_TIMEOUT;
+	}
 	return DEVICE_OK;
 }
 
 
-int ZaberBinaryStage::SetSetting(long device, long axis, string setting, long data) const
+// Stops tracking a home, for commands that interrupt it.
+void ZaberBinaryStage::DropHome()
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::SetSetting\n", true);
+	MMThreadGuard guard(moveLock_);
+	if (homing_ && scheduler_ != 0)
+	{
+		scheduler_->Cancel(homeRequest_);
+	}
+	homing_ = false;
+}
 
-	/*
-	Byte_1 = device (0 or 1; shouldn't matter)
-	Byte_2 = if setting is resolution, 37 (note that this is microstep resolution)
-			 if setting is position, 45
-			 if setting is maxspeed, 42 (this is the target speed not the max speed, but close enough)
-			 if setting is accel, 43
-	Byte_3 - Byte_6 = data (base 256 backwards)
-	*/
 
-	unordered_map<string, unsigned char> commandDict;
-	commandDict["resolution"] = 37;
-	commandDict["pos"] = 45;
-	commandDict["maxspeed"] = 42;
-	commandDict["accel"] = 43;
-	commandDict["limit.min"] = 106;
-	commandDict["limit.max"] = 44;
+void ZaberBinaryStage::PublishPosition(long steps)
+{
+	PublishPosition(steps, GetCurrentMMTime());
+}
 
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = device;
-	cmd[1] = commandDict[setting];
-	//conversion of long to bytes
-	
-	long long dataLong = data;
-	long long long32 = 256*256*256;
-	long32 *= 256;
-	if (data < 0){
-		dataLong += long32;
-		core_->LogMessage(device_, "We are trying to correct a negative value of data\n", true);
 
-	}
-	ostringstream os;
-	os << "data after negative number correction: " << dataLong / (256*256*256);
-	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear();
-	os.str("");
-	long l1;
-	long l2;
-	long l3;
-	long l4;
-
-	l1 = dataLong % 256;
-	l2 =  (dataLong % (256*256) - l1) / 256;
-	l3 = (dataLong % (256*256*256) - 256*l2 - l1) / (256*256);
-	l4 = (dataLong - 256*256*l3 - 256*l2 - l1) / (256*256*256);
-
-	cmd[2] = (unsigned char) l1;
-	cmd[3] = (unsigned char) l2;
-	cmd[4] = (unsigned char) l3;
-	cmd[5] = (unsigned char) l4;
-	unsigned char resp[stage_byte_len_] = {0};
-	int ret = QueryCommand(cmd, resp);
-	if (ret != DEVICE_OK)
+// Tells the core about a position read from the device at the given time,
+// unless it is the one it was told last. The shared memory feed gets every
+// reading, for the time stamp.
+void ZaberBinaryStage::PublishPosition(long steps, MM::MMTime time)
+{
 	{
-		return ERR_SETTING_FAILED;
+		MMThreadGuard guard(publishLock_);
+		feed_.Write(steps, steps * stepSizeUm_, time);
+		if (!publishPositions_ || (published_ && steps == publishedSteps_))
+		{
+			return;
+		}
+		published_ = true;
+		publishedSteps_ = steps;
 	}
-
-	return DEVICE_OK;
+	core_->OnStagePositionChanged(this, steps * stepSizeUm_);
 }
 
 
-bool ZaberBinaryStage::IsBusy(long device) const //??? does this exist in binary?
+// Move tracking and manual move tracking from the scheduler. This may run on
+// another thread while moveLock_ is held, so the motion model is only told
+// about knob movements through manualMoved_; it rereads the position next
+// time it is asked.
+void ZaberBinaryStage::OnPositionReport(const unsigned char* reply, MM::MMTime /*time*/)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::IsBusy\n", true);
+	if (reply[1] == 10)
+	{
+		AtomicStore(&manualMoved_, 1);
+	}
+	PublishPosition(ReplyData(reply));
+}
 
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = device;
-	cmd[1] = 50; //Ask for device ID
 
-	unsigned char resp[stage_byte_len_] = {0};
-	int ret = QueryCommand(cmd, resp);
+// A timed move from moveTimer_, on the timer's thread. It skips the move
+// coalescing interval, so it goes out now even if a move was just sent.
+void ZaberBinaryStage::OnTimer(long steps, MM::MMTime due)
+{
+	MM::MMTime fired = GetCurrentMMTime();
+	jog_.Cancel();
+
+	MMThreadGuard guard(moveLock_);
+	RecordTimedMove(true);
+	pendingAbsolute_ = true;
+	pendingTarget_ = steps;
+	movePending_ = true;
+	int ret = PumpMoves(true);
 	if (ret != DEVICE_OK)
 	{
 		ostringstream os;
-		os << "SendSerialCommand failed in ZaberBinaryStage::IsBusy, error code: " << ret;
-		core_->LogMessage(device_, os.str().c_str(), false);
-		return false;
+		os << "Timed move failed in ZaberBinaryStage::OnTimer, error code: " << ret;
+		this->LogMessage(os.str().c_str(), false);
+		return;
 	}
-	//if we figure out how to query for busy status, put here
-	return false;
+
+	timedSample_ = moveInFlight_;
+	timedDue_ = due;
+	timedFired_ = fired;
+	RecordTimedMove(false);
 }
 
 
-int ZaberBinaryStage::Stop(long device) const
+// Measures a timed move once its frame has been written: the jitter against
+// its due time, and the time from the timer firing to the write, which
+// becomes the timer lead. With final set the move is done or withdrawn, and
+// is dropped if it never went out. Called with moveLock_ held.
+void ZaberBinaryStage::RecordTimedMove(bool final)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::Stop\n", true);
+	if (!timedSample_)
+	{
+		return;
+	}
 
-	/*
-	Byte_1 = device (0 or 1; shouldn't matter)
-	Byte_2 = 23
-	Byte_3-Byte_6 = ignored
-	n.b. ASCII stop returns 0, whereas binary stop returns the final position
-	*/
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = device;
-	cmd[1] = 23;
+	if (moveRequest_.sentTime.getUsec() >= timedFired_.getUsec())
+	{
+		timedSample_ = false;
+
+		double jitterUs = (moveRequest_.sentTime - timedDue_).getUsec();
+		timedJitter_.Record(fabs(jitterUs));
+		timedJitterSumUs_ += jitterUs;
+		timedJitterCount_++;
 
-	unsigned char resp[stage_byte_len_] = {0};
-	return QueryCommand(cmd, resp);
+		double latencyUs = (moveRequest_.sentTime - timedFired_).getUsec();
+		timedLeadUs_ += (latencyUs - timedLeadUs_) / 8;
+		timedLeadUs_ = (timedLeadUs_ < 0) ? 0 : ((timedLeadUs_ > 20000) ? 20000 : timedLeadUs_);
+		moveTimer_.SetLeadUs(timedLeadUs_);
+	}
+	else if (final)
+	{
+		timedSample_ = false;
+	}
 }
 
 
-int ZaberBinaryStage::GetLimits(long device, long axis, long& min, long& max) const
+// Velocity commands from the jog engine.
+int ZaberBinaryStage::SendJogVelocity(long velocityData)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::GetLimits\n", true);
+	return SendMoveCommand(deviceAddress_, axisNumber_, "vel", velocityData);
+}
 
-	int ret = GetSetting(device, axis, "limit.min", min);
-	if (ret != DEVICE_OK) 
+
+int ZaberBinaryStage::SendJogStop()
+{
+	long finalPos;
+	int ret = ZaberBinaryBase::Stop(deviceAddress_, &finalPos);
+	if (ret != DEVICE_OK)
 	{
 		return ret;
 	}
-
-	return GetSetting(device, axis, "limit.max", max);
+	PublishPosition(finalPos);
+	return DEVICE_OK;
 }
 
 
-int ZaberBinaryStage::SendMoveCommand(long device, long axis, std::string type, long data) const
+// One position read for the sampler, on its thread. It goes through the
+// scheduler like any other query, so it may overlap a move in flight; the
+// device is taken to have read the position halfway through the round trip.
+int ZaberBinaryStage::ReadSample(long& steps, MM::MMTime& time)
 {
-	core_->LogMessage(device_, "ZaberBinaryStage::SendMoveCommand\n", true);
-
-	
-	/*
-	Byte_1 = device (0 or 1; shouldn't matter)
-	Byte_2 = if type is 'abs', 20
-			 if type is 'rel', 21
-			 if type is 'vel', 22
-	Byte_3 - Byte_6 = data (base 256 backwards)
-	*/
-	unordered_map<string, unsigned char> commandDict;
-	commandDict["abs"] = 20;
-	commandDict["rel"] = 21;
-	commandDict["vel"] = 22;
-	/*
-	long travel;
-	if (type == "abs") {
-		int ret = GetSetting(deviceAddress_, axis, "pos", travel);
-		travel = data - travel;
-	} else if (type == "rel") {
-		travel = data;
-	} else {
-		travel = 0;
-	}
-
-	if (travel < 0){
-		travel = -travel;
-	}
-	// Long travels make you sleepy
-	double sleepyTimeFloat = 0;
-	long speedData = -1;
-	double speed = 0;
-	if (travel > 100) {
-		int ret = GetSetting(deviceAddress_, axis, "maxspeed", speedData);
-		if (ret != DEVICE_OK) 
-		{
-			return ret;
-		}
+	vector<unsigned char> cmd(stage_byte_len_, 0);
+	cmd[0] = (unsigned char) deviceAddress_;
+	cmd[1] = 60; // return current position
 
-		// convert to um/ms
-		speed = (speedData/convFactor_)*stepSizeUm_/(double) 1000;
-		
-		sleepyTimeFloat = (double) travel / 6.4 / 10.0 / speed - (double) 250;
-		if (sleepyTimeFloat < 0)
-			sleepyTimeFloat = 0;
+	PortRequest request;
+	int ret = SubmitCommand(cmd, request);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	ret = scheduler_->Wait(core_, this, request, 1000.0);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
+	}
+	unsigned char reply[stage_byte_len_];
+	ret = FinishCommand(request, reply);
+	if (ret != DEVICE_OK)
+	{
+		return ret;
 	}
-	long sleepyTimeMs = sleepyTimeFloat;
-	ostringstream os;
-	os << "Calculated speed (um/ms): " << speed << " Sleepy time float: " << sleepyTimeFloat << " Sleeping for: " << sleepyTimeMs << " ms" << " Travel (steps): " << travel << " Speed (?? units): " << speedData;
-	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear();
-	os.str("");
-	*/
 
-	ostringstream os;
-	vector<const unsigned char> cmd(stage_byte_len_, 0);
-	// maybe device is 0??
-	cmd[0] = device;
-	cmd[1] = commandDict[type];
-	//conversion of long to bytes
-	
-	os << "Trying to move by: " << data << " Arithmetic test: " << data % (256*256);
-	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear();
-	os.str("");
-	//for(size_t i=2; i<stage_byte_len_; cmd[i++]  = data & (((1 << 8) - 1) << (8 * (i-2))));
-	long long dataLong = data;
-	long long long32 = 256*256*256;
-	long32 *= 256;
-	if (data < 0){
-		dataLong += long32;
-		core_->LogMessage(device_, "We are trying to correct a negative value of data\n", true);
-
-	}
-	os << "data after negative number correction: " << dataLong / (256*256*256);
-	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear();
-	os.str("");
-	long l1;
-	long l2;
-	long l3;
-	long l4;
-
-	l1 = dataLong % 256;
-	l2 =  (dataLong % (256*256) - l1) / 256;
-	l3 = (dataLong % (256*256*256) - 256*l2 - l1) / (256*256);
-	l4 = (dataLong - 256*256*l3 - 256*l2 - l1) / (256*256*256);
-
-	cmd[2] = (unsigned char) l1;
-	cmd[3] = (unsigned char) l2;
-	cmd[4] = (unsigned char) l3;
-	cmd[5] = (unsigned char) l4;
-
-	os.clear(); os.str(""); os << "This is l1: " << l1 << " and this is cmd[2]: " << cmd[2]; 	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear(); os.str(""); os << "This is l2: " << l2 << " and this is cmd[3]: " << cmd[3];	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear(); os.str(""); os << "This is l3: " << l3 << " and this is cmd[4]: " << cmd[4];	core_->LogMessage(device_, os.str().c_str(), true);
-	os.clear(); os.str(""); os << "This is l4: " << l4 << " and this is cmd[5]: " << cmd[5];	core_->LogMessage(device_, os.str().c_str(), true);
-
-	unsigned char resp[stage_byte_len_] = {0};
-	long sleepyTimeMs = 0;
-	return QueryCommand(cmd, resp, sleepyTimeMs);
+	steps = ReplyData(reply);
+	time = request.sentTime + MM::MMTime((request.doneTime - request.sentTime).getUsec() / 2);
+	PublishPosition(steps, time);
+	return DEVICE_OK;
+}
+
+
+// Forgets pending and in-flight moves, and the motion model with them, for
+// commands that supersede them.
+void ZaberBinaryStage::DropMoves()
+{
+	MMThreadGuard guard(moveLock_);
+	motion_.Invalidate();
+	RecordTimedMove(true);
+	if (moveInFlight_ && scheduler_ != 0)
+	{
+		scheduler_->Cancel(moveRequest_);
+	}
+	moveInFlight_ = false;
+	movePending_ = false;
+	commandedKnown_ = false;
 }
+
 
 /*
 //Functions from UserDefinedSerialImpl.h for communication with a binary device. (Q: why were they in the .h file? Does it matter?)
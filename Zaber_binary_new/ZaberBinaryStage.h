@@ -1,43 +1,32 @@
-#ifndef _ZABER_BINARY_H_
-#define _ZABER_BINARY_H_
-
-#include <MMDevice.h>
-#include <DeviceBase.h>
-#include <ModuleInterface.h>
-#include <sstream>
-#include <string>
-#include <unordered_map>
-
-
-//////////////////////////////////////////////////////////////////////////////
-// Various constants: error codes, error messages
-//////////////////////////////////////////////////////////////////////////////
-
-#define ERR_PORT_CHANGE_FORBIDDEN    10002
-#define ERR_DRIVER_DISABLED          10004
-#define ERR_BUSY_TIMEOUT             10008
-#define ERR_AXIS_COUNT               10016
-#define ERR_COMMAND_REJECTED         10032
-#define	ERR_NO_REFERENCE_POS         10064
-#define	ERR_SETTING_FAILED           10128
-#define	ERR_INVALID_DEVICE_NUM       10256
-
-extern const char* g_Msg_PORT_CHANGE_FORBIDDEN;
-extern const char* g_Msg_DRIVER_DISABLED;
-extern const char* g_Msg_BUSY_TIMEOUT;
-extern const char* g_Msg_AXIS_COUNT;
-extern const char* g_Msg_COMMAND_REJECTED;
-extern const char* g_Msg_NO_REFERENCE_POS;
-extern const char* g_Msg_SETTING_FAILED;
-extern const char* g_Msg_INVALID_DEVICE_NUM;
+#ifndef _ZABER_BINARY_STAGE_H_
+#define _ZABER_BINARY_STAGE_H_
+
+#include "ZaberBinary.h"
+#include "TimerWheel.h"
+#include "JogEngine.h"
+#include "PositionSampler.h"
+#include "PositionFeed.h"
 
 //Stage-specific constants
 extern const char* g_StageName;
 extern const char* g_StageDescription;
-extern const unsigned long stage_byte_len_;
 
-class ZaberBinaryStage: public CStageBase<ZaberBinaryStage>
+class ZaberBinaryStage;
+
+// Sends a coalesced move once the coalescing interval is over, rather than
+// on the next Busy() or position request.
+class MovePump : public TimerListener
+{
+public:
+	MovePump(ZaberBinaryStage* stage) : stage_(stage) {}
+	void OnTimer(long payload, MM::MMTime due);
+
+private:
+	ZaberBinaryStage* stage_;
+};
 
+class ZaberBinaryStage: public CStageBase<ZaberBinaryStage>, public ZaberBinaryBase, public PositionListener,
+	public TimerListener, public JogOutput, public SampleSource
 {
 public:
 	ZaberBinaryStage();
@@ -68,6 +57,15 @@ public:
 
 	int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
 	bool IsContinuousFocusDrive() const {return false;}
+
+	// Timed moves
+	// -----------
+	int ScheduleMoveSteps(long steps, MM::MMTime at);
+	void CancelScheduledMoves();
+
+	// Sampled positions
+	// -----------------
+	int GetPositionUmAt(MM::MMTime time, double& pos);
 	
 	// action interface
 	// ----------------
@@ -78,23 +76,82 @@ public:
 	int OnLinearMotion  (MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnSpeed         (MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnAccel         (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnResyncInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFlightRecorder(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFlightRecorderDump(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLatency       (MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnLatencyReset  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMessageIds    (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnResyncCount   (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnQueueLimit    (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDeviceBuffer  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDeviceInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnQueueStat     (MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnCoalesceInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHomingTimeout (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHomeAll       (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSessionReplay (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnNativePort    (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnNativeBaud    (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSessionRecording(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnReplayMismatches(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPublishPositions(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPositionFeed  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimedMovePosition(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimedMoveTime (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTimedMoveStat (MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnOutOfRangeMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogInterval   (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogSmoothing  (MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnJogStat       (MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+	int OnSamplingInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSampledPositionTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSampledPosition(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSamplerStat   (MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+
+	// PositionListener API
+	// --------------------
+	void OnPositionReport(const unsigned char* reply, MM::MMTime time);
+
+	// TimerListener API
+	// -----------------
+	void OnTimer(long steps, MM::MMTime due);
+
+	// JogOutput API
+	// -------------
+	int SendJogVelocity(long velocityData);
+	int SendJogStop();
+
+	// SampleSource API
+	// ----------------
+	int ReadSample(long& steps, MM::MMTime& time);
 
 	protected:
-	int ClearPort() const;
-	int SendCommand(const std::vector<const unsigned char> command) const;
-	int QueryCommand(const std::vector<const unsigned char> command, unsigned char* reply, long sleepyTimeMs=0) const;
-	int GetSetting(long device, long axis, std::string setting, long& data) const;
-	int SetSetting(long device, long axis, std::string setting, long data) const;
-	bool IsBusy(long device) const;
-	int Stop(long device) const;
-	int GetLimits(long device, long axis, long& min, long& max) const;
-	int SendMoveCommand(long device, long axis, std::string type, long data) const;
-
-	bool initialized_;
-	std::string port_;
-	MM::Device *device_;
-	MM::Core *core_;
-	std::string cmdPrefix_;
+	friend class MovePump;
+	int SetUpDevice();
+	int CreateMotionProperties();
+	int CreateJogProperties();
+	int CreateSamplingProperties();
+	int CreateTimedMoveProperties();
+	int CreateDiagnosticProperties();
+	int CreatePortProperties();
+	int PumpMoves(bool immediate=false);
+	void SchedulePump(MM::MMTime at);
+	void DropMoves();
+	int PumpHome();
+	void DropHome();
+	void PublishPosition(long steps);
+	void PublishPosition(long steps, MM::MMTime time);
+	void RecordTimedMove(bool final);
+
+	// Latency statistics per Stage API method, next to the per command
+	// class ones kept by the base.
+	enum LatencyApi
+	{
+		ApiGetPositionUm, ApiGetPositionSteps, ApiSetPositionUm, ApiSetRelativePositionUm,
+		ApiSetPositionSteps, ApiSetRelativePositionSteps, ApiMove, ApiStop, ApiHome,
+		ApiGetLimits, ApiBusy, ApiCount
+	};
 
 private:
 	long deviceAddress_;
@@ -105,7 +162,75 @@ private:
 	long resolution_;
 	long motorSteps_;
 	double linearMotion_;
+	double resyncIntervalMs_; // 0 disables position estimation
+	double maxSpeedSteps_;    // steps/s
+	double accelSteps_;       // steps/s^2
+	MotionModel motion_;
+	std::string recorderDumpPath_;
+	bool clampToLimits_; // out of range targets are clamped rather than refused
+	LatencyHistogram apiLatency_[ApiCount];
+
+	// Move coalescing: positions requested while a move is being written or
+	// within the coalescing interval of the last one are merged, so only the
+	// latest target goes out.
+	PortRequest moveRequest_;
+	bool moveInFlight_;
+	bool movePending_;
+	bool pendingAbsolute_;
+	long pendingTarget_;    // steps; a delta when not absolute
+	bool commandedKnown_;
+	long commandedTarget_;  // target of the last move sent, for merging relative moves
+	MM::MMTime lastDispatch_;
+	MM::MMTime moveDeadline_; // the reply is taken as lost after this
+	double coalesceIntervalMs_;
+	MovePump movePump_;
+	TimerWheel pumpTimer_;
+	bool pumpScheduled_;
+	MMThreadLock moveLock_; // guards the coalescing and homing state
+
+	// Homing runs in the background; Busy() collects the reply. A homing
+	// failure is returned by the next position read.
+	PortRequest homeRequest_;
+	bool homing_;
+	MM::MMTime homeStart_;
+	int homeError_;
+	bool homeAll_; // home every device on the port with one broadcast
+
+	// Positions learned from replies are passed on to the core, so the GUI
+	// need not poll for them.
+	bool publishPositions_;
+	bool published_;
+	long publishedSteps_;
+	PositionFeed feed_;      // shared memory copy for other processes
+	std::string feedName_;
+	MMThreadLock publishLock_; // guards the four above; taken last
+	volatile long manualMoved_; // the knob moved the axis since the model last saw it
+
+	// Timed moves wait in moveTimer_ and are written at their due time,
+	// early by the measured time from the timer firing to the frame being
+	// written. The jitter is how far from the due time the frame went out.
+	TimerWheel moveTimer_;
+	double timedMoveUm_;     // target for the next "Timed Move Time"
+	MM::MMTime timedMoveAt_; // last time scheduled through the property
+	bool timedSample_;       // moveRequest_ is a timed move not yet measured
+	MM::MMTime timedDue_;
+	MM::MMTime timedFired_;
+	double timedLeadUs_;
+	LatencyHistogram timedJitter_; // absolute
+	double timedJitterSumUs_;      // signed, for the mean
+	long timedJitterCount_;
+
+	// Move(velocity) sets the jog velocity; the engine paces the commands.
+	JogEngine jog_;
+	double jogIntervalMs_;
+	double jogSmoothingMs_;
+
+	// Opt-in background position sampling, for looking up where the stage
+	// was at a given time (a camera frame's, say) after the fact.
+	PositionSampler sampler_;
+	double samplingIntervalMs_; // 0 when off
+	MM::MMTime sampledAt_;      // time "Sampled Position [um]" is read at
 
 };
 
-#endif //_ZABER_BINARY_H_
\ No newline at end of file
+#endif //_ZABER_BINARY_STAGE_H_
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef _ZABER_CHECK_H_
+#define _ZABER_CHECK_H_
+
+// Minimal checks for the unit tests: a failed check is reported and counted,
+// and main() returns the count so the runner sees the failure.
+
+#include <stdio.h>
+
+static int g_checkFailures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			g_checkFailures++; \
+		} \
+	} while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+	do \
+	{ \
+		long long e_ = (long long) (expected); \
+		long long a_ = (long long) (actual); \
+		if (e_ != a_) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #expected, #actual, e_, a_); \
+			g_checkFailures++; \
+		} \
+	} while (0)
+
+inline int CheckResult(const char* test)
+{
+	printf("%s: %s\n", test, g_checkFailures == 0 ? "passed" : "FAILED");
+	return g_checkFailures;
+}
+
+#endif //_ZABER_CHECK_H_
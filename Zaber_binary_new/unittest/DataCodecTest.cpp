@@ -0,0 +1,147 @@
+// Round trip of the binary data field through EncodeData/DecodeData for
+// every 32-bit value (or every n-th with a stride argument), with the bytes
+// compared against the modulo arithmetic the adapter used before, and a
+// throughput comparison of the two.
+
+#include "Check.h"
+#include "../ZaberBinary.h"
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+	// exposes the protected codec
+	class Codec : public ZaberBinaryBase
+	{
+	public:
+		using ZaberBinaryBase::EncodeData;
+		using ZaberBinaryBase::DecodeData;
+		using ZaberBinaryBase::ReplyData;
+	};
+
+	// The conversion SetSetting and BuildMoveCommand did before EncodeData.
+	void LegacyEncode(long data, unsigned char* bytes)
+	{
+		long long dataLong = data;
+		long long long32 = 256*256*256;
+		long32 *= 256;
+		if (data < 0)
+		{
+			dataLong += long32;
+		}
+		long l1 = dataLong % 256;
+		long l2 = (dataLong % (256*256) - l1) / 256;
+		long l3 = (dataLong % (256*256*256) - 256*l2 - l1) / (256*256);
+		long l4 = (dataLong - 256*256*l3 - 256*l2 - l1) / (256*256*256);
+		bytes[0] = (unsigned char) l1;
+		bytes[1] = (unsigned char) l2;
+		bytes[2] = (unsigned char) l3;
+		bytes[3] = (unsigned char) l4;
+	}
+
+	// The conversion ReplyData did before DecodeData.
+	long LegacyDecode(const unsigned char* bytes)
+	{
+		long long dataLong = 0;
+		dataLong += (long) bytes[0];
+		dataLong += ((long) bytes[1])*256;
+		dataLong += ((long) bytes[2])*256*256;
+		if (bytes[3] <= 127)
+		{
+			dataLong += ((long) bytes[3])*256*256*256;
+		}
+		else
+		{
+			dataLong += ((long) bytes[3] - 256)*256*256*256;
+		}
+		return (long) dataLong;
+	}
+
+	long long g_mismatches = 0;
+
+	void CheckValue(int32_t value)
+	{
+		unsigned char bytes[4];
+		unsigned char legacy[4];
+		Codec::EncodeData(value, bytes);
+		LegacyEncode(value, legacy);
+		long decoded = Codec::DecodeData(bytes);
+		if (memcmp(bytes, legacy, 4) != 0 || decoded != (long) value || LegacyDecode(bytes) != decoded)
+		{
+			if (g_mismatches++ < 10)
+			{
+				fprintf(stderr, "  %ld: %02x %02x %02x %02x (legacy %02x %02x %02x %02x), decoded %ld\n", (long) value,
+					bytes[0], bytes[1], bytes[2], bytes[3], legacy[0], legacy[1], legacy[2], legacy[3], decoded);
+			}
+		}
+	}
+
+	void RoundTrip(long long stride)
+	{
+		// the limits, around zero and around each byte boundary
+		const int32_t edges[] = { INT32_MIN, INT32_MIN + 1, -0x1000000, -0x800001, -0x800000, -0x10000, -0x8000,
+			-256, -255, -129, -128, -1, 0, 1, 127, 128, 255, 256, 0x7FFF, 0x8000, 0xFFFF, 0x10000, 0x7FFFFF,
+			0x800000, 0xFFFFFF, 0x1000000, INT32_MAX - 1, INT32_MAX };
+		for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+		{
+			CheckValue(edges[i]);
+		}
+
+		for (long long v = INT32_MIN; v <= INT32_MAX; v += stride)
+		{
+			CheckValue((int32_t) v);
+		}
+		CHECK_EQUAL(0, g_mismatches);
+
+		// the data field of a whole reply frame
+		unsigned char reply[6] = { 1, 20, 0x00, 0x00, 0x00, 0x80 };
+		CHECK_EQUAL(INT32_MIN, Codec::ReplyData(reply));
+		reply[2] = reply[3] = reply[4] = reply[5] = 0xFF;
+		CHECK_EQUAL(-1, Codec::ReplyData(reply));
+	}
+
+	template <class Encode, class Decode>
+	double NsPerValue(Encode encode, Decode decode, long count)
+	{
+		unsigned char bytes[4];
+		long long sum = 0;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (long i = 0; i < count; i++)
+		{
+			long value = (long) (int32_t) (i * 2654435761u);
+			encode(value, bytes);
+			sum += decode(bytes);
+		}
+		double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+		// keeps the loop from being optimized away
+		if (sum == 42)
+		{
+			printf(" ");
+		}
+		return ns / count;
+	}
+
+	void Benchmark()
+	{
+		const long count = 100000000;
+		double current = NsPerValue(Codec::EncodeData, Codec::DecodeData, count);
+		double legacy = NsPerValue(LegacyEncode, LegacyDecode, count);
+		printf("  encode + decode: %.2f ns, legacy %.2f ns\n", current, legacy);
+	}
+}
+
+
+// Optional argument: the stride through the int32 range, 1 (every value)
+// by default.
+int main(int argc, char** argv)
+{
+	long long stride = (argc > 1) ? atoll(argv[1]) : 1;
+	RoundTrip(stride > 0 ? stride : 1);
+	Benchmark();
+	return CheckResult("DataCodecTest");
+}
@@ -0,0 +1,151 @@
+// ZaberBinaryFilterWheel on the simulated port: the wheel turns the shorter
+// way round, across the wrap at 0 too; a new state supersedes a turn in
+// progress and still ends on its filter; an error reply ends Busy() at
+// once; and a lost reply ends it once the device says it has stopped.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../ZaberBinaryFilterWheel.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+	const long Revolution = 64000;
+	const long Positions = 6;
+
+	// A wheel with its filters evenly spaced, starting at the given steps.
+	ZaberBinaryFilterWheel* OpenWheel(SimulatedPort& port, long device, long startSteps, long minSteps = -Revolution)
+	{
+		port.SetSetting(device, 44, Revolution);
+		port.SetSetting(device, 106, minSteps);
+		port.SetSetting(device, 45, startSteps);
+		for (long i = 0; i < Positions; i++)
+		{
+			port.SetStoredPosition(device, i, i * Revolution / Positions);
+		}
+
+		char address[8];
+		snprintf(address, sizeof(address), "%ld", device);
+		ZaberBinaryFilterWheel* wheel = new ZaberBinaryFilterWheel();
+		wheel->SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, wheel->SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, wheel->SetProperty("Controller Device Number", address));
+		CHECK_EQUAL(DEVICE_OK, wheel->Initialize());
+		return wheel;
+	}
+
+	void CloseWheel(ZaberBinaryFilterWheel* wheel)
+	{
+		wheel->Shutdown();
+		delete wheel;
+	}
+
+	// Polls Busy() as the core does; returns how long the wheel was busy.
+	double BusyMs(SimulatedPort& port, ZaberBinaryFilterWheel& wheel, double limitMs)
+	{
+		double start = port.NowUs();
+		while (wheel.Busy() && port.NowUs() - start < limitMs * 1000.0)
+		{
+			CDeviceUtils::SleepMs(2);
+		}
+		return (port.NowUs() - start) / 1000.0;
+	}
+
+	void Turn(ZaberBinaryFilterWheel& wheel, long state)
+	{
+		char value[8];
+		snprintf(value, sizeof(value), "%ld", state);
+		CHECK_EQUAL(DEVICE_OK, wheel.SetProperty(MM::g_Keyword_State, value));
+	}
+
+	long State(ZaberBinaryFilterWheel& wheel)
+	{
+		char value[MM::MaxStrLength] = "";
+		CHECK_EQUAL(DEVICE_OK, wheel.GetProperty(MM::g_Keyword_State, value));
+		return atol(value);
+	}
+
+	// From a step short of a full turn, position 0 is one step on; from a
+	// step past 0, the last filter is back across 0. The device does not
+	// wrap, so it ends up outside [0, turn).
+	void ShorterWayRound(SimulatedPort& port)
+	{
+		ZaberBinaryFilterWheel* wheel = OpenWheel(port, 1, Revolution - 1);
+		CHECK_EQUAL(0, State(*wheel));
+		Turn(*wheel, 0);
+		BusyMs(port, *wheel, 2000.0);
+		CHECK_EQUAL(Revolution, port.Position(1));
+		CloseWheel(wheel);
+
+		wheel = OpenWheel(port, 2, 1);
+		CHECK_EQUAL(0, State(*wheel));
+		Turn(*wheel, 5);
+		BusyMs(port, *wheel, 2000.0);
+		CHECK_EQUAL(5 * Revolution / Positions - Revolution, port.Position(2));
+
+		// two thirds of a turn on is one third back
+		Turn(*wheel, 3);
+		BusyMs(port, *wheel, 2000.0);
+		CHECK_EQUAL(3 * Revolution / Positions - Revolution, port.Position(2));
+		CloseWheel(wheel);
+	}
+
+	// A new state while the wheel turns stops it and turns from where it
+	// stopped, ending exactly on the filter.
+	void SupersedeWhileTurning(SimulatedPort& port)
+	{
+		port.SetSetting(3, 42, 16384); // 10000 steps/s, a sixth of a turn in ~1 s
+		ZaberBinaryFilterWheel* wheel = OpenWheel(port, 3, 0);
+		Turn(*wheel, 2);
+		CHECK(BusyMs(port, *wheel, 300.0) >= 300.0);
+		CHECK(port.IsMoving(3));
+		Turn(*wheel, 1);
+		double busyMs = BusyMs(port, *wheel, 5000.0);
+		CHECK(busyMs < 3000.0);
+		CHECK(!port.IsMoving(3));
+		CHECK_EQUAL(Revolution / Positions, port.Position(3));
+		CHECK_EQUAL(1, State(*wheel));
+		CloseWheel(wheel);
+	}
+
+	// The device refuses a turn below its minimum position; Busy() ends with
+	// the error reply instead of waiting out the deadline.
+	void ErrorReplyEndsBusy(SimulatedPort& port)
+	{
+		ZaberBinaryFilterWheel* wheel = OpenWheel(port, 4, 0, 0);
+		Turn(*wheel, 5);
+		double busyMs = BusyMs(port, *wheel, 3000.0);
+		CHECK(busyMs < 200.0);
+		CHECK_EQUAL(0, port.Position(4));
+		CloseWheel(wheel);
+	}
+
+	// Without a reply, the wheel stays busy until the predicted arrival plus
+	// the margin, and then asks the device, which has long stopped.
+	void LostReplyDeadline(SimulatedPort& port)
+	{
+		ZaberBinaryFilterWheel* wheel = OpenWheel(port, 5, 0);
+		port.DropMoveReplies(true);
+		Turn(*wheel, 3);
+		double busyMs = BusyMs(port, *wheel, 5000.0);
+		port.DropMoveReplies(false);
+		printf("  lost reply given up after %.0f ms\n", busyMs);
+		CHECK(busyMs > 1000.0 && busyMs < 2500.0);
+		CHECK_EQUAL(Revolution / 2, port.Position(5));
+		CHECK(!wheel->Busy());
+		CloseWheel(wheel);
+	}
+}
+
+
+int main()
+{
+	SimulatedPort port;
+	ShorterWayRound(port);
+	SupersedeWhileTurning(port);
+	ErrorReplyEndsBusy(port);
+	LostReplyDeadline(port);
+	return CheckResult("FilterWheelTest");
+}
@@ -0,0 +1,163 @@
+// Homing with ZaberBinaryStage on the simulated port. Home() returns at once
+// and Busy() collects the reply, for a broadcast home the reply of the
+// stage's own device; a home that overruns the homing timeout is stopped and
+// its failure returned by the next position read.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../ZaberBinaryStage.h"
+#include "../ZaberBinary.h"
+#include "../PortScheduler.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+
+namespace
+{
+	ZaberBinaryStage* OpenStage(SimulatedPort& port, const char* device, const char* homeAll = "No")
+	{
+		ZaberBinaryStage* stage = new ZaberBinaryStage();
+		stage->SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Controller Device Number", device));
+		CHECK_EQUAL(DEVICE_OK, stage->Initialize());
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Home All Devices", homeAll));
+		return stage;
+	}
+
+	void CloseStage(ZaberBinaryStage* stage)
+	{
+		stage->Shutdown();
+		delete stage;
+	}
+
+	// Polls Busy() as the core does; returns how long the stage was busy.
+	double BusyMs(SimulatedPort& port, ZaberBinaryStage& stage, double limitMs)
+	{
+		double start = port.NowUs();
+		while (stage.Busy() && port.NowUs() - start < limitMs * 1000.0)
+		{
+			CDeviceUtils::SleepMs(5);
+		}
+		return (port.NowUs() - start) / 1000.0;
+	}
+
+	// Slow devices far from home, so that homing takes 10 s.
+	void FarFromHome(SimulatedPort& port, long device)
+	{
+		port.SetSetting(device, 42, 16384);
+		port.SetSetting(device, 45, 100000);
+	}
+
+	// Home() returns before the axis gets home; Busy() collects the reply.
+	void HomeDoesNotBlock(SimulatedPort& port)
+	{
+		port.SetSetting(4, 45, 50000);
+		ZaberBinaryStage* stage = OpenStage(port, "4");
+		double start = port.NowUs();
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		CHECK(port.NowUs() - start < 100000.0);
+		CHECK(stage->Busy());
+		double busyMs = BusyMs(port, *stage, 3000.0);
+		CHECK(busyMs > 300.0 && busyMs < 1500.0);
+		CHECK_EQUAL(0, port.Position(4));
+		long steps = -1;
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionSteps(steps));
+		CHECK_EQUAL(0, steps);
+		CloseStage(stage);
+	}
+
+	// A broadcast home is done when the stage's own device replies, not the
+	// first device to get home. The other replies are skipped whole, and a
+	// second stage homing meanwhile follows the device status.
+	void BroadcastHome(SimulatedPort& port)
+	{
+		port.SetSetting(5, 45, 20000);
+		port.SetSetting(6, 45, 80000);
+		PortScheduler* scheduler = PortScheduler::Acquire("SIM");
+		long resyncs = scheduler->ResyncCount();
+		ZaberBinaryStage* stage = OpenStage(port, "6", "Yes");
+		// positions from the motion model, which a home reply sets
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Position Resync Interval [ms]", "10000"));
+		ZaberBinaryStage* other = OpenStage(port, "5", "Yes");
+
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		CDeviceUtils::SleepMs(50);
+		CHECK_EQUAL(DEVICE_OK, other->Home());
+		CHECK(other->Busy());
+		CHECK(BusyMs(port, *other, 2000.0) < 500.0);
+		CHECK_EQUAL(0, port.Position(5));
+
+		// taken for the stage's reply, device 5's would put it at 0 now
+		CHECK(stage->Busy());
+		CHECK(port.IsMoving(6));
+		long steps = -1;
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionSteps(steps));
+		CHECK(steps > 0);
+		BusyMs(port, *stage, 3000.0);
+		CHECK(!port.IsMoving(6));
+		CHECK_EQUAL(0, port.Position(6));
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionSteps(steps));
+		CHECK_EQUAL(0, steps);
+		CHECK_EQUAL(resyncs, scheduler->ResyncCount());
+
+		CloseStage(other);
+		CloseStage(stage);
+		PortScheduler::Release(scheduler);
+	}
+
+	void TimeoutStopsHome(SimulatedPort& port)
+	{
+		FarFromHome(port, 1);
+		ZaberBinaryStage* stage = OpenStage(port, "1");
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Homing Timeout [ms]", "1000"));
+
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		double busyMs = BusyMs(port, *stage, 5000.0);
+		printf("  home gave up after %.0f ms\n", busyMs);
+		CHECK(busyMs > 900.0 && busyMs < 2000.0);
+		CHECK(!port.IsMoving(1));
+		long stoppedAt = port.Position(1);
+		CHECK(stoppedAt > 0 && stoppedAt < 100000);
+
+		double pos = 0;
+		CHECK_EQUAL(ERR_BUSY_TIMEOUT, stage->GetPositionUm(pos));
+		long steps = 0;
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionSteps(steps));
+		CHECK_EQUAL(stoppedAt, steps);
+		CloseStage(stage);
+	}
+
+	// With all devices homed by one broadcast, all of them are stopped.
+	void TimeoutStopsBroadcastHome(SimulatedPort& port)
+	{
+		FarFromHome(port, 2);
+		FarFromHome(port, 3);
+		ZaberBinaryStage* stage = OpenStage(port, "2", "Yes");
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Homing Timeout [ms]", "1000"));
+
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		BusyMs(port, *stage, 5000.0);
+		CHECK(!port.IsMoving(2));
+		CHECK(!port.IsMoving(3));
+		double pos = 0;
+		CHECK_EQUAL(ERR_BUSY_TIMEOUT, stage->GetPositionUm(pos));
+
+		// a new home starts clean
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		CHECK(stage->Busy());
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionUm(pos));
+		CHECK_EQUAL(DEVICE_OK, stage->Stop());
+		CloseStage(stage);
+	}
+}
+
+
+int main()
+{
+	SimulatedPort port;
+	HomeDoesNotBlock(port);
+	BroadcastHome(port);
+	TimeoutStopsHome(port);
+	TimeoutStopsBroadcastHome(port);
+	return CheckResult("HomingTest");
+}
@@ -0,0 +1,140 @@
+// Soft travel limits and device errors with ZaberBinaryStage on the
+// simulated port. A target outside the limits read from the device is
+// refused before anything is sent, or clamped to the nearer limit; an error
+// reply is mapped onto the adapter's error codes.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../ZaberBinaryStage.h"
+#include "../ZaberBinary.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+
+namespace
+{
+	const long LimitMin = -1000;
+	const long LimitMax = 100000;
+
+	ZaberBinaryStage* OpenStage(SimulatedPort& port, const char* device)
+	{
+		ZaberBinaryStage* stage = new ZaberBinaryStage();
+		stage->SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Controller Device Number", device));
+		CHECK_EQUAL(DEVICE_OK, stage->Initialize());
+		return stage;
+	}
+
+	void CloseStage(ZaberBinaryStage* stage)
+	{
+		stage->Shutdown();
+		delete stage;
+	}
+
+	int WaitIdle(ZaberBinaryStage& stage)
+	{
+		for (int i = 0; i < 5000; i++)
+		{
+			if (!stage.Busy())
+			{
+				return DEVICE_OK;
+			}
+			CDeviceUtils::SleepMs(1);
+		}
+		return DEVICE_ERR;
+	}
+
+	void RejectOutOfRange(SimulatedPort& port)
+	{
+		port.SetSetting(1, 106, LimitMin);
+		port.SetSetting(1, 44, LimitMax);
+		ZaberBinaryStage* stage = OpenStage(port, "1");
+
+		long writes = port.Writes();
+		CHECK_EQUAL(ERR_POSITION_OUT_OF_RANGE, stage->SetPositionSteps(LimitMax + 1));
+		CHECK_EQUAL(ERR_POSITION_OUT_OF_RANGE, stage->SetPositionSteps(LimitMin - 1));
+		CHECK_EQUAL(writes, port.Writes());
+
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionSteps(LimitMax));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(LimitMax, port.Position(1));
+
+		// the target of a relative move is known once the last one is done
+		writes = port.Writes();
+		CHECK_EQUAL(ERR_POSITION_OUT_OF_RANGE, stage->SetRelativePositionSteps(1));
+		CHECK_EQUAL(writes, port.Writes());
+		CHECK_EQUAL(DEVICE_OK, stage->SetRelativePositionSteps(-LimitMax));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(0, port.Position(1));
+		CloseStage(stage);
+	}
+
+	void ClampOutOfRange(SimulatedPort& port)
+	{
+		port.SetSetting(2, 106, LimitMin);
+		port.SetSetting(2, 44, LimitMax);
+		ZaberBinaryStage* stage = OpenStage(port, "2");
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Out Of Range Moves", "Clamp"));
+
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionSteps(2 * LimitMax));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(LimitMax, port.Position(2));
+
+		CHECK_EQUAL(DEVICE_OK, stage->SetRelativePositionSteps(-3 * LimitMax));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(LimitMin, port.Position(2));
+
+		long steps = 0;
+		CHECK_EQUAL(DEVICE_OK, stage->GetPositionSteps(steps));
+		CHECK_EQUAL(LimitMin, steps);
+		CloseStage(stage);
+	}
+
+	// The device's error code decides the result, whether the command waits
+	// for its reply (a position read) or not (a move).
+	void DeviceErrors(SimulatedPort& port)
+	{
+		ZaberBinaryStage* stage = OpenStage(port, "3");
+		const struct
+		{
+			long code;
+			int result;
+		} errors[] =
+		{
+			{ 20, ERR_POSITION_OUT_OF_RANGE },
+			{ 21, ERR_POSITION_OUT_OF_RANGE },
+			{ 42, ERR_SETTING_FAILED },
+			{ 106, ERR_SETTING_FAILED },
+			{ 64, DEVICE_UNSUPPORTED_COMMAND },
+			{ 2, ERR_COMMAND_REJECTED },
+			{ 255, ERR_COMMAND_REJECTED },
+		};
+		for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+		{
+			port.RejectNext(3, errors[i].code);
+			long steps = 0;
+			CHECK_EQUAL(errors[i].result, stage->GetPositionSteps(steps));
+		}
+
+		// a refused move ends Busy() with nothing moving, and the next one
+		// goes ahead
+		port.RejectNext(3, 20);
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionSteps(5000));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(0, port.Position(3));
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionSteps(5000));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(5000, port.Position(3));
+		CloseStage(stage);
+	}
+}
+
+
+int main()
+{
+	SimulatedPort port;
+	RejectOutOfRange(port);
+	ClampOutOfRange(port);
+	DeviceErrors(port);
+	return CheckResult("LimitsTest");
+}
@@ -0,0 +1,136 @@
+// Runs PortScheduler over LinuxSerialTransport on a pseudo terminal, with the
+// simulated devices on the master side. Several threads wait on slow replies
+// at once: only one of them can block in the transport's read, and the others
+// must back off rather than spin, so the process stays far from a full core
+// per waiter.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../PortScheduler.h"
+#include <DeviceBase.h>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+	const int DeviceCount = 3;
+	const int Waiters = 4;
+	const int Queries = 20;
+
+	double CpuSeconds()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	}
+
+	// Moves bytes between the pty master and the simulated devices.
+	void Pump(int master, SimulatedPort& port, atomic<bool>& quit)
+	{
+		unsigned char buf[64];
+		while (!quit)
+		{
+			pollfd fd = { master, POLLIN, 0 };
+			if (poll(&fd, 1, 1) > 0 && (fd.revents & POLLIN))
+			{
+				ssize_t n = read(master, buf, sizeof(buf));
+				if (n > 0)
+				{
+					port.WriteToSerial(0, "", buf, (unsigned long) n);
+				}
+			}
+			unsigned long got = 0;
+			port.ReadFromSerial(0, "", buf, sizeof(buf), got);
+			if (got > 0 && write(master, buf, got) != (ssize_t) got)
+			{
+				return;
+			}
+		}
+	}
+}
+
+
+int main()
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+	{
+		printf("  no pseudo terminal available; skipped\n");
+		return 0;
+	}
+	string slave = ptsname(master);
+
+	SimulatedPort port;
+	port.SetReplyDelayUs(30000.0);
+	for (int d = 1; d <= DeviceCount; d++)
+	{
+		port.SetSetting(d, 37, d * 1000 + 37);
+	}
+	atomic<bool> quit(false);
+	thread device(Pump, master, ref(port), ref(quit));
+
+	PortScheduler* scheduler = PortScheduler::Acquire("PTY");
+	int ret = scheduler->UseNativePort(slave, 115200);
+	CHECK_EQUAL(DEVICE_OK, ret);
+	if (ret == DEVICE_OK)
+	{
+		atomic<long> good(0), bad(0);
+		double cpuStart = CpuSeconds();
+		chrono::steady_clock::time_point wallStart = chrono::steady_clock::now();
+
+		vector<thread> threads;
+		for (int t = 0; t < Waiters; t++)
+		{
+			threads.push_back(thread([&, t]()
+			{
+				for (int i = 0; i < Queries; i++)
+				{
+					int device = 1 + (t + i) % DeviceCount;
+					PortRequest request;
+					request.frame[0] = (unsigned char) device;
+					request.frame[1] = 53;
+					request.frame[2] = 37;
+					if (scheduler->Submit(&port, 0, request) == DEVICE_OK && scheduler->Wait(&port, 0, request, 2000) == DEVICE_OK
+						&& request.reply[0] == device && request.reply[1] == 37
+						&& (request.reply[2] | request.reply[3] << 8) == device * 1000 + 37)
+					{
+						good++;
+					}
+					else
+					{
+						bad++;
+					}
+				}
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); t++)
+		{
+			threads[t].join();
+		}
+
+		double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+		double cpu = CpuSeconds() - cpuStart;
+		printf("  %ld good, %ld bad; %.2f s CPU in %.2f s with %d waiters\n", good.load(), bad.load(), cpu, wall, Waiters);
+		CHECK_EQUAL(Waiters * Queries, good.load());
+		CHECK_EQUAL(0, bad.load());
+		// a spinning waiter alone would take a whole core
+		CHECK(cpu < 0.5 * wall);
+	}
+
+	PortScheduler::Release(scheduler);
+	quit = true;
+	device.join();
+	close(master);
+	return CheckResult("NativePortTest");
+}
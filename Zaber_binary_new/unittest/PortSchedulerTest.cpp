@@ -0,0 +1,205 @@
+// Stress test for PortScheduler: eight threads query a simulated port while
+// others move, stop and withdraw requests, with and without message IDs.
+// Every reply must reach the request it answers, and the scheduler must end
+// with nothing queued or in flight.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../PortScheduler.h"
+#include <DeviceBase.h>
+#include <atomic>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+	const int DeviceCount = 3;
+	const unsigned char Settings[] = { 37, 42, 43, 44 };
+
+	long Expected(int device, unsigned char setting)
+	{
+		return device * 1000 + setting;
+	}
+
+	long ReplyData(const PortRequest& request)
+	{
+		return (long) (int) ((unsigned long) request.reply[2] | (unsigned long) request.reply[3] << 8
+			| (unsigned long) request.reply[4] << 16 | (unsigned long) request.reply[5] << 24);
+	}
+
+	void Query(PortRequest& request, int device, unsigned char setting)
+	{
+		request.frame[0] = (unsigned char) device;
+		request.frame[1] = 53;
+		request.frame[2] = setting;
+		request.frame[3] = request.frame[4] = request.frame[5] = 0;
+	}
+
+	long DumpedRecords(FlightRecorder& recorder, const string& path)
+	{
+		if (recorder.Dump(path) != DEVICE_OK)
+		{
+			return -1;
+		}
+		FILE* file = fopen(path.c_str(), "rb");
+		unsigned char header[12] = { 0 };
+		size_t read = fread(header, 1, sizeof(header), file);
+		fclose(file);
+		remove(path.c_str());
+		return read == sizeof(header) ? (long) (header[8] | header[9] << 8 | header[10] << 16 | header[11] << 24) : -1;
+	}
+
+	void Stress(bool messageIds)
+	{
+		SimulatedPort port;
+		port.SetReplyDelayUs(300.0);
+		PortScheduler* scheduler = PortScheduler::Acquire("SIM");
+		scheduler->SetBaudRate(115200);
+		scheduler->SetDeviceBudget(4, 0.2);
+		for (int d = 1; d <= DeviceCount; d++)
+		{
+			for (size_t s = 0; s < sizeof(Settings); s++)
+			{
+				// keep the travel wide enough for the moves below
+				port.SetSetting(d, Settings[s], Settings[s] == 44 ? 1000000 + Expected(d, 44) : Expected(d, Settings[s]));
+			}
+			if (messageIds)
+			{
+				port.SetSetting(d, 40, 64);
+				scheduler->SetMessageIds(d, true);
+			}
+		}
+
+		// every device on a port keeps its own recorder
+		FlightRecorder first, second;
+		first.SetEnabled(true);
+		second.SetEnabled(true);
+		scheduler->AttachRecorder(&first);
+		scheduler->AttachRecorder(&second);
+
+		atomic<long> good(0), bad(0), errors(0);
+		vector<thread> threads;
+		for (int t = 0; t < 8; t++)
+		{
+			threads.push_back(thread([&, t]()
+			{
+				for (int i = 0; i < 300; i++)
+				{
+					int device = 1 + (t + i) % DeviceCount;
+					unsigned char setting = Settings[(t * 7 + i) % sizeof(Settings)];
+					PortRequest request;
+					Query(request, device, setting);
+					if (scheduler->Submit(&port, 0, request) != DEVICE_OK || scheduler->Wait(&port, 0, request, 2000) != DEVICE_OK)
+					{
+						errors++;
+						continue;
+					}
+					long expected = (setting == 44) ? 1000000 + Expected(device, 44) : Expected(device, setting);
+					if (request.reply[0] == device && request.reply[1] == setting && ReplyData(request) == expected)
+					{
+						good++;
+					}
+					else
+					{
+						bad++;
+					}
+				}
+			}));
+		}
+
+		// moves interrupted by urgent stops; the stop discards what is queued
+		threads.push_back(thread([&]()
+		{
+			for (int i = 0; i < 40; i++)
+			{
+				PortRequest move;
+				move.frame[0] = 2;
+				move.frame[1] = 20;
+				move.frame[2] = (unsigned char) (i + 1);
+				move.frame[3] = 100;
+				scheduler->Submit(&port, 0, move);
+				CDeviceUtils::SleepMs(2);
+
+				PortRequest stop;
+				stop.urgent = true;
+				stop.frame[0] = 2;
+				stop.frame[1] = 23;
+				int ret = scheduler->Submit(&port, 0, stop);
+				if (ret == DEVICE_OK)
+				{
+					ret = scheduler->Wait(&port, 0, stop, 2000);
+				}
+				scheduler->Cancel(move);
+				(ret == DEVICE_OK && stop.reply[1] == 23) ? good++ : bad++;
+			}
+		}));
+
+		// requests withdrawn and submitted again at once, as a timed out
+		// Wait() or a superseded move does, racing the flushers
+		for (int t = 0; t < 4; t++)
+		{
+			threads.push_back(thread([&, t]()
+			{
+				PortRequest request;
+				for (int i = 0; i < 300; i++)
+				{
+					int device = 1 + (t + i) % DeviceCount;
+					Query(request, device, 42);
+					scheduler->Submit(&port, 0, request);
+					scheduler->Cancel(request);
+					Query(request, device, 43);
+					if (scheduler->Submit(&port, 0, request) != DEVICE_OK || scheduler->Wait(&port, 0, request, 2000) != DEVICE_OK)
+					{
+						errors++;
+						continue;
+					}
+					(request.reply[1] == 43 && ReplyData(request) == Expected(device, 43)) ? good++ : bad++;
+				}
+			}));
+		}
+
+		for (size_t t = 0; t < threads.size(); t++)
+		{
+			threads[t].join();
+		}
+
+		// late replies to withdrawn requests are skipped, not matched
+		for (int i = 0; i < 20; i++)
+		{
+			scheduler->Poll(&port, 0);
+			CDeviceUtils::SleepMs(1);
+		}
+		PortScheduler::Stats stats;
+		scheduler->GetStats(stats);
+
+		printf("  message IDs %s: %ld good, %ld bad, %ld errors, %ld resyncs\n", messageIds ? "on" : "off",
+			good.load(), bad.load(), errors.load(), scheduler->ResyncCount());
+		CHECK_EQUAL(0, bad.load());
+		CHECK_EQUAL(0, errors.load());
+		CHECK_EQUAL(8 * 300 + 40 + 4 * 300, good.load());
+		CHECK_EQUAL(0, scheduler->ResyncCount());
+		CHECK_EQUAL(0, stats.queueDepth);
+		CHECK_EQUAL(0, stats.inFlight);
+
+		long firstRecords = DumpedRecords(first, "scheduler_test_first.zbfr");
+		long secondRecords = DumpedRecords(second, "scheduler_test_second.zbfr");
+		CHECK(firstRecords > 0);
+		CHECK_EQUAL(firstRecords, secondRecords);
+
+		scheduler->DetachRecorder(&first);
+		scheduler->DetachRecorder(&second);
+		PortScheduler::Release(scheduler);
+	}
+}
+
+
+int main()
+{
+	Stress(false);
+	Stress(true);
+	return CheckResult("PortSchedulerTest");
+}
@@ -0,0 +1,103 @@
+// PositionFeed slots: one writer per device address on a segment, whether
+// the other writer is in this process or another, and a slot left by a
+// process that is gone is taken over.
+
+#include "Check.h"
+#include "../PositionFeed.h"
+#include "../ZaberBinary.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+	const size_t HeaderSize = 64;
+	const size_t SlotSize = 64;
+	const size_t FeedSize = HeaderSize + PositionFeed::SlotCount * SlotSize;
+
+	// The segment as a reader sees it.
+	unsigned char* Map(const string& name)
+	{
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+		{
+			return 0;
+		}
+		void* base = mmap(0, FeedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		return (base == MAP_FAILED) ? 0 : static_cast<unsigned char*>(base);
+	}
+
+	uint64_t& Field(unsigned char* base, long device, size_t offset)
+	{
+		return *reinterpret_cast<uint64_t*>(base + HeaderSize + device * SlotSize + offset);
+	}
+
+	// A pid no process has: that of a child that has exited.
+	pid_t GonePid()
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			_exit(0);
+		}
+		waitpid(pid, 0, 0);
+		return pid;
+	}
+}
+
+
+int main()
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/zaber-feed-test-%d", (int) getpid());
+	shm_unlink(name);
+
+	{
+		PositionFeed first, second, other;
+		CHECK_EQUAL(DEVICE_OK, first.Open(name, 5));
+		// the same device number on another port
+		CHECK_EQUAL(ERR_FEED_SLOT_IN_USE, second.Open(name, 5));
+		CHECK(!second.IsOpen());
+		CHECK_EQUAL(DEVICE_OK, other.Open(name, 6));
+
+		unsigned char* base = Map(name);
+		CHECK(base != 0);
+		if (base != 0)
+		{
+			first.Write(1234, 192.8125, MM::MMTime(5000.0));
+			CHECK_EQUAL(1, Field(base, 5, 8));
+			CHECK_EQUAL(1234, Field(base, 5, 16));
+			CHECK_EQUAL(0, Field(base, 5, 0) & 1);
+
+			// the first writer has not lost its slot to the refused one
+			CHECK((Field(base, 5, 40) >> 32) == (uint64_t) getpid());
+			first.Close();
+			CHECK_EQUAL(0, Field(base, 5, 8));
+			CHECK_EQUAL(0, Field(base, 5, 40));
+			CHECK_EQUAL(DEVICE_OK, second.Open(name, 5));
+
+			// a writer that died with the slot claimed, mid-update
+			Field(base, 7, 40) = ((uint64_t) GonePid() << 32) | 1;
+			Field(base, 7, 0) = 3;
+			PositionFeed taker;
+			CHECK_EQUAL(DEVICE_OK, taker.Open(name, 7));
+			CHECK_EQUAL(0, Field(base, 7, 0) & 1);
+
+			// a live process other than this one
+			Field(base, 8, 40) = ((uint64_t) getppid() << 32) | 1;
+			PositionFeed refused;
+			CHECK_EQUAL(ERR_FEED_SLOT_IN_USE, refused.Open(name, 8));
+			munmap(base, FeedSize);
+		}
+	}
+
+	shm_unlink(name);
+	return CheckResult("PositionFeedTest");
+}
@@ -0,0 +1,121 @@
+// Records a stage session against the simulated port, then replays it into
+// a fresh ZaberBinaryStage on a core whose clock is far from the recording's.
+// The replayed stage must send exactly the recorded frames and report the
+// same positions; with the position estimate on, that only holds if the
+// replay clock agrees with the core clock the stage times moves with.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../ZaberBinaryStage.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+	const char* SessionPath = "replay_test.zbsr";
+
+	int WaitIdle(ZaberBinaryStage& stage)
+	{
+		for (int i = 0; i < 5000; i++)
+		{
+			if (!stage.Busy())
+			{
+				return DEVICE_OK;
+			}
+			CDeviceUtils::SleepMs(1);
+		}
+		return DEVICE_ERR;
+	}
+
+	// The same calls in both sessions. Positions are collected as they are
+	// reported; with the estimate on, the ones after a move come from the
+	// motion model rather than from the device.
+	void Script(ZaberBinaryStage& stage, vector<double>& positions)
+	{
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Position Resync Interval [ms]", "60000"));
+
+		const double targets[] = { 1000.0, 250.0, 4000.0 };
+		for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++)
+		{
+			CHECK_EQUAL(DEVICE_OK, stage.SetPositionUm(targets[i]));
+			CHECK_EQUAL(DEVICE_OK, WaitIdle(stage));
+			double pos = 0;
+			CHECK_EQUAL(DEVICE_OK, stage.GetPositionUm(pos));
+			positions.push_back(pos);
+		}
+
+		// two deltas while the first is on its way; both must arrive
+		CHECK_EQUAL(DEVICE_OK, stage.SetRelativePositionUm(-500.0));
+		CHECK_EQUAL(DEVICE_OK, stage.SetRelativePositionUm(-700.0));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(stage));
+		double pos = 0;
+		CHECK_EQUAL(DEVICE_OK, stage.GetPositionUm(pos));
+		positions.push_back(pos);
+
+		// a read from the device, not the model
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Position Resync Interval [ms]", "0"));
+		CHECK_EQUAL(DEVICE_OK, stage.GetPositionUm(pos));
+		positions.push_back(pos);
+	}
+
+	long Mismatches(ZaberBinaryStage& stage)
+	{
+		char value[MM::MaxStrLength];
+		if (stage.GetProperty("Serial Session Replay Mismatches", value) != DEVICE_OK)
+		{
+			return -1;
+		}
+		return atol(value);
+	}
+}
+
+
+int main()
+{
+	vector<double> recorded, replayed;
+	{
+		SimulatedPort port;
+		ZaberBinaryStage stage;
+		stage.SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty(MM::g_Keyword_Port, "SIM1"));
+
+		// record from the first frame, before the stage has the port
+		PortScheduler* scheduler = PortScheduler::Acquire("SIM1");
+		CHECK_EQUAL(DEVICE_OK, scheduler->StartRecording(SessionPath));
+		CHECK_EQUAL(DEVICE_OK, stage.Initialize());
+		Script(stage, recorded);
+		stage.Shutdown();
+		scheduler->StopRecording();
+		PortScheduler::Release(scheduler);
+
+		// 1000 + 250 + 4000 - 500 - 700 um
+		CHECK_EQUAL(nint(2800.0 / 0.15625), port.Position(1));
+	}
+
+	{
+		// an hour into the core's clock
+		StandInCore core(3600.0e6);
+		ZaberBinaryStage stage;
+		stage.SetCallback(&core);
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty(MM::g_Keyword_Port, "SIM2"));
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Serial Session Replay File", SessionPath));
+		CHECK_EQUAL(DEVICE_OK, stage.Initialize());
+		Script(stage, replayed);
+		CHECK_EQUAL(0, Mismatches(stage));
+		stage.Shutdown();
+	}
+	remove(SessionPath);
+
+	CHECK_EQUAL(recorded.size(), replayed.size());
+	for (size_t i = 0; i < recorded.size() && i < replayed.size(); i++)
+	{
+		printf("  position %d: recorded %.3f um, replayed %.3f um\n", (int) i, recorded[i], replayed[i]);
+		CHECK(recorded[i] == replayed[i]);
+	}
+	CHECK(recorded.size() == 5 && recorded[3] == 2800.0 && recorded[4] == 2800.0);
+	return CheckResult("ReplayTest");
+}
@@ -0,0 +1,148 @@
+// Damages single replies on the line, a byte lost or a byte inserted, and
+// checks that PortScheduler realigns on the next frame: the damaged query
+// may fail, but no reply may be handed to the wrong request and the queries
+// after it must succeed. Runs with and without message IDs, one query at a
+// time and with a query to every device in flight at once. Without IDs, a
+// reply short of a byte joined to the next one can pass for the first
+// query's reply while both are in flight; only message IDs rule that out.
+// The replies every device sends to a broadcast must not count as damage.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../PortScheduler.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+
+namespace
+{
+	const int DeviceCount = 3;
+	const int Rounds = 120;
+	const int FaultEvery = 10;
+
+	long Expected(int device)
+	{
+		return device * 1000 + 37;
+	}
+
+	void Query(PortRequest& request, int device)
+	{
+		request.frame[0] = (unsigned char) device;
+		request.frame[1] = 53;
+		request.frame[2] = 37;
+		request.frame[3] = request.frame[4] = request.frame[5] = 0;
+	}
+
+	// 1 if the reply answers the query, 0 if the query failed, -1 if the
+	// reply belongs to another query
+	int Outcome(PortScheduler* scheduler, SimulatedPort& port, PortRequest& request, int device)
+	{
+		if (scheduler->Wait(&port, 0, request, 100) != DEVICE_OK)
+		{
+			return 0;
+		}
+		long data = (long) (int) ((unsigned long) request.reply[2] | (unsigned long) request.reply[3] << 8
+			| (unsigned long) request.reply[4] << 16 | (unsigned long) request.reply[5] << 24);
+		bool ours = request.reply[0] == device && request.reply[1] == 37 && data == Expected(device);
+		return ours ? 1 : -1;
+	}
+
+	void Damage(bool messageIds, bool burst)
+	{
+		SimulatedPort port;
+		port.SetReplyDelayUs(300.0);
+		PortScheduler* scheduler = PortScheduler::Acquire("RESYNC");
+		scheduler->SetBaudRate(115200);
+		for (int d = 1; d <= DeviceCount; d++)
+		{
+			port.SetSetting(d, 37, Expected(d));
+			if (messageIds)
+			{
+				port.SetSetting(d, 40, 64);
+			}
+			scheduler->SetMessageIds(d, messageIds);
+		}
+
+		long good = 0, failed = 0, bad = 0, faults = 0, failedAfterFault = 0;
+		for (int round = 0; round < Rounds; round++)
+		{
+			bool fault = round % FaultEvery == FaultEvery - 1;
+			if (fault)
+			{
+				port.InjectFault((round / FaultEvery) % 2 == 0 ? SimulatedPort::LoseByte : SimulatedPort::ExtraByte);
+				faults++;
+			}
+
+			int queries = burst ? DeviceCount : 1;
+			PortRequest requests[DeviceCount];
+			for (int q = 0; q < queries; q++)
+			{
+				Query(requests[q], 1 + (round + q) % DeviceCount);
+				scheduler->Submit(&port, 0, requests[q]);
+			}
+			for (int q = 0; q < queries; q++)
+			{
+				int outcome = Outcome(scheduler, port, requests[q], 1 + (round + q) % DeviceCount);
+				good += outcome > 0;
+				failed += outcome == 0;
+				bad += outcome < 0;
+				// the round after a fault must be clean again
+				failedAfterFault += round % FaultEvery == 0 && round > 0 && outcome <= 0;
+			}
+		}
+
+		printf("  message IDs %s, %s: %ld good, %ld failed, %ld bad with %ld faults; %ld bytes skipped\n",
+			messageIds ? "on" : "off", burst ? "burst" : "one at a time", good, failed, bad, faults, scheduler->ResyncCount());
+		if (messageIds || !burst)
+		{
+			CHECK_EQUAL(0, bad);
+		}
+		CHECK_EQUAL(0, failedAfterFault);
+		CHECK(failed + bad <= faults * (burst ? DeviceCount : 1));
+		CHECK(scheduler->ResyncCount() > 0);
+		PortScheduler::Release(scheduler);
+	}
+
+	// Every device answers a broadcast; the replies after the one awaited
+	// are skipped whole, not taken for a misaligned stream.
+	void Broadcast()
+	{
+		SimulatedPort port;
+		port.SetReplyDelayUs(300.0);
+		PortScheduler* scheduler = PortScheduler::Acquire("RESYNC");
+		scheduler->SetBaudRate(115200);
+		for (int d = 1; d <= SimulatedPort::MaxDevice; d++)
+		{
+			port.SetSetting(d, 37, Expected(d));
+		}
+
+		PortRequest request;
+		Query(request, 0);
+		request.replyFrom = 2;
+		scheduler->Submit(&port, 0, request);
+		CHECK_EQUAL(DEVICE_OK, scheduler->Wait(&port, 0, request, 100));
+		CHECK_EQUAL(2, (int) request.reply[0]);
+
+		long good = 0;
+		for (int i = 0; i < 20; i++)
+		{
+			PortRequest query;
+			Query(query, 1 + i % DeviceCount);
+			scheduler->Submit(&port, 0, query);
+			good += Outcome(scheduler, port, query, 1 + i % DeviceCount) > 0;
+		}
+		CHECK_EQUAL(20, good);
+		CHECK_EQUAL(0, scheduler->ResyncCount());
+		PortScheduler::Release(scheduler);
+	}
+}
+
+
+int main()
+{
+	Damage(false, false);
+	Damage(true, false);
+	Damage(false, true);
+	Damage(true, true);
+	Broadcast();
+	return CheckResult("ResyncTest");
+}
@@ -0,0 +1,152 @@
+// PositionSampler and its sample ring: a full ring keeps the newest
+// samples, a consumer racing the producer never sees a torn or stale one,
+// and a lookup across failed reads reports the position unknown.
+
+#include "Check.h"
+#include "standin/StandInCore.h"
+#include "../PositionSampler.h"
+#include <DeviceBase.h>
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+	SampleRing::Sample MakeSample(long i)
+	{
+		SampleRing::Sample sample;
+		sample.timeUs = (double) i;
+		sample.steps = i;
+		return sample;
+	}
+
+	void FullRingKeepsNewest()
+	{
+		SampleRing* ring = new SampleRing();
+		long overwritten = 0;
+		for (long i = 0; i < SampleRing::Capacity + 10; i++)
+		{
+			overwritten += ring->Push(MakeSample(i)) ? 0 : 1;
+		}
+		CHECK_EQUAL(10, overwritten);
+
+		SampleRing::Sample sample;
+		long count = 0;
+		long first = -1, last = -1;
+		while (ring->Pop(sample))
+		{
+			first = (first < 0) ? sample.steps : first;
+			last = sample.steps;
+			count++;
+		}
+		CHECK_EQUAL(SampleRing::Capacity, count);
+		CHECK_EQUAL(10, first);
+		CHECK_EQUAL(SampleRing::Capacity + 9, last);
+		delete ring;
+	}
+
+	// The producer outruns the consumer, so it overwrites slots the
+	// consumer may be reading.
+	void RacingConsumer()
+	{
+		SampleRing* ring = new SampleRing();
+		const long count = 2000000;
+		atomic<bool> done(false);
+		long torn = 0, backwards = 0, popped = 0;
+		thread consumer([&]()
+		{
+			long previous = -1;
+			SampleRing::Sample sample;
+			for (;;)
+			{
+				bool finished = done;
+				while (ring->Pop(sample))
+				{
+					torn += (sample.timeUs != (double) sample.steps) ? 1 : 0;
+					backwards += (sample.steps <= previous) ? 1 : 0;
+					previous = sample.steps;
+					popped++;
+				}
+				if (finished)
+				{
+					break;
+				}
+			}
+		});
+		long overwritten = 0;
+		for (long i = 0; i < count; i++)
+		{
+			overwritten += ring->Push(MakeSample(i)) ? 0 : 1;
+		}
+		done = true;
+		consumer.join();
+
+		printf("  %ld popped, %ld overwritten\n", popped, overwritten);
+		CHECK_EQUAL(0, torn);
+		CHECK_EQUAL(0, backwards);
+		CHECK_EQUAL(count, popped + overwritten);
+		delete ring;
+	}
+
+	// Reads the time as position, and fails while told to.
+	class ClockSource : public SampleSource
+	{
+	public:
+		ClockSource(StandInCore& core) : core_(core), failing_(false) {}
+		void SetFailing(bool failing) { failing_ = failing; }
+
+		int ReadSample(long& steps, MM::MMTime& time)
+		{
+			if (failing_)
+			{
+				return DEVICE_ERR;
+			}
+			time = core_.GetCurrentMMTime();
+			steps = (long) (time.getUsec() / 1000.0);
+			return DEVICE_OK;
+		}
+
+	private:
+		StandInCore& core_;
+		atomic<bool> failing_;
+	};
+
+	void GapIsUnknown()
+	{
+		StandInCore core;
+		ClockSource source(core);
+		PositionSampler sampler(&source);
+		sampler.SetClock(&core);
+		CHECK_EQUAL(DEVICE_OK, sampler.Start(2.0));
+
+		CDeviceUtils::SleepMs(60);
+		MM::MMTime before = core.GetCurrentMMTime() - MM::MMTime(20000.0);
+		source.SetFailing(true);
+		MM::MMTime gapStart = core.GetCurrentMMTime();
+		CDeviceUtils::SleepMs(60);
+		MM::MMTime during = gapStart + MM::MMTime(30000.0);
+		source.SetFailing(false);
+		CDeviceUtils::SleepMs(60);
+		MM::MMTime after = core.GetCurrentMMTime() - MM::MMTime(20000.0);
+		sampler.Stop();
+
+		double steps = 0;
+		CHECK_EQUAL(DEVICE_OK, sampler.PositionAt(before, steps));
+		CHECK(steps > before.getMsec() - 3.0 && steps < before.getMsec() + 3.0);
+		CHECK_EQUAL(DEVICE_UNKNOWN_POSITION, sampler.PositionAt(during, steps));
+		CHECK_EQUAL(DEVICE_OK, sampler.PositionAt(after, steps));
+		CHECK(steps > after.getMsec() - 3.0 && steps < after.getMsec() + 3.0);
+		CHECK(sampler.ErrorCount() > 0);
+	}
+}
+
+
+int main()
+{
+	FullRingKeepsNewest();
+	RacingConsumer();
+	GapIsUnknown();
+	return CheckResult("SamplerTest");
+}
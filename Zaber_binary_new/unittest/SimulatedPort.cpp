@@ -0,0 +1,302 @@
+#include "SimulatedPort.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+using namespace std;
+
+
+SimulatedPort::SimulatedPort() :
+	replyDelayUs_(1000.0),
+	dropMoveReplies_(false),
+	writes_(0),
+	fault_(NoFault)
+{
+	for (int d = 0; d <= MaxDevice; d++)
+	{
+		Axis& axis = axes_[d];
+		memset(axis.settings, 0, sizeof(axis.settings));
+		axis.settings[37] = 64;        // resolution
+		axis.settings[42] = 163840;    // maxspeed, 100000 steps/s
+		axis.settings[43] = 100;       // accel
+		axis.settings[44] = 305381;    // limit.max
+		axis.start = 0;
+		axis.target = 0;
+		axis.startUs = 0.0;
+		axis.endUs = 0.0;
+		axis.velocity = 0;
+		memset(axis.stored, 0, sizeof(axis.stored));
+		axis.reject = 0;
+	}
+}
+
+
+void SimulatedPort::SetSetting(long device, unsigned char setting, long value)
+{
+	lock_guard<mutex> guard(lock_);
+	axes_[device].settings[setting] = value;
+	if (setting == 45)
+	{
+		axes_[device].start = axes_[device].target = value;
+		axes_[device].endUs = 0.0;
+	}
+}
+
+
+void SimulatedPort::SetStoredPosition(long device, long index, long steps)
+{
+	lock_guard<mutex> guard(lock_);
+	axes_[device].stored[index & 15] = steps;
+}
+
+
+void SimulatedPort::RejectNext(long device, long errorCode)
+{
+	lock_guard<mutex> guard(lock_);
+	axes_[device].reject = errorCode;
+}
+
+
+long SimulatedPort::Setting(long device, unsigned char setting)
+{
+	lock_guard<mutex> guard(lock_);
+	return axes_[device].settings[setting];
+}
+
+
+void SimulatedPort::InjectFault(Fault fault)
+{
+	lock_guard<mutex> guard(lock_);
+	fault_ = fault;
+}
+
+
+long SimulatedPort::Position(long device)
+{
+	lock_guard<mutex> guard(lock_);
+	return PositionAt(device, NowUs());
+}
+
+
+bool SimulatedPort::IsMoving(long device)
+{
+	lock_guard<mutex> guard(lock_);
+	return NowUs() < axes_[device].endUs || axes_[device].velocity != 0;
+}
+
+
+// Frames may arrive in pieces; each complete one is executed at once.
+int SimulatedPort::WriteToSerial(const MM::Device* /*caller*/, const char* /*port*/, const unsigned char* buf, unsigned long length)
+{
+	lock_guard<mutex> guard(lock_);
+	double nowUs = NowUs();
+	partial_.insert(partial_.end(), buf, buf + length);
+	while (partial_.size() >= 6)
+	{
+		unsigned char frame[6];
+		memcpy(frame, &partial_[0], 6);
+		partial_.erase(partial_.begin(), partial_.begin() + 6);
+		writes_++;
+
+		if (frame[0] == 0)
+		{
+			for (long d = 1; d <= MaxDevice; d++)
+			{
+				Execute(d, frame, nowUs);
+			}
+		}
+		else if (frame[0] <= MaxDevice)
+		{
+			Execute(frame[0], frame, nowUs);
+		}
+	}
+	return DEVICE_OK;
+}
+
+
+int SimulatedPort::ReadFromSerial(const MM::Device* /*caller*/, const char* /*port*/, unsigned char* buf, unsigned long length, unsigned long& read)
+{
+	lock_guard<mutex> guard(lock_);
+	double nowUs = NowUs();
+	vector<Reply>::iterator it = replies_.begin();
+	while (it != replies_.end())
+	{
+		if (it->dueUs <= nowUs)
+		{
+			switch (fault_)
+			{
+			case LoseByte:
+				rx_.insert(rx_.end(), it->frame, it->frame + 5);
+				break;
+			case ExtraByte:
+				rx_.push_back(it->frame[0]);
+				rx_.insert(rx_.end(), it->frame, it->frame + 6);
+				break;
+			default:
+				rx_.insert(rx_.end(), it->frame, it->frame + 6);
+				break;
+			}
+			fault_ = NoFault;
+			it = replies_.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+
+	read = 0;
+	while (read < length && !rx_.empty())
+	{
+		buf[read++] = rx_.front();
+		rx_.pop_front();
+	}
+	return DEVICE_OK;
+}
+
+
+void SimulatedPort::Execute(long device, const unsigned char* frame, double nowUs)
+{
+	Axis& axis = axes_[device];
+	bool ids = (axis.settings[40] & 64) != 0;
+	unsigned char id = ids ? frame[5] : 0;
+	long data = (long) frame[2] | ((long) frame[3] << 8) | ((long) frame[4] << 16);
+	if (ids)
+	{
+		data -= (frame[4] & 0x80) ? 0x1000000L : 0;
+	}
+	else
+	{
+		data = (long) (int32_t) ((uint32_t) data | ((uint32_t) frame[5] << 24));
+	}
+	double dueUs = nowUs + replyDelayUs_;
+
+	if (axis.reject != 0)
+	{
+		Queue(device, 255, axis.reject, id, dueUs, false);
+		axis.reject = 0;
+		return;
+	}
+
+	switch (frame[1])
+	{
+	case 1:
+		StartMove(device, 0, 1, id, nowUs);
+		break;
+	case 20:
+		StartMove(device, data, 20, id, nowUs);
+		break;
+	case 21:
+		StartMove(device, PositionAt(device, nowUs) + data, 21, id, nowUs);
+		break;
+	case 22:
+		DropMoves(device);
+		axis.velocity = data;
+		Queue(device, 22, data, id, dueUs, false);
+		break;
+	case 23:
+	{
+		DropMoves(device);
+		axis.velocity = 0;
+		long pos = PositionAt(device, nowUs);
+		axis.start = axis.target = pos;
+		axis.endUs = 0.0;
+		Queue(device, 23, pos, id, dueUs, false);
+		break;
+	}
+	case 17:
+		Queue(device, 17, axis.stored[data & 15], id, dueUs, false);
+		break;
+	case 53:
+	{
+		unsigned char setting = frame[2];
+		long value = (setting == 45) ? PositionAt(device, nowUs) : axis.settings[setting & 127];
+		Queue(device, setting, value, id, dueUs, false);
+		break;
+	}
+	case 54:
+		Queue(device, 54, (nowUs < axis.endUs) ? 99 : 0, id, dueUs, false);
+		break;
+	case 60:
+		Queue(device, 60, PositionAt(device, nowUs), id, dueUs, false);
+		break;
+	case 37: case 40: case 42: case 43: case 44: case 106:
+		axis.settings[frame[1]] = data;
+		Queue(device, frame[1], data, id, dueUs, false);
+		break;
+	default:
+		// invalid command
+		Queue(device, 255, 64, id, dueUs, false);
+		break;
+	}
+}
+
+
+// Moves at maxspeed, converted to steps/s the way the adapter does.
+void SimulatedPort::StartMove(long device, long target, unsigned char command, unsigned char id, double nowUs)
+{
+	Axis& axis = axes_[device];
+	if (target < axis.settings[106] || target > axis.settings[44])
+	{
+		// position out of range
+		Queue(device, 255, command, id, nowUs + replyDelayUs_, false);
+		return;
+	}
+
+	DropMoves(device);
+	axis.velocity = 0;
+	axis.start = PositionAt(device, nowUs);
+	axis.target = target;
+	axis.startUs = nowUs;
+	double speed = axis.settings[42] / 1.6384;
+	double durationUs = (speed > 0) ? fabs((double) (target - axis.start)) / speed * 1e6 : 0.0;
+	axis.endUs = nowUs + durationUs;
+	if (!dropMoveReplies_)
+	{
+		Queue(device, command, target, id, axis.endUs + replyDelayUs_, true);
+	}
+}
+
+
+void SimulatedPort::DropMoves(long device)
+{
+	vector<Reply>::iterator it = replies_.begin();
+	while (it != replies_.end())
+	{
+		if (it->move && it->frame[0] == device)
+		{
+			it = replies_.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+}
+
+
+void SimulatedPort::Queue(long device, unsigned char command, long data, unsigned char id, double dueUs, bool move)
+{
+	Reply reply;
+	reply.dueUs = dueUs;
+	reply.move = move;
+	reply.frame[0] = (unsigned char) device;
+	reply.frame[1] = command;
+	reply.frame[2] = (unsigned char) (data & 0xFF);
+	reply.frame[3] = (unsigned char) ((data >> 8) & 0xFF);
+	reply.frame[4] = (unsigned char) ((data >> 16) & 0xFF);
+	reply.frame[5] = (axes_[device].settings[40] & 64) ? id : (unsigned char) ((data >> 24) & 0xFF);
+	replies_.push_back(reply);
+}
+
+
+long SimulatedPort::PositionAt(long device, double nowUs) const
+{
+	const Axis& axis = axes_[device];
+	if (nowUs >= axis.endUs || axis.endUs <= axis.startUs)
+	{
+		return axis.target;
+	}
+	double fraction = (nowUs - axis.startUs) / (axis.endUs - axis.startUs);
+	return axis.start + (long) ((axis.target - axis.start) * fraction);
+}
@@ -0,0 +1,83 @@
+#ifndef _ZABER_SIMULATED_PORT_H_
+#define _ZABER_SIMULATED_PORT_H_
+
+#include "standin/StandInCore.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// A stand-in core whose serial port has simulated binary devices behind it.
+// Each device answers after a reply delay and moves at its "maxspeed"
+// setting with no acceleration phase, so it finishes a little ahead of what
+// the adapter's motion model predicts. Like the real devices it drops a move
+// interrupted by a newer move or a stop without replying, and with bit 6 of
+// its mode set it echoes message IDs in byte 6. A move at velocity only
+// counts as moving until a stop or another move; it does not change the
+// position. Stored positions are answered from SetStoredPosition(). A fault
+// injected on the line damages the next reply sent, and RejectNext() has a
+// device answer its next command with an error.
+class SimulatedPort : public StandInCore
+{
+public:
+	static const int MaxDevice = 16;
+
+	enum Fault
+	{
+		NoFault,
+		LoseByte,  // the last byte of the reply never arrives
+		ExtraByte  // a copy of the first byte arrives ahead of the reply
+	};
+
+	SimulatedPort();
+
+	void SetReplyDelayUs(double delayUs) { replyDelayUs_ = delayUs; }
+	void SetSetting(long device, unsigned char setting, long value);
+	long Setting(long device, unsigned char setting);
+	void SetStoredPosition(long device, long index, long steps);
+	void RejectNext(long device, long errorCode);
+	long Position(long device);
+	bool IsMoving(long device);
+	void DropMoveReplies(bool drop) { dropMoveReplies_ = drop; }
+	long Writes() const { return writes_; }
+	void InjectFault(Fault fault);
+
+	int WriteToSerial(const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long length);
+	int ReadFromSerial(const MM::Device* caller, const char* port, unsigned char* buf, unsigned long length, unsigned long& read);
+
+private:
+	struct Axis
+	{
+		long settings[128];
+		long start;
+		long target;
+		double startUs;
+		double endUs;
+		long velocity; // of the last move at velocity
+		long stored[16];
+		long reject; // error code the next command is answered with, or 0
+	};
+	struct Reply
+	{
+		double dueUs;
+		bool move; // completes a move; dropped if the move is interrupted
+		unsigned char frame[6];
+	};
+
+	void Execute(long device, const unsigned char* frame, double nowUs);
+	void StartMove(long device, long target, unsigned char command, unsigned char id, double nowUs);
+	void DropMoves(long device);
+	void Queue(long device, unsigned char command, long data, unsigned char id, double dueUs, bool move);
+	long PositionAt(long device, double nowUs) const;
+
+	std::mutex lock_;
+	Axis axes_[MaxDevice + 1];
+	std::vector<Reply> replies_;
+	std::deque<unsigned char> rx_;
+	std::vector<unsigned char> partial_;
+	double replyDelayUs_;
+	bool dropMoveReplies_;
+	long writes_;
+	Fault fault_;
+};
+
+#endif //_ZABER_SIMULATED_PORT_H_
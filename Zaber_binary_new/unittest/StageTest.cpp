@@ -0,0 +1,267 @@
+// ZaberBinaryStage on the simulated port: settings shared across a port,
+// concurrent use, and the protocol options.
+
+#include "Check.h"
+#include "SimulatedPort.h"
+#include "../ZaberBinaryStage.h"
+#include <DeviceBase.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+	string Property(ZaberBinaryStage& stage, const char* name)
+	{
+		char value[MM::MaxStrLength] = "";
+		CHECK_EQUAL(DEVICE_OK, stage.GetProperty(name, value));
+		return value;
+	}
+
+	int WaitIdle(ZaberBinaryStage& stage)
+	{
+		for (int i = 0; i < 5000; i++)
+		{
+			if (!stage.Busy())
+			{
+				return DEVICE_OK;
+			}
+			CDeviceUtils::SleepMs(1);
+		}
+		return DEVICE_ERR;
+	}
+
+	// Keeps the stage polled, as the core does while waiting for it, so that
+	// commands held back by the port budget go out. Returns Busy().
+	bool Poll(ZaberBinaryStage& stage, int ms)
+	{
+		for (int i = 0; i < ms; i++)
+		{
+			stage.Busy();
+			CDeviceUtils::SleepMs(1);
+		}
+		return stage.Busy();
+	}
+
+	ZaberBinaryStage* OpenStage(SimulatedPort& port, const char* device, const char* messageIds = "No")
+	{
+		ZaberBinaryStage* stage = new ZaberBinaryStage();
+		stage->SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Controller Device Number", device));
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Message IDs", messageIds));
+		CHECK_EQUAL(DEVICE_OK, stage->Initialize());
+		return stage;
+	}
+
+	void CloseStage(ZaberBinaryStage* stage)
+	{
+		stage->Shutdown();
+		delete stage;
+	}
+
+	// Move(0) stops the axis when no jog is on, too: during a move to a
+	// position and during a home.
+	void ZeroVelocityStops(SimulatedPort& port)
+	{
+		ZaberBinaryStage* stage = OpenStage(port, "6");
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionUm(20000.0));
+		CHECK(Poll(*stage, 20));
+		CHECK(port.IsMoving(6));
+		CHECK_EQUAL(DEVICE_OK, stage->Move(0.0));
+		CDeviceUtils::SleepMs(5);
+		CHECK(!port.IsMoving(6));
+		CHECK(!stage->Busy());
+
+		CHECK_EQUAL(DEVICE_OK, stage->SetPositionUm(20000.0));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(DEVICE_OK, stage->Home());
+		CHECK(Poll(*stage, 20));
+		CHECK(port.IsMoving(6));
+		CHECK_EQUAL(DEVICE_OK, stage->Move(0.0));
+		CDeviceUtils::SleepMs(5);
+		CHECK(!port.IsMoving(6));
+		CHECK(port.Position(6) > 0);
+		CHECK(!stage->Busy());
+		CloseStage(stage);
+	}
+
+	// With message IDs the top data byte carries the ID: moves and settings
+	// still work, values beyond 24 bits are refused rather than cut short,
+	// and the device mode is put back on shutdown.
+	void MessageIds(SimulatedPort& port)
+	{
+		CHECK_EQUAL(0, port.Setting(5, 40));
+		ZaberBinaryStage* stage = OpenStage(port, "5", "Yes");
+		CHECK_EQUAL(64, port.Setting(5, 40));
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Position Resync Interval [ms]", "0"));
+
+		const double targets[] = { 1000.0, 250.0, 30000.0 };
+		for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++)
+		{
+			CHECK_EQUAL(DEVICE_OK, stage->SetPositionUm(targets[i]));
+			CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+			double pos = 0;
+			CHECK_EQUAL(DEVICE_OK, stage->GetPositionUm(pos));
+			CHECK(pos == targets[i]);
+		}
+		CHECK_EQUAL(DEVICE_OK, stage->SetRelativePositionUm(-500.0));
+		CHECK_EQUAL(DEVICE_OK, WaitIdle(*stage));
+		CHECK_EQUAL(nint(29500.0 / 0.15625), port.Position(5));
+
+		// settings are read back as often as the UI polls them
+		for (int i = 0; i < 50; i++)
+		{
+			CHECK(atof(Property(*stage, "Speed [mm/s]").c_str()) > 0);
+		}
+		CHECK_EQUAL(DEVICE_OK, stage->SetProperty("Speed [mm/s]", "5"));
+		long speed = port.Setting(5, 42);
+		CHECK(speed > 0 && speed < 0x800000);
+		// 1000 mm/s is more than 2^23 in data units
+		CHECK_EQUAL(ERR_SETTING_FAILED, stage->SetProperty("Speed [mm/s]", "1000"));
+		CHECK_EQUAL(speed, port.Setting(5, 42));
+
+		CloseStage(stage);
+		CHECK_EQUAL(0, port.Setting(5, 40));
+	}
+
+	// Port settings live in the port's scheduler: a stage shows what another
+	// one on the port has set, and a stage initialized later does not reset
+	// them.
+	void PortSettingsAreShared(SimulatedPort& port)
+	{
+		ZaberBinaryStage first, second;
+		first.SetCallback(&port);
+		second.SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, first.SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, second.SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, second.SetProperty("Controller Device Number", "2"));
+
+		CHECK_EQUAL(DEVICE_OK, first.Initialize());
+		CHECK_EQUAL(DEVICE_OK, first.SetProperty("Serial Queue Limit", "8"));
+		CHECK_EQUAL(DEVICE_OK, first.SetProperty("Device Command Interval [ms]", "2.5"));
+		CHECK_EQUAL(DEVICE_OK, first.SetProperty("Serial Session Recording File", "stage_test.zbsr"));
+
+		CHECK_EQUAL(DEVICE_OK, second.Initialize());
+		CHECK(Property(second, "Serial Queue Limit") == "8");
+		CHECK(atof(Property(second, "Device Command Interval [ms]").c_str()) == 2.5);
+		CHECK(Property(second, "Serial Session Recording File") == "stage_test.zbsr");
+
+		CHECK_EQUAL(DEVICE_OK, second.SetProperty("Device Input Buffer [frames]", "2"));
+		CHECK_EQUAL(DEVICE_OK, second.SetProperty("Serial Session Recording File", ""));
+		CHECK(Property(first, "Device Input Buffer [frames]") == "2");
+		CHECK(atof(Property(first, "Device Command Interval [ms]").c_str()) == 2.5);
+		CHECK(Property(first, "Serial Session Recording File") == "");
+
+		second.Shutdown();
+		first.Shutdown();
+		remove("stage_test.zbsr");
+	}
+
+	// Position reads racing moves: every estimate must lie on the way
+	// between the targets, never in some half-updated profile.
+	void PositionDuringMoves(SimulatedPort& port)
+	{
+		ZaberBinaryStage stage;
+		stage.SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Controller Device Number", "3"));
+		CHECK_EQUAL(DEVICE_OK, stage.Initialize());
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Position Resync Interval [ms]", "50"));
+
+		atomic<bool> moving(true);
+		atomic<long> outside(0), errors(0);
+		thread reader([&]()
+		{
+			while (moving)
+			{
+				double pos;
+				if (stage.GetPositionUm(pos) != DEVICE_OK)
+				{
+					errors++;
+				}
+				else if (pos < -0.5 || pos > 2000.5)
+				{
+					outside++;
+				}
+			}
+		});
+		for (int i = 0; i < 40; i++)
+		{
+			CHECK_EQUAL(DEVICE_OK, stage.SetPositionUm((i % 2) ? 2000.0 : 0.0));
+			CDeviceUtils::SleepMs(5);
+			if (i % 8 == 7)
+			{
+				CHECK_EQUAL(DEVICE_OK, stage.Stop());
+			}
+		}
+		moving = false;
+		reader.join();
+		CHECK_EQUAL(0, errors.load());
+		CHECK_EQUAL(0, outside.load());
+		stage.Shutdown();
+	}
+
+	// Stop() during a jog, with jog ticks going out on the engine's thread:
+	// no velocity command may follow the stop.
+	void StopDuringJog(SimulatedPort& port)
+	{
+		ZaberBinaryStage stage;
+		stage.SetCallback(&port);
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty(MM::g_Keyword_Port, "SIM"));
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Controller Device Number", "4"));
+		CHECK_EQUAL(DEVICE_OK, stage.Initialize());
+		CHECK_EQUAL(DEVICE_OK, stage.SetProperty("Jog Update Interval [ms]", "5"));
+
+		for (int i = 0; i < 20; i++)
+		{
+			CHECK_EQUAL(DEVICE_OK, stage.Move((i % 2) ? 0.5 : -0.5));
+			CDeviceUtils::SleepMs(3 + i % 7);
+			CHECK_EQUAL(DEVICE_OK, stage.Stop());
+			CDeviceUtils::SleepMs(20);
+			CHECK(!port.IsMoving(4));
+		}
+
+		// With slow replies a jog command is nearly always being sent; the
+		// stop must not wait for its reply before going out. Writing a frame
+		// at 9600 baud alone takes about 6 ms.
+		port.SetReplyDelayUs(30000.0);
+		double worstMs = 0;
+		for (int i = 0; i < 5; i++)
+		{
+			CHECK_EQUAL(DEVICE_OK, stage.Move(0.5 + 0.1 * i));
+			CDeviceUtils::SleepMs(12);
+			CHECK(port.IsMoving(4));
+			double start = port.NowUs();
+			thread stopper([&]() { CHECK_EQUAL(DEVICE_OK, stage.Stop()); });
+			while (port.IsMoving(4) && port.NowUs() - start < 1e6)
+			{
+				this_thread::yield();
+			}
+			double stoppedMs = (port.NowUs() - start) / 1000.0;
+			worstMs = (stoppedMs > worstMs) ? stoppedMs : worstMs;
+			stopper.join();
+			CHECK(!port.IsMoving(4));
+		}
+		port.SetReplyDelayUs(1000.0);
+		printf("  stop during a jog reached the device within %.1f ms\n", worstMs);
+		CHECK(worstMs < 25.0);
+		stage.Shutdown();
+	}
+}
+
+
+int main()
+{
+	SimulatedPort port;
+	PortSettingsAreShared(port);
+	PositionDuringMoves(port);
+	StopDuringJog(port);
+	MessageIds(port);
+	ZeroVelocityStops(port);
+	return CheckResult("StageTest");
+}
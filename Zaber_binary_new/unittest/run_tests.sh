@@ -0,0 +1,38 @@
+#!/bin/sh
+# Builds and runs the unit tests against the stand-in Micro-Manager headers
+# in standin/, so they need neither the Micro-Manager tree nor a device.
+# Every *Test.cpp is one test program, linked with the whole adapter.
+# Usage: run_tests.sh [test name...]; all tests by default.
+
+cd "$(dirname "$0")" || exit 1
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-std=c++11 -O2 -Wall -Wno-unused-variable -Wno-sign-compare -pthread"}
+OUT=${OUT:-build}
+
+mkdir -p "$OUT"
+objects=""
+for src in standin/StandIn.cpp SimulatedPort.cpp ../*.cpp ../../ZaberCommon/*.cpp; do
+	obj="$OUT/$(basename "$src" .cpp).o"
+	if [ ! -f "$obj" ] || [ "$src" -nt "$obj" ] || [ -n "$(find .. ../../ZaberCommon -name '*.h' -newer "$obj")" ]; then
+		$CXX $CXXFLAGS -Istandin -I.. -c "$src" -o "$obj" || exit 1
+	fi
+	objects="$objects $obj"
+done
+
+failed=0
+for src in *Test.cpp; do
+	name=$(basename "$src" .cpp)
+	if [ $# -gt 0 ] && ! echo " $* " | grep -q " $name "; then
+		continue
+	fi
+	echo "== $name"
+	if ! $CXX $CXXFLAGS -Istandin -I.. -o "$OUT/$name" "$src" $objects; then
+		echo "$name: build FAILED"
+		failed=$((failed + 1))
+		continue
+	fi
+	(cd "$OUT" && "./$name") || failed=$((failed + 1))
+done
+
+[ $failed -eq 0 ] && echo "all tests passed" || echo "$failed test(s) failed"
+exit $failed
@@ -0,0 +1,205 @@
+#ifndef _STANDIN_DEVICE_BASE_H_
+#define _STANDIN_DEVICE_BASE_H_
+
+// Stand-in for DeviceBase.h: the device base classes with a plain property
+// store, enough to initialize a device and read and set its properties from
+// a test.
+
+#include "MMDevice.h"
+#include <map>
+#include <math.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+inline long nint(double value)
+{
+	return (long) floor(value + 0.5);
+}
+
+class CDeviceUtils
+{
+public:
+	static bool CopyLimitedString(char* target, const char* source);
+	static void SleepMs(long ms);
+};
+
+template <class T>
+class MMPropAct : public MM::ActionFunctor
+{
+public:
+	MMPropAct(T* obj, int (T::*fpt)(MM::PropertyBase*, MM::ActionType)) : obj_(obj), fpt_(fpt) {}
+	int Execute(MM::PropertyBase* pProp, MM::ActionType eAct) { return (obj_->*fpt_)(pProp, eAct); }
+
+private:
+	T* obj_;
+	int (T::*fpt_)(MM::PropertyBase*, MM::ActionType);
+};
+
+template <class T>
+class MMPropActEx : public MM::ActionFunctor
+{
+public:
+	MMPropActEx(T* obj, int (T::*fpt)(MM::PropertyBase*, MM::ActionType, long), long data) : obj_(obj), fpt_(fpt), data_(data) {}
+	int Execute(MM::PropertyBase* pProp, MM::ActionType eAct) { return (obj_->*fpt_)(pProp, eAct, data_); }
+
+private:
+	T* obj_;
+	int (T::*fpt_)(MM::PropertyBase*, MM::ActionType, long);
+	long data_;
+};
+
+template <class U>
+class CDeviceBase : public MM::Device
+{
+public:
+	typedef MMPropAct<U> CPropertyAction;
+	typedef MMPropActEx<U> CPropertyActionEx;
+
+	CDeviceBase() : callback_(0) {}
+	~CDeviceBase()
+	{
+		for (typename std::map<std::string, Property>::iterator it = properties_.begin(); it != properties_.end(); it++)
+		{
+			delete it->second.action;
+		}
+	}
+
+	void SetCallback(MM::Core* callback) { callback_ = callback; }
+	MM::Core* GetCoreCallback() const { return callback_; }
+
+	int CreateProperty(const char* name, const char* value, MM::PropertyType /*type*/, bool readOnly, MM::ActionFunctor* action = 0, bool /*preInit*/ = false)
+	{
+		Property& prop = properties_[name];
+		prop.value.value_ = value;
+		prop.readOnly = readOnly;
+		prop.action = action;
+		return DEVICE_OK;
+	}
+	int CreateStringProperty(const char* name, const char* value, bool readOnly, MM::ActionFunctor* action = 0, bool preInit = false)
+	{
+		return CreateProperty(name, value, MM::String, readOnly, action, preInit);
+	}
+	int CreateIntegerProperty(const char* name, long value, bool readOnly, MM::ActionFunctor* action = 0, bool preInit = false)
+	{
+		std::ostringstream os;
+		os << value;
+		return CreateProperty(name, os.str().c_str(), MM::Integer, readOnly, action, preInit);
+	}
+	int CreateFloatProperty(const char* name, double value, bool readOnly, MM::ActionFunctor* action = 0, bool preInit = false)
+	{
+		std::ostringstream os;
+		os << value;
+		return CreateProperty(name, os.str().c_str(), MM::Float, readOnly, action, preInit);
+	}
+	int SetPropertyLimits(const char* name, double /*low*/, double /*high*/)
+	{
+		return HasProperty(name) ? DEVICE_OK : DEVICE_ERR;
+	}
+	int AddAllowedValue(const char* name, const char* /*value*/)
+	{
+		return HasProperty(name) ? DEVICE_OK : DEVICE_ERR;
+	}
+	bool HasProperty(const char* name) const
+	{
+		return properties_.find(name) != properties_.end();
+	}
+
+	int SetProperty(const char* name, const char* value)
+	{
+		typename std::map<std::string, Property>::iterator it = properties_.find(name);
+		if (it == properties_.end())
+		{
+			return DEVICE_ERR;
+		}
+		it->second.value.value_ = value;
+		return it->second.action != 0 ? it->second.action->Execute(&it->second.value, MM::AfterSet) : DEVICE_OK;
+	}
+	int GetProperty(const char* name, char* value)
+	{
+		typename std::map<std::string, Property>::iterator it = properties_.find(name);
+		if (it == properties_.end())
+		{
+			return DEVICE_ERR;
+		}
+		if (it->second.action != 0)
+		{
+			int ret = it->second.action->Execute(&it->second.value, MM::BeforeGet);
+			if (ret != DEVICE_OK)
+			{
+				return ret;
+			}
+		}
+		CDeviceUtils::CopyLimitedString(value, it->second.value.value_.c_str());
+		return DEVICE_OK;
+	}
+
+	int UpdateStatus()
+	{
+		char value[MM::MaxStrLength];
+		for (typename std::map<std::string, Property>::iterator it = properties_.begin(); it != properties_.end(); it++)
+		{
+			GetProperty(it->first.c_str(), value);
+		}
+		return DEVICE_OK;
+	}
+
+	void LogMessage(const char* msg, bool debugOnly = false) const
+	{
+		if (callback_ != 0)
+		{
+			callback_->LogMessage(this, msg, debugOnly);
+		}
+	}
+	void InitializeDefaultErrorMessages() {}
+	void SetErrorText(int code, const char* text) { errorText_[code] = text; }
+	int OnPropertyChanged(const char* name, const char* value)
+	{
+		return callback_ != 0 ? callback_->OnPropertyChanged(this, name, value) : DEVICE_OK;
+	}
+	MM::MMTime GetCurrentMMTime()
+	{
+		return callback_ != 0 ? callback_->GetCurrentMMTime() : MM::MMTime(0.0);
+	}
+	void GetLabel(char* label) const
+	{
+		CDeviceUtils::CopyLimitedString(label, "StandIn");
+	}
+
+private:
+	struct Property
+	{
+		Property() : readOnly(false), action(0) {}
+		MM::PropertyBase value;
+		bool readOnly;
+		MM::ActionFunctor* action;
+	};
+
+	MM::Core* callback_;
+	std::map<std::string, Property> properties_;
+	std::map<int, std::string> errorText_;
+};
+
+template <class U>
+class CStageBase : public CDeviceBase<U>
+{
+protected:
+	int OnStagePositionChanged(double pos)
+	{
+		MM::Core* callback = this->GetCoreCallback();
+		return callback != 0 ? callback->OnStagePositionChanged(this, pos) : DEVICE_OK;
+	}
+};
+
+template <class U>
+class CStateDeviceBase : public CDeviceBase<U>
+{
+public:
+	typedef CStateDeviceBase<U> CStateBase;
+
+	int OnLabel(MM::PropertyBase* /*pProp*/, MM::ActionType /*eAct*/) { return DEVICE_OK; }
+	int SetPositionLabel(long /*pos*/, const char* /*label*/) { return DEVICE_OK; }
+	int OnStateChanged(long /*pos*/) { return DEVICE_OK; }
+};
+
+#endif //_STANDIN_DEVICE_BASE_H_
@@ -0,0 +1,56 @@
+#ifndef _STANDIN_DEVICE_THREADS_H_
+#define _STANDIN_DEVICE_THREADS_H_
+
+// Stand-in for DeviceThreads.h on std::thread. MMThreadLock is recursive,
+// as the real one is.
+
+#include <mutex>
+#include <thread>
+
+class MMThreadLock
+{
+public:
+	void Lock() { mutex_.lock(); }
+	void Unlock() { mutex_.unlock(); }
+
+private:
+	std::recursive_mutex mutex_;
+};
+
+class MMThreadGuard
+{
+public:
+	MMThreadGuard(MMThreadLock& lock) : lock_(&lock) { lock_->Lock(); }
+	MMThreadGuard(MMThreadLock* lock) : lock_(lock) { lock_->Lock(); }
+	~MMThreadGuard() { lock_->Unlock(); }
+
+private:
+	MMThreadLock* lock_;
+};
+
+class MMDeviceThreadBase
+{
+public:
+	virtual ~MMDeviceThreadBase() {}
+	virtual int svc() = 0;
+
+	int activate()
+	{
+		thread_ = std::thread(&MMDeviceThreadBase::Run, this);
+		return 0;
+	}
+	void wait()
+	{
+		if (thread_.joinable())
+		{
+			thread_.join();
+		}
+	}
+
+private:
+	void Run() { svc(); }
+
+	std::thread thread_;
+};
+
+#endif //_STANDIN_DEVICE_THREADS_H_
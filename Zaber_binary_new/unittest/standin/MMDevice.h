@@ -0,0 +1,104 @@
+#ifndef _STANDIN_MMDEVICE_H_
+#define _STANDIN_MMDEVICE_H_
+
+// Stand-in for the parts of MMDevice.h the adapter uses, so that the unit
+// tests build without the Micro-Manager tree. As in the real API the core is
+// an interface; tests implement it with StandInCore.
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#define DEVICE_OK                        0
+#define DEVICE_ERR                       1
+#define DEVICE_NOT_SUPPORTED             3
+#define DEVICE_UNSUPPORTED_COMMAND       11
+#define DEVICE_SERIAL_COMMAND_FAILED     12
+#define DEVICE_SERIAL_INVALID_RESPONSE   20
+#define DEVICE_INVALID_INPUT_PARAM       21
+#define DEVICE_BUFFER_OVERFLOW           22
+#define DEVICE_NOT_CONNECTED             28
+#define DEVICE_UNKNOWN_POSITION          30
+
+namespace MM
+{
+	extern const char* g_Keyword_Name;
+	extern const char* g_Keyword_Description;
+	extern const char* g_Keyword_Port;
+	extern const char* g_Keyword_State;
+	extern const char* g_Keyword_Label;
+
+	const int MaxStrLength = 1024;
+
+	enum DeviceType { UnknownType, StageDevice, StateDevice };
+	enum PropertyType { Undef, String, Float, Integer };
+	enum ActionType { NoAction, BeforeGet, AfterSet };
+
+	class MMTime
+	{
+	public:
+		MMTime(double uSecTotal = 0.0)
+		{
+			sec_ = (long) (uSecTotal / 1.0e6);
+			uSec_ = (long) (uSecTotal - sec_ * 1.0e6);
+		}
+		MMTime(long sec, long uSec) : sec_(sec), uSec_(uSec) {}
+
+		MMTime operator+(const MMTime& other) const { return MMTime(getUsec() + other.getUsec()); }
+		MMTime operator-(const MMTime& other) const { return MMTime(getUsec() - other.getUsec()); }
+		bool operator<(const MMTime& other) const { return getUsec() < other.getUsec(); }
+		bool operator>(const MMTime& other) const { return getUsec() > other.getUsec(); }
+		bool operator<=(const MMTime& other) const { return getUsec() <= other.getUsec(); }
+		bool operator>=(const MMTime& other) const { return getUsec() >= other.getUsec(); }
+		double getMsec() const { return sec_ * 1.0e3 + uSec_ / 1.0e3; }
+		double getUsec() const { return sec_ * 1.0e6 + uSec_; }
+
+		long sec_;
+		long uSec_;
+	};
+
+	class Device
+	{
+	public:
+		virtual ~Device() {}
+	};
+
+	// A property value, kept as a string like the core does.
+	class PropertyBase
+	{
+	public:
+		bool Set(double value);
+		bool Set(long value);
+		bool Set(const char* value);
+		bool Get(double& value) const;
+		bool Get(long& value) const;
+		bool Get(std::string& value) const;
+
+		std::string value_;
+	};
+
+	class ActionFunctor
+	{
+	public:
+		virtual ~ActionFunctor() {}
+		virtual int Execute(PropertyBase* pProp, ActionType eAct) = 0;
+	};
+
+	class Core
+	{
+	public:
+		virtual ~Core() {}
+
+		virtual int LogMessage(const Device* caller, const char* msg, bool debugOnly) const = 0;
+		virtual int WriteToSerial(const Device* caller, const char* port, const unsigned char* buf, unsigned long length) = 0;
+		virtual int ReadFromSerial(const Device* caller, const char* port, unsigned char* buf, unsigned long length, unsigned long& read) = 0;
+		virtual MMTime GetCurrentMMTime() = 0;
+		virtual int GetDeviceProperty(const char* deviceName, const char* propName, char* value) = 0;
+		virtual int OnPropertyChanged(const Device* caller, const char* propName, const char* propValue) = 0;
+		virtual int OnStagePositionChanged(const Device* caller, double pos) = 0;
+	};
+}
+
+#endif //_STANDIN_MMDEVICE_H_
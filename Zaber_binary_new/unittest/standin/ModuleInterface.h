@@ -0,0 +1,10 @@
+#ifndef _STANDIN_MODULE_INTERFACE_H_
+#define _STANDIN_MODULE_INTERFACE_H_
+
+#include "MMDevice.h"
+
+#define MODULE_API
+
+void RegisterDevice(const char* name, MM::DeviceType type, const char* description);
+
+#endif //_STANDIN_MODULE_INTERFACE_H_
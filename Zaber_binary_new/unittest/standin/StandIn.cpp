@@ -0,0 +1,77 @@
+#include "MMDevice.h"
+#include "DeviceBase.h"
+#include "ModuleInterface.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const char* MM::g_Keyword_Name = "Name";
+const char* MM::g_Keyword_Description = "Description";
+const char* MM::g_Keyword_Port = "Port";
+const char* MM::g_Keyword_State = "State";
+const char* MM::g_Keyword_Label = "Label";
+
+
+bool MM::PropertyBase::Set(double value)
+{
+	std::ostringstream os;
+	os << value;
+	value_ = os.str();
+	return true;
+}
+
+
+bool MM::PropertyBase::Set(long value)
+{
+	std::ostringstream os;
+	os << value;
+	value_ = os.str();
+	return true;
+}
+
+
+bool MM::PropertyBase::Set(const char* value)
+{
+	value_ = value;
+	return true;
+}
+
+
+bool MM::PropertyBase::Get(double& value) const
+{
+	value = atof(value_.c_str());
+	return true;
+}
+
+
+bool MM::PropertyBase::Get(long& value) const
+{
+	value = atol(value_.c_str());
+	return true;
+}
+
+
+bool MM::PropertyBase::Get(std::string& value) const
+{
+	value = value_;
+	return true;
+}
+
+
+bool CDeviceUtils::CopyLimitedString(char* target, const char* source)
+{
+	strncpy(target, source, MM::MaxStrLength - 1);
+	target[MM::MaxStrLength - 1] = 0;
+	return strlen(source) < (size_t) MM::MaxStrLength;
+}
+
+
+void CDeviceUtils::SleepMs(long ms)
+{
+	usleep(ms * 1000);
+}
+
+
+void RegisterDevice(const char* /*name*/, MM::DeviceType /*type*/, const char* /*description*/)
+{
+}
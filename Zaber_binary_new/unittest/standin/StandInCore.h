@@ -0,0 +1,71 @@
+#ifndef _STANDIN_CORE_H_
+#define _STANDIN_CORE_H_
+
+// A core for the unit tests: a monotonic clock starting at 0 or at a
+// given origin, no serial port, and the log and position callbacks counted. Tests put a simulated
+// device behind the serial calls by overriding them.
+
+#include "MMDevice.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+class StandInCore : public MM::Core
+{
+public:
+	StandInCore(double originUs = 0.0) : start_(std::chrono::steady_clock::now()), originUs_(originUs), verbose_(false), positionReports_(0), lastPosition_(0.0) {}
+
+	void SetVerbose(bool verbose) { verbose_ = verbose; }
+	long PositionReports() const { return positionReports_; }
+	double LastPosition() const { return lastPosition_; }
+
+	double NowUs() const
+	{
+		return originUs_ + std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count();
+	}
+
+	int LogMessage(const MM::Device* /*caller*/, const char* msg, bool /*debugOnly*/) const
+	{
+		if (verbose_)
+		{
+			fprintf(stderr, "%.3f ms  %s\n", NowUs() / 1000.0, msg);
+		}
+		return DEVICE_OK;
+	}
+	int WriteToSerial(const MM::Device* /*caller*/, const char* /*port*/, const unsigned char* /*buf*/, unsigned long /*length*/)
+	{
+		return DEVICE_NOT_CONNECTED;
+	}
+	int ReadFromSerial(const MM::Device* /*caller*/, const char* /*port*/, unsigned char* /*buf*/, unsigned long /*length*/, unsigned long& read)
+	{
+		read = 0;
+		return DEVICE_NOT_CONNECTED;
+	}
+	MM::MMTime GetCurrentMMTime()
+	{
+		return MM::MMTime(NowUs());
+	}
+	int GetDeviceProperty(const char* /*deviceName*/, const char* /*propName*/, char* /*value*/)
+	{
+		return DEVICE_ERR;
+	}
+	int OnPropertyChanged(const MM::Device* /*caller*/, const char* /*propName*/, const char* /*propValue*/)
+	{
+		return DEVICE_OK;
+	}
+	int OnStagePositionChanged(const MM::Device* /*caller*/, double pos)
+	{
+		lastPosition_ = pos;
+		positionReports_++;
+		return DEVICE_OK;
+	}
+
+private:
+	std::chrono::steady_clock::time_point start_;
+	double originUs_;
+	bool verbose_;
+	std::atomic<long> positionReports_;
+	std::atomic<double> lastPosition_;
+};
+
+#endif //_STANDIN_CORE_H_